@@ -63,6 +63,18 @@
 
 #include "housemotion_feed.h"
 #include "housemotion_store.h"
+#include "housemotion_index.h"
+#include "housemotion_order.h"
+#include "housemotion_pack.h"
+#include "housemotion_pressure.h"
+#include "housemotion_capture.h"
+#include "housemotion_latency.h"
+#include "housemotion_event.h"
+#include "housemotion_stats.h"
+#include "housemotion_peer.h"
+#include "housemotion_admit.h"
+#include "housemotion_manifest.h"
+#include "housemotion_watchdog.h"
 
 static char HostName[256];
 
@@ -77,9 +89,16 @@ static const char *housemotion_check (const char *method, const char *uri,
                                       const char *data, int length) {
     static char buffer[1280];
 
-    snprintf (buffer, sizeof(buffer),
-              "{\"host\":\"%s\",\"timestamp\":%ld,\"updated\":%lld}",
-              HostName, (long)time(0), housemotion_update());
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%ld,\"updated\":%lld",
+                           HostName, (long)time(0), housemotion_update());
+
+    // Let the DVR know that recordings are about to be deleted.
+    char emergency[256];
+    if (housemotion_store_emergency (emergency, sizeof(emergency)))
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            ",%s", emergency);
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
     echttp_content_type_json ();
     return buffer;
 }
@@ -89,18 +108,74 @@ static const char *housemotion_status (const char *method, const char *uri,
     static char buffer[65537];
     int cursor = 0;
 
+    // When several DVRs poll at the same time, compute the status once.
+    const char *shared = housemotion_admit_shared ("/cctv/status");
+    if (shared) {
+        echttp_content_type_json ();
+        return shared;
+    }
+    if (!housemotion_admit_request ("/cctv/status")) return "";
+
     cursor += snprintf (buffer, sizeof(buffer),
                         "{\"host\":\"%s\",\"proxy\":\"%s\","
                             "\"timestamp\":%lld,\"updated\":%lld,\"cctv\":{",
                         HostName, houseportal_server(),
                             (long long)time(0), housemotion_update());
 
+    if (cursor >= sizeof(buffer)) goto overflow;
     cursor += housemotion_feed_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_event_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_latency_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
     cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
-    cursor += housemotion_store_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_pressure_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_watchdog_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_admit_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, ",");
+    if (cursor >= sizeof(buffer)) goto overflow;
+    cursor += housemotion_manifest_status (buffer+cursor, sizeof(buffer)-cursor);
+    if (cursor >= sizeof(buffer)) goto overflow;
+    char aggregate[256];
+    if (housemotion_peer_status (aggregate, sizeof(aggregate))) {
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            ",%s", aggregate);
+        if (cursor >= sizeof(buffer)) goto overflow;
+    }
+
+    // The store status ends with the list of all recordings, which is only
+    // limited by the space left: it must come last.
+    //
+    if (cursor + 1 >= sizeof(buffer)) goto overflow;
+    int store = housemotion_store_status (buffer+cursor+1,
+                                          sizeof(buffer)-cursor-1);
+    if (store > 0) {
+        buffer[cursor] = ',';
+        cursor += store + 1;
+        if (cursor >= sizeof(buffer)) goto overflow;
+    }
     cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    if (cursor >= sizeof(buffer)) goto overflow;
     echttp_content_type_json ();
-    return buffer;
+    return housemotion_admit_save ("/cctv/status", buffer);
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    echttp_error (500, "Status too large");
+    return "";
 }
 
 static void housemotion_background (int fd, int mode) {
@@ -108,18 +183,49 @@ static void housemotion_background (int fd, int mode) {
     static time_t LastCall = 0;
     time_t now = time(0);
 
-    if (LastCall >= now) return; // Process only once per second.
+    // The storage walk, the picture packing, the manifests hashing and the
+    // emergency cleanup are done in short slices, so that the Motion hooks
+    // are processed in between: resume them as often as possible.
+    //
+    housemotion_watchdog_step ("index refresh");
+    housemotion_index_refresh (now);
+    housemotion_watchdog_step ("pack");
+    housemotion_pack_refresh ();
+    housemotion_watchdog_step ("manifest");
+    housemotion_manifest_background ();
+    housemotion_watchdog_step ("emergency");
+    housemotion_store_refresh ();
+
+    if (LastCall >= now) {
+        housemotion_watchdog_idle ();
+        return; // Process only once per second.
+    }
     LastCall = now;
 
+    housemotion_watchdog_step ("portal");
     houseportal_background (now);
+    housemotion_pressure_background(now);
+    housemotion_admit_background(now);
+    housemotion_watchdog_background(now);
+    housemotion_watchdog_step ("store");
     housemotion_store_background(now);
+    housemotion_watchdog_step ("feed");
     housemotion_feed_background(now);
+    housemotion_watchdog_step ("event");
+    housemotion_event_background(now);
 
+    housemotion_watchdog_step ("discovery");
     housediscover (now);
+    housemotion_watchdog_step ("peers");
+    housemotion_peer_background(now);
+    housemotion_watchdog_step ("log");
     houselog_background (now);
+    housemotion_watchdog_idle ();
 }
 
 static void housemotion_protect (const char *method, const char *uri) {
+    housemotion_watchdog_step (uri);
+    housemotion_capture_request (method, uri);
     echttp_cors_protect(method, uri);
 }
 
@@ -150,14 +256,26 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, housemotion_protect);
 
+    housemotion_capture_initialize (argc, argv);
+    housemotion_admit_initialize (argc, argv);
+    housemotion_pressure_initialize (argc, argv);
+    housemotion_index_initialize (argc, argv);
+    housemotion_order_initialize (argc, argv);
+    housemotion_latency_initialize (argc, argv);
+    housemotion_pack_initialize (argc, argv);
     housemotion_feed_initialize (argc, argv);
     housemotion_store_initialize (argc, argv);
+    housemotion_manifest_initialize (argc, argv);
+    housemotion_event_initialize (argc, argv);
+    housemotion_stats_initialize (argc, argv);
+    housemotion_peer_initialize (argc, argv);
 
     echttp_route_uri ("/cctv/check", housemotion_check);
     echttp_route_uri ("/cctv/status", housemotion_status);
     echttp_static_route ("/", "/usr/local/share/house/public");
 
     echttp_background (&housemotion_background);
+    housemotion_watchdog_initialize (argc, argv);
 
     houselog_event ("SERVICE", "cctv", "START", "ON %s", HostName);
     echttp_loop();
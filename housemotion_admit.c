@@ -0,0 +1,255 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_admit.c - Protect the service against request bursts.
+ *
+ * SYNOPSYS:
+ *
+ * When several DVRs restart at the same time, they all request the
+ * status and the recordings list at once. Each of these requests is
+ * expensive, and the service stalls while computing the same response
+ * over and over.
+ *
+ * This module provides two protections for the expensive endpoints:
+ *
+ * - Identical requests received within the same short period share one
+ *   computation: the first request computes the response, which is then
+ *   returned as-is to the following requests. A request is identified by
+ *   a key built from its parameters: a key too long to be kept is never
+ *   shared, since two different requests could then look the same.
+ *
+ * - The number of expensive computations is limited for each endpoint
+ *   (--motion-admit, per second), so that a burst on one endpoint does
+ *   not block the others. Beyond that limit, the request is rejected with
+ *   a 503 status and a Retry-After header.
+ *
+ * The cheap endpoints (check, Motion hooks, downloads) never go through
+ * this module.
+ *
+ * void housemotion_admit_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * const char *housemotion_admit_shared (const char *key);
+ *
+ *    Return the response recently computed for the same request (as
+ *    identified by the key), or 0 if there is none. A key of 0 designates
+ *    a request that must not be shared.
+ *
+ * int housemotion_admit_request (const char *endpoint);
+ *
+ *    Return 1 if an expensive computation is allowed now for this
+ *    endpoint. If not, the HTTP error is set and 0 is returned.
+ *
+ * const char *housemotion_admit_save (const char *key,
+ *                                     const char *response);
+ *
+ *    Keep a copy of a computed response for the following identical
+ *    requests, unless the key is 0 or too long. Return the response, for
+ *    convenience.
+ *
+ * void housemotion_admit_background (time_t now);
+ *
+ *    Release the copies of the responses under memory pressure.
+ *
+ * int housemotion_admit_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the admission statistics.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_pressure.h"
+#include "housemotion_admit.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_ADMIT_SHARED 8
+#define MOTION_ADMIT_WINDOW 1 // Second.
+#define MOTION_ADMIT_KEY    512
+
+typedef struct {
+    char   key[MOTION_ADMIT_KEY];
+    char  *response;
+    time_t saved;
+} MotionSharedResponse;
+
+static MotionSharedResponse HouseMotionShared[MOTION_ADMIT_SHARED];
+static int HouseMotionSharedCursor = 0;
+
+// There are only a few expensive endpoints, each with its own budget.
+//
+#define MOTION_ADMIT_ENDPOINTS 8
+
+typedef struct {
+    const char *endpoint;
+    int    tokens;
+    time_t refill;
+} MotionAdmitBucket;
+
+static MotionAdmitBucket HouseMotionAdmitBuckets[MOTION_ADMIT_ENDPOINTS];
+static int HouseMotionAdmitBucketsCount = 0;
+
+static int HouseMotionAdmitRate = 4; // Computations per second.
+
+static long long HouseMotionAdmitComputed = 0;
+static long long HouseMotionAdmitShared = 0;
+static long long HouseMotionAdmitRejected = 0;
+
+const char *housemotion_admit_shared (const char *key) {
+
+    int i;
+    time_t now = time(0);
+
+    if ((!key) || (strlen(key) >= MOTION_ADMIT_KEY)) return 0;
+
+    for (i = 0; i < MOTION_ADMIT_SHARED; ++i) {
+        MotionSharedResponse *shared = HouseMotionShared + i;
+        if (!shared->response) continue;
+        if (now >= shared->saved + MOTION_ADMIT_WINDOW) continue;
+        if (strcmp (shared->key, key)) continue;
+        HouseMotionAdmitShared += 1;
+        return shared->response;
+    }
+    return 0;
+}
+
+// The endpoint names are constant strings.
+//
+static MotionAdmitBucket *housemotion_admit_bucket (const char *endpoint) {
+
+    int i;
+    for (i = 0; i < HouseMotionAdmitBucketsCount; ++i) {
+        if (!strcmp (HouseMotionAdmitBuckets[i].endpoint, endpoint))
+            return HouseMotionAdmitBuckets + i;
+    }
+    if (HouseMotionAdmitBucketsCount >= MOTION_ADMIT_ENDPOINTS) return 0;
+
+    MotionAdmitBucket *bucket =
+        HouseMotionAdmitBuckets + (HouseMotionAdmitBucketsCount++);
+    bucket->endpoint = endpoint;
+    bucket->tokens = HouseMotionAdmitRate;
+    bucket->refill = 0;
+    return bucket;
+}
+
+int housemotion_admit_request (const char *endpoint) {
+
+    time_t now = time(0);
+
+    if (!HouseMotionAdmitRate) return 1;
+
+    MotionAdmitBucket *bucket = housemotion_admit_bucket (endpoint);
+    if (!bucket) return 1; // Not a registered expensive endpoint.
+
+    if (now != bucket->refill) {
+        bucket->tokens = HouseMotionAdmitRate;
+        bucket->refill = now;
+    }
+    if (bucket->tokens <= 0) {
+        HouseMotionAdmitRejected += 1;
+        echttp_attribute_set ("Retry-After", "1");
+        echttp_error (503, "Overloaded");
+        return 0;
+    }
+    bucket->tokens -= 1;
+    HouseMotionAdmitComputed += 1;
+    return 1;
+}
+
+const char *housemotion_admit_save (const char *key, const char *response) {
+
+    int i;
+    MotionSharedResponse *shared = 0;
+
+    if ((!key) || (strlen(key) >= MOTION_ADMIT_KEY)) return response;
+
+    for (i = 0; i < MOTION_ADMIT_SHARED; ++i) {
+        if (!strcmp (HouseMotionShared[i].key, key)) {
+            shared = HouseMotionShared + i;
+            break;
+        }
+    }
+    if (!shared) {
+        shared = HouseMotionShared + HouseMotionSharedCursor;
+        if (++HouseMotionSharedCursor >= MOTION_ADMIT_SHARED)
+            HouseMotionSharedCursor = 0;
+        snprintf (shared->key, sizeof(shared->key), "%s", key);
+    }
+    free (shared->response);
+    shared->response = strdup (response);
+    shared->saved = time(0);
+    return response;
+}
+
+void housemotion_admit_background (time_t now) {
+
+    int i;
+    int kept = 0;
+
+    for (i = 0; i < MOTION_ADMIT_SHARED; ++i) {
+        if (HouseMotionShared[i].response) kept = 1;
+    }
+    if (!kept) return;
+    if (!housemotion_pressure_shrink ()) return;
+
+    for (i = 0; i < MOTION_ADMIT_SHARED; ++i) {
+        free (HouseMotionShared[i].response);
+        HouseMotionShared[i].response = 0;
+    }
+}
+
+int housemotion_admit_status (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size,
+                           "\"admission\":{\"rate\":%d,\"computed\":%lld,"
+                               "\"shared\":%lld,\"rejected\":%lld}",
+                           HouseMotionAdmitRate, HouseMotionAdmitComputed,
+                           HouseMotionAdmitShared, HouseMotionAdmitRejected);
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+void housemotion_admit_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *rate = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-admit=", argv[i], &rate);
+    }
+    if (rate) {
+        HouseMotionAdmitRate = atoi (rate);
+        if (HouseMotionAdmitRate < 0) HouseMotionAdmitRate = 0;
+    }
+}
@@ -0,0 +1,31 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_admit.h - Protect the service against request bursts.
+ */
+void housemotion_admit_initialize (int argc, const char **argv);
+
+const char *housemotion_admit_shared (const char *key);
+int  housemotion_admit_request (const char *endpoint);
+const char *housemotion_admit_save (const char *key, const char *response);
+void housemotion_admit_background (time_t now);
+
+int  housemotion_admit_status (char *buffer, int size);
@@ -0,0 +1,118 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_capture.c - Record the HTTP requests received, for replay.
+ *
+ * SYNOPSYS:
+ *
+ * This module records every HTTP request received (Motion hooks and
+ * clients requests) with its time of arrival, so that a real traffic
+ * pattern can later be replayed against a test instance (see
+ * test/housemotion_replay.c).
+ *
+ * The capture is enabled using the --motion-capture=FILE option. Each
+ * request is recorded as one line of text:
+ *
+ *    <seconds>.<microseconds> <method> <uri>[?<parameters>]
+ *
+ * void housemotion_capture_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_capture_request (const char *method, const char *uri);
+ *
+ *    Record one request. This must be called while the request is being
+ *    processed, so that its parameters are accessible.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "housemotion_capture.h"
+
+static FILE *HouseMotionCapture = 0;
+
+// The parameters used by the HouseMotion web API. Any parameter that is
+// not listed here is not recorded, and would be missing on replay: this
+// list must be extended whenever an endpoint accepts a new parameter.
+//
+static const char *HouseMotionCaptureParameters[] = {
+    "event", "camera", "file", "stage", "since", "until", "before", "count",
+    "sort", "order", "offset", "length",
+    0
+};
+
+// Escape the few characters that would break the request line.
+//
+static void housemotion_capture_encode (FILE *out, const char *value) {
+    for (; *value; ++value) {
+        unsigned char c = (unsigned char)(*value);
+        if ((c <= ' ') || (c == '%') || (c == '&') || (c == '+') || (c >= 127))
+            fprintf (out, "%%%02X", c);
+        else
+            fputc (c, out);
+    }
+}
+
+void housemotion_capture_request (const char *method, const char *uri) {
+
+    if (!HouseMotionCapture) return;
+
+    struct timeval now;
+    gettimeofday (&now, 0);
+    fprintf (HouseMotionCapture, "%lld.%06d %s ",
+             (long long)(now.tv_sec), (int)(now.tv_usec), method);
+    housemotion_capture_encode (HouseMotionCapture, uri);
+
+    const char *sep = "?";
+    int i;
+    for (i = 0; HouseMotionCaptureParameters[i]; ++i) {
+        const char *value =
+            echttp_parameter_get (HouseMotionCaptureParameters[i]);
+        if (!value) continue;
+        fprintf (HouseMotionCapture, "%s%s=", sep, HouseMotionCaptureParameters[i]);
+        housemotion_capture_encode (HouseMotionCapture, value);
+        sep = "&";
+    }
+    fputc ('\n', HouseMotionCapture);
+}
+
+void housemotion_capture_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *capture = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-capture=", argv[i], &capture);
+    }
+    if (!capture) return;
+
+    HouseMotionCapture = fopen (capture, "a");
+    if (!HouseMotionCapture) {
+        houselog_trace (HOUSE_FAILURE, "CAPTURE", "cannot open %s", capture);
+        return;
+    }
+    setvbuf (HouseMotionCapture, 0, _IOLBF, 0);
+}
@@ -0,0 +1,125 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_dirent.c - Read large directories efficiently.
+ *
+ * SYNOPSYS:
+ *
+ * Motion may store tens of thousands of pictures per day in the same
+ * directory. The readdir(3) function reads the directory entries using
+ * a small buffer, which means hundreds of system calls for each such
+ * directory. This module reads the entries directly, using getdents64(2)
+ * with a large buffer that is reused for every directory.
+ *
+ * The entry type reported by the file system is trusted, so that no
+ * stat(2) call is needed to tell files from subdirectories. The type is
+ * only checked when the file system does not report it (DT_UNKNOWN).
+ *
+ * Only the regular files and directories are reported, and the names
+ * that start with '.' are ignored.
+ *
+ * int housemotion_dirent_scan (const char *path,
+ *                              housemotion_dirent_listener *listener,
+ *                              void *context);
+ *
+ *    Call the listener for each entry in the specified directory, until
+ *    the listener returns a non-zero value. Return -1 if the directory
+ *    could not be read, 0 otherwise.
+ *
+ * The buffer is shared: this must only be called from the main thread.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "housemotion_dirent.h"
+
+#define MOTION_DIRENT_BUFFER (256 * 1024)
+
+struct housemotion_dirent64 {
+    unsigned long long d_ino;
+    long long          d_off;
+    unsigned short     d_reclen;
+    unsigned char      d_type;
+    char               d_name[];
+};
+
+static char *HouseMotionDirentBuffer = 0;
+
+static int housemotion_dirent_type (int fd, const char *name,
+                                    unsigned char type) {
+
+    if (type == DT_UNKNOWN) {
+        struct stat filestat;
+        if (fstatat (fd, name, &filestat, AT_SYMLINK_NOFOLLOW)) return 0;
+        if (S_ISREG(filestat.st_mode)) return HOUSEMOTION_DIRENT_FILE;
+        if (S_ISDIR(filestat.st_mode)) return HOUSEMOTION_DIRENT_DIR;
+        return 0;
+    }
+    if (type == DT_REG) return HOUSEMOTION_DIRENT_FILE;
+    if (type == DT_DIR) return HOUSEMOTION_DIRENT_DIR;
+    return 0;
+}
+
+int housemotion_dirent_scan (const char *path,
+                             housemotion_dirent_listener *listener,
+                             void *context) {
+
+    if (!HouseMotionDirentBuffer) {
+        HouseMotionDirentBuffer = malloc (MOTION_DIRENT_BUFFER);
+        if (!HouseMotionDirentBuffer) return -1;
+    }
+    int fd = open (path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    for (;;) {
+        long length = syscall (SYS_getdents64, fd,
+                               HouseMotionDirentBuffer, MOTION_DIRENT_BUFFER);
+        if (length < 0) {
+            close (fd);
+            return -1;
+        }
+        if (length == 0) break;
+
+        long offset = 0;
+        while (offset < length) {
+            struct housemotion_dirent64 *entry =
+                (struct housemotion_dirent64 *)(HouseMotionDirentBuffer + offset);
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.') continue;
+
+            int type = housemotion_dirent_type (fd, entry->d_name, entry->d_type);
+            if (!type) continue;
+            if (listener (entry->d_name, type, context)) {
+                close (fd);
+                return 0;
+            }
+        }
+    }
+    close (fd);
+    return 0;
+}
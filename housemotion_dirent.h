@@ -0,0 +1,32 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_dirent.h - Read large directories efficiently.
+ */
+#define HOUSEMOTION_DIRENT_FILE 1
+#define HOUSEMOTION_DIRENT_DIR  2
+
+typedef int housemotion_dirent_listener (const char *name, int type,
+                                         void *context);
+
+int housemotion_dirent_scan (const char *path,
+                             housemotion_dirent_listener *listener,
+                             void *context);
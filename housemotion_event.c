@@ -0,0 +1,647 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_event.c - An in-memory index of the Motion events.
+ *
+ * SYNOPSYS:
+ *
+ * This module keeps the most recent Motion events (as received through
+ * the Motion hooks) in memory, so that they can be queried by camera,
+ * stage and time range, one page at a time. This avoids loading the whole
+ * event history when only the most recent events are of interest.
+ *
+ * Each event is assigned a sequence number, which is used as the page
+ * cursor: a page is requested relative to a sequence number, so that
+ * new events arriving between two queries do not shift the pages.
+ *
+ * void housemotion_event_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_event_add (const char *camera,
+ *                             const char *stage, const char *text);
+ *
+ *    Record a new event. The oldest event is forgotten when the index
+ *    is full.
+ *
+ * void housemotion_event_start (const char *camera, const char *event);
+ * int  housemotion_event_end   (const char *camera, const char *event,
+ *                               time_t *start);
+ *
+ *    Track the events in progress, from the Motion start and end hooks.
+ *    An event end is paired with its start using the event text, or else
+ *    the camera. The end returns the number of files recorded and the
+ *    start time of the event (both 0 if the start was not seen).
+ *
+ * const char *housemotion_event_file (const char *path, long long size);
+ *
+ *    Account for a new recording file, if it belongs to an active event.
+ *    Return the camera of that event, or 0 if no active event matches.
+ *
+ * int housemotion_event_active (const char *path);
+ *
+ *    Return 1 if the file belongs to an event in progress. Such a file
+ *    is still being produced and must not be deleted or downloaded.
+ *
+ * void housemotion_event_background (time_t now);
+ *
+ *    Forget the active events for which no end was ever received. Under
+ *    memory pressure, forget the posters of the events that are no
+ *    longer listed.
+ *
+ * int housemotion_event_status (char *buffer, int size);
+ *
+ *    Populate a JSON list of the events in progress.
+ *
+ * Each event is given a poster: one representative picture, chosen
+ * without decoding any image as the largest JPEG file of the event. The
+ * posters are tracked as the pictures are added to the index or to the
+ * packs (see housemotion_index_listen()), so that no request ever walks
+ * the recordings. The pictures of an event share the same name, minus
+ * the extension and frame number. Only the posters of the most recent
+ * events are kept.
+ *
+ * The events can be queried using the following request:
+ *
+ *    GET /cctv/events?camera=ID&stage=NAME&since=TIME&until=TIME
+ *                    &before=SEQUENCE&count=INTEGER
+ *
+ * All parameters are optional. The events are listed from the most
+ * recent to the oldest. The "next" item in the response is the value of
+ * the "before" parameter to use to retrieve the next page (if any).
+ *
+ * The poster of an event is retrieved using the following request:
+ *
+ *    GET /cctv/events/SEQUENCE/poster
+ *
+ * where SEQUENCE identifies any entry for that event in the events list.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_index.h"
+#include "housemotion_pack.h"
+#include "housemotion_pressure.h"
+#include "housemotion_store.h"
+#include "housemotion_event.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+struct HouseMotionEventRecord {
+    long long sequence;
+    time_t    timestamp;
+    char      camera[32];
+    char      stage[8];
+    char      text[160];
+};
+
+#define MOTION_EVENT_INDEX_DEFAULT 4096
+#define MOTION_EVENT_PAGE_DEFAULT 50
+#define MOTION_EVENT_PAGE_MAX 500
+
+static struct HouseMotionEventRecord *HouseMotionEventIndex = 0;
+static int HouseMotionEventIndexSize = MOTION_EVENT_INDEX_DEFAULT;
+static long long HouseMotionEventNext = 1;
+
+static char HouseMotionEventHost[256];
+
+// The events in progress. There is typically at most one per camera.
+// An event for which no end was received is forgotten after a while,
+// in case Motion was restarted or a notification was lost.
+//
+struct HouseMotionActiveEvent {
+    time_t    start;
+    time_t    activity;
+    int       files;
+    long long bytes;
+    char      camera[32];
+    char      id[128];
+};
+
+#define MOTION_ACTIVE_MAX 32
+#define MOTION_ACTIVE_TIMEOUT 3600
+
+static struct HouseMotionActiveEvent HouseMotionActive[MOTION_ACTIVE_MAX];
+static int HouseMotionActiveCount = 0;
+
+// The posters of the most recent events, found in a hash table using the
+// event name: the start of the poster's path, up to key characters.
+//
+struct HouseMotionPoster {
+    char     *path; // Relative to the storage root, 0 if the entry is free.
+    int       key;
+    long long size;
+    time_t    mtime;
+    int       next; // Next entry in the same hash bucket.
+};
+
+#define MOTION_POSTER_MAX 2048
+#define MOTION_POSTER_BUCKETS 4093
+
+// The pictures of a recent event may not have been indexed yet: request
+// a storage walk (see --motion-scan-period).
+//
+#define MOTION_POSTER_RECENT 600
+
+static struct HouseMotionPoster HouseMotionPosters[MOTION_POSTER_MAX];
+static int HouseMotionPosterBuckets[MOTION_POSTER_BUCKETS];
+static int HouseMotionPosterCount = 0;
+
+// The event text comes from the Motion hooks: make sure it cannot break
+// the JSON syntax.
+//
+static void housemotion_event_copy (char *dest, const char *src, int size) {
+
+    int i;
+    for (i = 0; (i < size - 1) && src[i]; ++i) {
+        char c = src[i];
+        dest[i] = ((c < ' ') || (c == '"') || (c == '\\')) ? '_' : c;
+    }
+    dest[i] = 0;
+}
+
+void housemotion_event_add (const char *camera,
+                            const char *stage, const char *text) {
+
+    if (!HouseMotionEventIndex) return;
+
+    struct HouseMotionEventRecord *record =
+        HouseMotionEventIndex
+            + (HouseMotionEventNext % HouseMotionEventIndexSize);
+
+    record->sequence = HouseMotionEventNext++;
+    record->timestamp = time(0);
+    housemotion_event_copy (record->camera, camera?camera:"", sizeof(record->camera));
+    housemotion_event_copy (record->stage, stage, sizeof(record->stage));
+    housemotion_event_copy (record->text, text?text:"", sizeof(record->text));
+}
+
+static int housemotion_event_search (const char *camera, const char *event) {
+
+    int i;
+    for (i = HouseMotionActiveCount - 1; i >= 0; --i) {
+        if (!strcmp (HouseMotionActive[i].id, event)) return i;
+    }
+    if (camera) {
+        for (i = HouseMotionActiveCount - 1; i >= 0; --i) {
+            if (!strcmp (HouseMotionActive[i].camera, camera)) return i;
+        }
+    }
+    return -1;
+}
+
+static void housemotion_event_forget (int i) {
+    HouseMotionActiveCount -= 1;
+    if (i < HouseMotionActiveCount) {
+        memmove (HouseMotionActive+i, HouseMotionActive+i+1,
+                 (HouseMotionActiveCount - i) * sizeof(HouseMotionActive[0]));
+    }
+}
+
+void housemotion_event_start (const char *camera, const char *event) {
+
+    time_t now = time(0);
+
+    // A new start on the same camera means that the previous end was lost.
+    int i = housemotion_event_search (camera, event);
+    if (i >= 0) housemotion_event_forget (i);
+    if (HouseMotionActiveCount >= MOTION_ACTIVE_MAX)
+        housemotion_event_forget (0); // Drop the oldest.
+
+    struct HouseMotionActiveEvent *active =
+        HouseMotionActive + (HouseMotionActiveCount++);
+    active->start = now;
+    active->activity = now;
+    active->files = 0;
+    active->bytes = 0;
+    housemotion_event_copy (active->camera, camera?camera:"", sizeof(active->camera));
+    housemotion_event_copy (active->id, event, sizeof(active->id));
+}
+
+int housemotion_event_end (const char *camera, const char *event,
+                           time_t *start) {
+
+    int files = 0;
+    *start = 0;
+    int i = housemotion_event_search (camera, event);
+    if (i >= 0) {
+        files = HouseMotionActive[i].files;
+        *start = HouseMotionActive[i].start;
+        housemotion_event_forget (i);
+    }
+    return files;
+}
+
+// The Motion event text is part of the name of the files recorded
+// for this event (see the README file).
+//
+static int housemotion_event_owner (const char *path) {
+    int i;
+    for (i = HouseMotionActiveCount - 1; i >= 0; --i) {
+        if (strstr (path, HouseMotionActive[i].id)) return i;
+    }
+    return -1;
+}
+
+// A poster is picked by name and size only: no image is ever decoded.
+//
+static int housemotion_event_picture (const char *path) {
+    const char *extension = strrchr (path, '.');
+    if (!extension) return 0;
+    return (!strcasecmp (extension, ".jpg")) ||
+           (!strcasecmp (extension, ".jpeg"));
+}
+
+const char *housemotion_event_file (const char *path, long long size) {
+
+    int i = housemotion_event_owner (path);
+    if (i < 0) return 0;
+    struct HouseMotionActiveEvent *active = HouseMotionActive + i;
+    active->files += 1;
+    active->bytes += size;
+    active->activity = time(0);
+    return HouseMotionActive[i].camera[0] ? HouseMotionActive[i].camera : 0;
+}
+
+int housemotion_event_active (const char *path) {
+    if (!HouseMotionActiveCount) return 0;
+    return housemotion_event_owner (path) >= 0;
+}
+
+// The event name is the picture's name, minus the extension and the
+// frame number, if any.
+//
+static int housemotion_event_key (const char *relative) {
+    const char *dot = strrchr (relative, '.');
+    int key = dot ? (int)(dot - relative) : (int)strlen(relative);
+    int end = key;
+    while ((end > 0) && isdigit((unsigned char)relative[end-1])) end -= 1;
+    if ((end < key) && (end > 1) && (relative[end-1] == '-')) key = end - 1;
+    return key;
+}
+
+static unsigned int housemotion_event_hash (const char *name, int length) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; ++i) {
+        hash ^= (unsigned char)(name[i]);
+        hash *= 16777619u;
+    }
+    return hash % MOTION_POSTER_BUCKETS;
+}
+
+static int housemotion_event_poster_find (const char *name, int length) {
+    int i = HouseMotionPosterBuckets[housemotion_event_hash (name, length)];
+    while (i >= 0) {
+        const struct HouseMotionPoster *poster = HouseMotionPosters + i;
+        if ((poster->key == length) && (!strncmp (poster->path, name, length)))
+            return i;
+        i = poster->next;
+    }
+    return -1;
+}
+
+static void housemotion_event_poster_release (int i) {
+    struct HouseMotionPoster *poster = HouseMotionPosters + i;
+    int *link = HouseMotionPosterBuckets
+                    + housemotion_event_hash (poster->path, poster->key);
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = poster->next;
+            break;
+        }
+        link = &(HouseMotionPosters[*link].next);
+    }
+    free (poster->path);
+    poster->path = 0;
+    HouseMotionPosterCount -= 1;
+}
+
+// When the table is full, the poster of the oldest event is forgotten,
+// unless the new picture is even older.
+//
+static int housemotion_event_poster_new (time_t mtime) {
+
+    int i;
+    int oldest = -1;
+    for (i = 0; i < MOTION_POSTER_MAX; ++i) {
+        const struct HouseMotionPoster *poster = HouseMotionPosters + i;
+        if (!poster->path) return i;
+        if ((oldest < 0) || (poster->mtime < HouseMotionPosters[oldest].mtime))
+            oldest = i;
+    }
+    if (HouseMotionPosters[oldest].mtime > mtime) return -1;
+    housemotion_event_poster_release (oldest);
+    return oldest;
+}
+
+static void housemotion_event_indexed (int root, const char *relative,
+                                       const HouseMotionFile *file,
+                                       const HouseMotionFile *previous) {
+
+    if (!file) return; // A deleted poster is reported as not found.
+    if (!housemotion_event_picture (relative)) return;
+
+    int key = housemotion_event_key (relative);
+    int i = housemotion_event_poster_find (relative, key);
+    if (i >= 0) {
+        struct HouseMotionPoster *poster = HouseMotionPosters + i;
+        if (file->mtime > poster->mtime) poster->mtime = file->mtime;
+        if (file->size <= poster->size) return;
+        if (strcmp (poster->path, relative)) {
+            free (poster->path);
+            poster->path = strdup (relative);
+        }
+        poster->size = file->size;
+        return;
+    }
+    if (HouseMotionPosterCount >= MOTION_POSTER_MAX) {
+        i = housemotion_event_poster_new (file->mtime);
+        if (i < 0) return;
+    } else {
+        i = housemotion_event_poster_new (0);
+    }
+    struct HouseMotionPoster *poster = HouseMotionPosters + i;
+    poster->path = strdup (relative);
+    poster->key = key;
+    poster->size = file->size;
+    poster->mtime = file->mtime;
+    unsigned int bucket = housemotion_event_hash (relative, key);
+    poster->next = HouseMotionPosterBuckets[bucket];
+    HouseMotionPosterBuckets[bucket] = i;
+    HouseMotionPosterCount += 1;
+}
+
+// The event text is normally the name of the event's files (see the
+// README file): look for that name first, and then for any poster that
+// contains the event text.
+//
+static const char *housemotion_event_poster_search (const char *id,
+                                                    time_t timestamp) {
+
+    int i = housemotion_event_poster_find (id, strlen(id));
+    if (i >= 0) return HouseMotionPosters[i].path;
+
+    for (i = 0; i < MOTION_POSTER_MAX; ++i) {
+        const char *path = HouseMotionPosters[i].path;
+        if (path && strstr (path, id)) return path;
+    }
+    if (timestamp > time(0) - MOTION_POSTER_RECENT)
+        housemotion_index_request ();
+    return 0;
+}
+
+// The pictures of the oldest event listed may have been recorded up to
+// MOTION_ACTIVE_TIMEOUT before that event was received.
+//
+static void housemotion_event_shrink (void) {
+
+    int i;
+    long long oldest = HouseMotionEventNext - HouseMotionEventIndexSize;
+    if (oldest < 1) oldest = 1;
+    if (oldest >= HouseMotionEventNext) return;
+    time_t limit = HouseMotionEventIndex[oldest % HouseMotionEventIndexSize]
+                       .timestamp - MOTION_ACTIVE_TIMEOUT;
+
+    for (i = 0; i < MOTION_POSTER_MAX; ++i) {
+        struct HouseMotionPoster *poster = HouseMotionPosters + i;
+        if (poster->path && (poster->mtime < limit))
+            housemotion_event_poster_release (i);
+    }
+}
+
+void housemotion_event_background (time_t now) {
+
+    int i;
+    for (i = HouseMotionActiveCount - 1; i >= 0; --i) {
+        if (HouseMotionActive[i].activity < now - MOTION_ACTIVE_TIMEOUT) {
+            houselog_trace (HOUSE_FAILURE, HouseMotionActive[i].camera,
+                            "no end for event %s", HouseMotionActive[i].id);
+            housemotion_event_forget (i);
+        }
+    }
+    if (HouseMotionPosterCount && housemotion_pressure_shrink ())
+        housemotion_event_shrink ();
+}
+
+int housemotion_event_status (char *buffer, int size) {
+
+    int i;
+    int cursor = snprintf (buffer, size, "\"active\":[");
+    if (cursor >= size) goto overflow;
+
+    const char *sep = "";
+    for (i = 0; i < HouseMotionActiveCount; ++i) {
+        struct HouseMotionActiveEvent *active = HouseMotionActive + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s[\"%s\",\"%s\",%lld,%d,%lld]",
+                            sep, active->camera, active->id,
+                            (long long)(active->start),
+                            active->files, active->bytes);
+        if (cursor >= size) goto overflow;
+        sep = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+static int housemotion_event_match (const struct HouseMotionEventRecord *record,
+                                    const char *camera, const char *stage,
+                                    time_t since, time_t until) {
+    if (camera && strcmp (camera, record->camera)) return 0;
+    if (stage && strcasecmp (stage, record->stage)) return 0;
+    if (since && (record->timestamp < since)) return 0;
+    if (until && (record->timestamp > until)) return 0;
+    return 1;
+}
+
+static const char *housemotion_event_query (const char *method, const char *uri,
+                                            const char *data, int length) {
+    static char buffer[65537];
+
+    const char *camera = echttp_parameter_get ("camera");
+    const char *stage = echttp_parameter_get ("stage");
+    const char *since = echttp_parameter_get ("since");
+    const char *until = echttp_parameter_get ("until");
+    const char *before = echttp_parameter_get ("before");
+    const char *count = echttp_parameter_get ("count");
+
+    if (camera && (!camera[0])) camera = 0;
+    if (stage && (!stage[0])) stage = 0;
+
+    time_t sincetime = since ? (time_t)atoll(since) : 0;
+    time_t untiltime = until ? (time_t)atoll(until) : 0;
+
+    int max = count ? atoi(count) : MOTION_EVENT_PAGE_DEFAULT;
+    if ((max <= 0) || (max > MOTION_EVENT_PAGE_MAX))
+        max = MOTION_EVENT_PAGE_MAX;
+
+    long long oldest = HouseMotionEventNext - HouseMotionEventIndexSize;
+    if (oldest < 1) oldest = 1;
+
+    long long sequence = HouseMotionEventNext - 1;
+    if (before) {
+        long long cursor = atoll(before) - 1;
+        if (cursor < sequence) sequence = cursor;
+    }
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,\"events\":[",
+                           HouseMotionEventHost, (long long)time(0));
+    const char *sep = "";
+    int listed = 0;
+
+    // The last page has been reached when all remaining entries are
+    // either too old or out of the index.
+    //
+    for (; (sequence >= oldest) && (listed < max); --sequence) {
+        const struct HouseMotionEventRecord *record =
+            HouseMotionEventIndex + (sequence % HouseMotionEventIndexSize);
+        if (sincetime && (record->timestamp < sincetime)) {
+            sequence = 0;
+            break;
+        }
+        if (!housemotion_event_match (record,
+                                      camera, stage, sincetime, untiltime))
+            continue;
+
+        int saved = cursor;
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            "%s[%lld,%lld,\"%s\",\"%s\",\"%s\"]",
+                            sep, record->sequence,
+                            (long long)(record->timestamp),
+                            record->camera, record->stage, record->text);
+        if (cursor >= sizeof(buffer) - 32) {
+            cursor = saved; // Leave room for the end of the JSON data.
+            break;
+        }
+        sep = ",";
+        listed += 1;
+    }
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "]");
+
+    // The next page starts right after the last entry listed, if there
+    // are any entry left.
+    //
+    if (sequence >= oldest) {
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            ",\"next\":%lld", sequence + 1);
+    }
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *housemotion_event_poster (const char *method,
+                                             const char *uri,
+                                             const char *data, int length) {
+
+    // The URI is /cctv/events/SEQUENCE/poster.
+    const char *cursor = uri + strlen("/cctv/events/");
+    char *end;
+    long long sequence = strtoll (cursor, &end, 10);
+    if ((end == cursor) || strcmp (end, "/poster")) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    long long oldest = HouseMotionEventNext - HouseMotionEventIndexSize;
+    if ((sequence < oldest) || (sequence <= 0) ||
+        (sequence >= HouseMotionEventNext)) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    const struct HouseMotionEventRecord *record =
+        HouseMotionEventIndex + (sequence % HouseMotionEventIndexSize);
+
+    const char *path = 0;
+    if (record->text[0])
+        path = housemotion_event_poster_search (record->text, record->timestamp);
+    if (!path) {
+        echttp_error (404, "No poster");
+        return "";
+    }
+    long long size;
+    time_t mtime;
+    const char *type;
+    int fd = housemotion_store_open (path, &size, &mtime, &type);
+    if (fd < 0) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    if (size > INT_MAX) {
+        close (fd);
+        echttp_error (413, "Poster too large");
+        return "";
+    }
+    echttp_content_type_set (type);
+    echttp_transfer (fd, (int)size);
+    return "";
+}
+
+static const char *housemotion_event_route (const char *method,
+                                            const char *uri,
+                                            const char *data, int length) {
+    if (!strncmp (uri, "/cctv/events/", 13))
+        return housemotion_event_poster (method, uri, data, length);
+    return housemotion_event_query (method, uri, data, length);
+}
+
+void housemotion_event_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *depth = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-events=", argv[i], &depth);
+    }
+    if (depth) {
+        HouseMotionEventIndexSize = atoi(depth);
+        if (HouseMotionEventIndexSize < MOTION_EVENT_PAGE_MAX)
+            HouseMotionEventIndexSize = MOTION_EVENT_PAGE_MAX;
+    }
+    HouseMotionEventIndex =
+        calloc (HouseMotionEventIndexSize, sizeof(*HouseMotionEventIndex));
+
+    gethostname (HouseMotionEventHost, sizeof(HouseMotionEventHost));
+
+    for (i = 0; i < MOTION_POSTER_BUCKETS; ++i)
+        HouseMotionPosterBuckets[i] = -1;
+    housemotion_index_listen (housemotion_event_indexed);
+    housemotion_pack_listen (housemotion_event_indexed);
+
+    echttp_route_match ("/cctv/events", housemotion_event_route);
+}
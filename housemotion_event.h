@@ -0,0 +1,35 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_event.h - An in-memory index of the Motion events.
+ */
+void housemotion_event_initialize (int argc, const char **argv);
+
+void housemotion_event_add (const char *camera,
+                            const char *stage, const char *text);
+
+void housemotion_event_start (const char *camera, const char *event);
+int  housemotion_event_end   (const char *camera, const char *event,
+                              time_t *start);
+const char *housemotion_event_file (const char *path, long long size);
+int  housemotion_event_active (const char *path);
+
+void housemotion_event_background (time_t now);
+int  housemotion_event_status (char *buffer, int size);
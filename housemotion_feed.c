@@ -26,7 +26,10 @@
  * and reports them to HouseDvr (on request).
  *
  * This module is not configured by the user: it learns about motion's cameras
- * on its own.
+ * on its own. The only option is the location of the Motion configuration,
+ * which may be repeated when several Motion instances run on the same
+ * computer: each instance has its own configuration, ports and storage,
+ * but all their cameras are reported together.
  *
  * void housemotion_feed_initialize (int argc, const char **argv);
  *
@@ -60,6 +63,7 @@
 #include "houselog.h"
 
 #include "housemotion_feed.h"
+#include "housemotion_format.h"
 #include "housemotion_store.h"
 
 #define DEBUG if (echttp_isdebug()) printf
@@ -74,9 +78,16 @@ static FeedRegistration *Feeds = 0;
 static int               FeedsCount = 0;
 static int               FeedsSize = 0;
 
-static const char *HouseMotionConf = "/etc/motion/motion.conf";
-static char *HouseMotionControlPort = 0;
-static char *HouseMotionStreamPort = 0;
+typedef struct {
+    const char *conf;
+    char *controlport;
+    char *streamport;
+} MotionInstance;
+
+#define MOTION_INSTANCES_MAX 8
+
+static MotionInstance HouseMotionInstances[MOTION_INSTANCES_MAX];
+static int            HouseMotionInstancesCount = 0;
 
 static char HouseMotionHost[256];
 static time_t LastConfigLoad = 0;
@@ -87,7 +98,8 @@ static void housemotion_feed_replace (char **var, const char *value) {
     else       *var = 0;
 }
 
-static void housemotion_feed_add_camera (char *id, char *name) {
+static void housemotion_feed_add_camera (const MotionInstance *instance,
+                                         char *id, char *name) {
 
     if (FeedsCount >= FeedsSize) {
         FeedsSize += 16;
@@ -98,7 +110,7 @@ static void housemotion_feed_add_camera (char *id, char *name) {
 
     char url[1024];
     snprintf (url, sizeof(url), "http://%s:%s/%s/stream",
-              HouseMotionHost, HouseMotionStreamPort, id);
+              HouseMotionHost, instance->streamport, id);
     Feeds[FeedsCount].url = strdup(url);
 
     FeedsCount += 1;
@@ -130,7 +142,22 @@ int housemotion_feed_status (char *buffer, int size) {
 
     cursor += snprintf (buffer+cursor, size-cursor,
                         "\"console\":\"http://%s:%s/\"",
-                        HouseMotionHost, HouseMotionControlPort);
+                        HouseMotionHost, HouseMotionInstances[0].controlport);
+    if (cursor >= size) goto overflow;
+
+    cursor += snprintf (buffer+cursor, size-cursor, ",\"consoles\":[");
+    if (cursor >= size) goto overflow;
+
+    for (i = 0; i < HouseMotionInstancesCount; ++i) {
+        cursor += snprintf (buffer+cursor, size-cursor, "%s\"http://%s:%s/\"",
+                            prefix, HouseMotionHost,
+                            HouseMotionInstances[i].controlport);
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+    prefix = "";
+
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
     if (cursor >= size) goto overflow;
 
     cursor += snprintf (buffer+cursor, size-cursor, ",\"feeds\":{");
@@ -179,7 +206,26 @@ static char *housemotion_feed_get_value (const char *name, char *data) {
     return data;
 }
 
-static void housemotion_feed_read_camera (const char *filename) {
+// The file name formats are used to decode the recording file names.
+//
+static int housemotion_feed_read_format (int index, char *data) {
+
+    char *value = housemotion_feed_get_value ("movie_filename", data);
+    if (!value) value = housemotion_feed_get_value ("picture_filename", data);
+    if (value) {
+        housemotion_format_compile (index, value);
+        return 1;
+    }
+    value = housemotion_feed_get_value ("text_event", data);
+    if (value) {
+        housemotion_format_event (index, value);
+        return 1;
+    }
+    return 0;
+}
+
+static void housemotion_feed_read_camera (const MotionInstance *instance,
+                                          const char *filename) {
 
     char buffer[1024];
     FILE *fd = fopen (filename, "r");
@@ -205,10 +251,11 @@ static void housemotion_feed_read_camera (const char *filename) {
             housemotion_feed_replace (&camname, value);
             continue;
         }
+        housemotion_feed_read_format (instance - HouseMotionInstances, data);
     }
 
     if (camname && camid) {
-        housemotion_feed_add_camera (camid, camname);
+        housemotion_feed_add_camera (instance, camid, camname);
     } else {
         // Ignore any incomplete configuration.
         if (camname) free(camname);
@@ -217,12 +264,16 @@ static void housemotion_feed_read_camera (const char *filename) {
     fclose(fd);
 }
 
-static void housemotion_feed_read_configuration (void) {
+static void housemotion_feed_read_configuration (int index) {
 
     char buffer[1024];
-    FILE *fd = fopen (HouseMotionConf, "r");
+    MotionInstance *instance = HouseMotionInstances + index;
+
+    FILE *fd = fopen (instance->conf, "r");
     if (!fd) return;
 
+    housemotion_format_clear (index);
+
     while (!feof(fd)) {
         char *data = fgets (buffer, sizeof(buffer), fd);
         if (!data) break;
@@ -234,45 +285,67 @@ static void housemotion_feed_read_configuration (void) {
         // the first characters of the tokens that we care for.
         // DO NOT FORGET TO UPDATE THAT LIST IF TOKENS ARE ADDED BELOW.
         //
-        if (!strchr ("cwst", data[0])) continue;
+        if (!strchr ("cmpstw", data[0])) continue;
 
         char *value = housemotion_feed_get_value ("camera", data);
         if (value) {
-            housemotion_feed_read_camera (value);
+            housemotion_feed_read_camera (instance, value);
             continue;
         }
         value = housemotion_feed_get_value ("webcontrol_port", data);
         if (value) {
-            housemotion_feed_replace (&HouseMotionControlPort, value);
+            housemotion_feed_replace (&(instance->controlport), value);
             continue;
         }
         value = housemotion_feed_get_value ("stream_port", data);
         if (value) {
-            housemotion_feed_replace (&HouseMotionStreamPort, value);
+            housemotion_feed_replace (&(instance->streamport), value);
             continue;
         }
         value = housemotion_feed_get_value ("target_dir", data);
         if (value) {
-            housemotion_store_location (value);
+            housemotion_store_location (index, value);
             continue;
         }
+        if (housemotion_feed_read_format (index, data)) continue;
     }
     fclose(fd);
+}
 
-    if (!HouseMotionControlPort) HouseMotionControlPort = strdup("8080");
-    if (!HouseMotionStreamPort) HouseMotionStreamPort = strdup("8081");
+static void housemotion_feed_read_all (void) {
 
+    int i;
+    for (i = 0; i < HouseMotionInstancesCount; ++i) {
+        housemotion_feed_read_configuration (i);
+
+        MotionInstance *instance = HouseMotionInstances + i;
+        if (!instance->controlport) instance->controlport = strdup("8080");
+        if (!instance->streamport) instance->streamport = strdup("8081");
+    }
     LastConfigLoad = time(0);
 }
 
 void housemotion_feed_initialize (int argc, const char **argv) {
 
     int i;
+    const char *conf;
+
     for (i = 1; i < argc; ++i) {
-        echttp_option_match ("-motion-conf=", argv[i], &HouseMotionConf);
+        if (echttp_option_match ("-motion-conf=", argv[i], &conf)) {
+            if (HouseMotionInstancesCount >= MOTION_INSTANCES_MAX) {
+                houselog_trace (HOUSE_FAILURE, "CONFIG",
+                                "too many Motion instances, %s ignored", conf);
+                continue;
+            }
+            HouseMotionInstances[HouseMotionInstancesCount++].conf = conf;
+        }
     }
+    if (!HouseMotionInstancesCount)
+        HouseMotionInstances[HouseMotionInstancesCount++].conf =
+            "/etc/motion/motion.conf";
+
     gethostname (HouseMotionHost, sizeof(HouseMotionHost));
-    housemotion_feed_read_configuration ();
+    housemotion_feed_read_all ();
 }
 
 static void housemotion_feed_scan_configuration (time_t now) {
@@ -282,7 +355,7 @@ static void housemotion_feed_scan_configuration (time_t now) {
     // For now, re-read the configuration files.
     // TBD: use the Motion web API to get the live configuration.
     housemotion_feed_clear_camera();
-    housemotion_feed_read_configuration();
+    housemotion_feed_read_all();
 }
 
 void housemotion_feed_background (time_t now) {
@@ -0,0 +1,394 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_format.c - Decode the names of the Motion recording files.
+ *
+ * SYNOPSYS:
+ *
+ * Motion names its recording files according to the movie_filename and
+ * picture_filename formats, which use conversion specifiers such as %Y,
+ * %m, %d (date), %H, %M, %S (time), %t (camera ID), %v (event number)
+ * or %C (the text_event format). This module compiles these formats
+ * once into a sequence of tokens, which is then used to decode the
+ * camera, event and time from each file path, without accessing the
+ * file itself.
+ *
+ * The specifiers that are not listed above match any text, up to the
+ * next literal part of the format.
+ *
+ * void housemotion_format_clear (int instance);
+ *
+ *    Forget all the formats for the specified Motion instance. This is
+ *    used before the Motion configuration is read again.
+ *
+ * void housemotion_format_event (int instance, const char *format);
+ *
+ *    Set the text_event format, used to expand the %C specifier. The
+ *    formats already compiled are compiled again.
+ *
+ * void housemotion_format_compile (int instance, const char *format);
+ *
+ *    Compile one movie_filename or picture_filename format.
+ *
+ * int housemotion_format_match (int instance, const char *relative,
+ *                               HouseMotionPathInfo *info);
+ *
+ *    Decode the path of a file, relative to the storage root. Return 1
+ *    on success, 0 if the path does not match any format.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_format.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+typedef enum {
+    FORMAT_LITERAL,
+    FORMAT_YEAR,
+    FORMAT_MONTH,
+    FORMAT_DAY,
+    FORMAT_HOUR,
+    FORMAT_MINUTE,
+    FORMAT_SECOND,
+    FORMAT_CAMERA,
+    FORMAT_EVENT,
+    FORMAT_NUMBER, // Any other numeric value, e.g. the frame number.
+    FORMAT_ANY
+} MotionFormatKind;
+
+typedef struct {
+    MotionFormatKind kind;
+    int   width; // For fixed width numbers, 0 if variable.
+    char *literal;
+} MotionFormatToken;
+
+typedef struct {
+    MotionFormatToken *tokens;
+    int count;
+} MotionFormat;
+
+#define MOTION_FORMAT_INSTANCES 8
+#define MOTION_FORMAT_MAX 8
+
+typedef struct {
+    char *event;
+    char *texts[MOTION_FORMAT_MAX];
+    MotionFormat formats[MOTION_FORMAT_MAX];
+    int count;
+} MotionFormatSet;
+
+static MotionFormatSet HouseMotionFormats[MOTION_FORMAT_INSTANCES];
+
+static const char *HouseMotionCameras[64];
+static int HouseMotionCamerasCount = 0;
+
+// Camera IDs are interned, so that they can be shared by all the files
+// from the same camera.
+//
+static const char *housemotion_format_camera (const char *id, int length) {
+    int i;
+    for (i = 0; i < HouseMotionCamerasCount; ++i) {
+        if ((!strncmp (HouseMotionCameras[i], id, length)) &&
+            (!HouseMotionCameras[i][length])) return HouseMotionCameras[i];
+    }
+    if (HouseMotionCamerasCount >= sizeof(HouseMotionCameras)/sizeof(char *))
+        return 0;
+    HouseMotionCameras[HouseMotionCamerasCount] = strndup (id, length);
+    return HouseMotionCameras[HouseMotionCamerasCount++];
+}
+
+static void housemotion_format_add (MotionFormat *format,
+                                    MotionFormatKind kind, int width,
+                                    const char *literal, int length) {
+
+    // Merge consecutive literals, and consecutive wildcards.
+    if (format->count > 0) {
+        MotionFormatToken *last = format->tokens + format->count - 1;
+        if ((kind == FORMAT_LITERAL) && (last->kind == FORMAT_LITERAL)) {
+            int previous = strlen (last->literal);
+            last->literal = realloc (last->literal, previous + length + 1);
+            memcpy (last->literal + previous, literal, length);
+            last->literal[previous + length] = 0;
+            return;
+        }
+        if ((kind == FORMAT_ANY) && (last->kind == FORMAT_ANY)) return;
+    }
+    format->tokens = realloc (format->tokens,
+                              (format->count + 1) * sizeof(MotionFormatToken));
+    MotionFormatToken *token = format->tokens + (format->count++);
+    token->kind = kind;
+    token->width = width;
+    token->literal = (kind == FORMAT_LITERAL) ? strndup (literal, length) : 0;
+}
+
+static void housemotion_format_parse (MotionFormat *format,
+                                      const char *text, const char *event,
+                                      int depth) {
+    while (*text) {
+        if (*text != '%') {
+            const char *start = text;
+            while (*text && (*text != '%')) text += 1;
+            housemotion_format_add (format, FORMAT_LITERAL, 0,
+                                    start, text - start);
+            continue;
+        }
+        text += 1;
+        switch (*text) {
+            case 0: return;
+            case '%':
+                housemotion_format_add (format, FORMAT_LITERAL, 0, "%", 1);
+                break;
+            case 'Y': housemotion_format_add (format, FORMAT_YEAR, 4, 0, 0); break;
+            case 'm': housemotion_format_add (format, FORMAT_MONTH, 2, 0, 0); break;
+            case 'd': housemotion_format_add (format, FORMAT_DAY, 2, 0, 0); break;
+            case 'H': housemotion_format_add (format, FORMAT_HOUR, 2, 0, 0); break;
+            case 'M': housemotion_format_add (format, FORMAT_MINUTE, 2, 0, 0); break;
+            case 'S': housemotion_format_add (format, FORMAT_SECOND, 2, 0, 0); break;
+            case 't': housemotion_format_add (format, FORMAT_CAMERA, 0, 0, 0); break;
+            case 'v': housemotion_format_add (format, FORMAT_EVENT, 0, 0, 0); break;
+            case 'q': housemotion_format_add (format, FORMAT_NUMBER, 0, 0, 0); break;
+            case 'C':
+                if (event && (depth == 0)) {
+                    housemotion_format_parse (format, event, 0, depth + 1);
+                } else {
+                    housemotion_format_add (format, FORMAT_ANY, 0, 0, 0);
+                }
+                break;
+            case '{':
+                // A named specifier, e.g. %{host}: any text.
+                while (*text && (*text != '}')) text += 1;
+                if (!*text) return;
+                housemotion_format_add (format, FORMAT_ANY, 0, 0, 0);
+                break;
+            default:
+                housemotion_format_add (format, FORMAT_ANY, 0, 0, 0);
+                break;
+        }
+        text += 1;
+    }
+}
+
+static void housemotion_format_free (MotionFormat *format) {
+    int j;
+    for (j = 0; j < format->count; ++j) {
+        if (format->tokens[j].literal) free (format->tokens[j].literal);
+    }
+    free (format->tokens);
+    format->tokens = 0;
+    format->count = 0;
+}
+
+void housemotion_format_clear (int instance) {
+
+    if ((instance < 0) || (instance >= MOTION_FORMAT_INSTANCES)) return;
+    MotionFormatSet *set = HouseMotionFormats + instance;
+
+    int i;
+    for (i = 0; i < set->count; ++i) {
+        housemotion_format_free (set->formats + i);
+        free (set->texts[i]);
+        set->texts[i] = 0;
+    }
+    set->count = 0;
+    if (set->event) {
+        free (set->event);
+        set->event = 0;
+    }
+}
+
+static int housemotion_format_add_text (MotionFormatSet *set, char *text) {
+
+    if (set->count >= MOTION_FORMAT_MAX) {
+        houselog_trace (HOUSE_FAILURE, "FORMAT", "too many formats, %s ignored", text);
+        free (text);
+        return 0;
+    }
+    MotionFormat *format = set->formats + set->count;
+    housemotion_format_parse (format, text, set->event, 0);
+
+    // Ignore a format that is already known (movie and picture files
+    // often use the same format).
+    int i, j;
+    for (i = 0; i < set->count; ++i) {
+        MotionFormat *known = set->formats + i;
+        if (known->count != format->count) continue;
+        for (j = 0; j < format->count; ++j) {
+            MotionFormatToken *a = known->tokens + j;
+            MotionFormatToken *b = format->tokens + j;
+            if (a->kind != b->kind) break;
+            if (a->literal && strcmp (a->literal, b->literal)) break;
+        }
+        if (j >= format->count) break;
+    }
+    if (i < set->count) {
+        housemotion_format_free (format);
+        free (text);
+        return 0;
+    }
+    set->texts[set->count++] = text;
+    DEBUG ("Compiled format %s into %d tokens\n", text, format->count);
+    return 1;
+}
+
+void housemotion_format_compile (int instance, const char *text) {
+
+    if ((instance < 0) || (instance >= MOTION_FORMAT_INSTANCES)) return;
+    housemotion_format_add_text (HouseMotionFormats + instance, strdup (text));
+}
+
+void housemotion_format_event (int instance, const char *format) {
+
+    if ((instance < 0) || (instance >= MOTION_FORMAT_INSTANCES)) return;
+    MotionFormatSet *set = HouseMotionFormats + instance;
+    if (set->event) {
+        if (!strcmp (set->event, format)) return; // No change.
+        free (set->event);
+    }
+    set->event = strdup (format);
+
+    // %C must now be expanded differently.
+    int i;
+    int count = set->count;
+    char *texts[MOTION_FORMAT_MAX];
+    for (i = 0; i < count; ++i) {
+        housemotion_format_free (set->formats + i);
+        texts[i] = set->texts[i];
+    }
+    set->count = 0;
+    for (i = 0; i < count; ++i) housemotion_format_add_text (set, texts[i]);
+}
+
+struct housemotion_format_fields {
+    struct tm   time;
+    const char *camera;
+    int         cameralength;
+    int         event;
+};
+
+static int housemotion_format_number (const char *text, int width,
+                                      int *value) {
+    int length = 0;
+    *value = 0;
+    while (isdigit(text[length])) {
+        if (width && (length >= width)) break;
+        *value = (*value * 10) + (text[length] - '0');
+        length += 1;
+    }
+    if (width && (length != width)) return -1;
+    return length ? length : -1;
+}
+
+// Match the remaining tokens against the remaining text. Wildcards and
+// variable width numbers are matched as short as possible, backtracking
+// if the rest does not match.
+//
+static int housemotion_format_recurse (const MotionFormatToken *token,
+                                       int count, const char *text,
+                                       struct housemotion_format_fields *fields) {
+    if (!count) return (*text == 0) || (*text == '.'); // Ignore extension.
+
+    int value;
+    int length;
+
+    switch (token->kind) {
+
+        case FORMAT_LITERAL:
+            length = strlen (token->literal);
+            if (strncmp (text, token->literal, length)) return 0;
+            return housemotion_format_recurse (token+1, count-1,
+                                               text+length, fields);
+        case FORMAT_ANY:
+            for (length = 0; ; ++length) {
+                if (housemotion_format_recurse (token+1, count-1,
+                                                text+length, fields)) return 1;
+                if ((!text[length]) || (text[length] == '/')) return 0;
+            }
+        case FORMAT_CAMERA:
+        case FORMAT_EVENT:
+        case FORMAT_NUMBER:
+            for (length = 1; isdigit(text[length-1]); ++length) {
+                if (!housemotion_format_recurse (token+1, count-1,
+                                                 text+length, fields)) continue;
+                housemotion_format_number (text, length, &value);
+                if (token->kind == FORMAT_CAMERA) {
+                    fields->camera = text;
+                    fields->cameralength = length;
+                } else if (token->kind == FORMAT_EVENT) {
+                    fields->event = value;
+                }
+                return 1;
+            }
+            return 0;
+        default: break;
+    }
+
+    length = housemotion_format_number (text, token->width, &value);
+    if (length < 0) return 0;
+    if (!housemotion_format_recurse (token+1, count-1, text+length, fields))
+        return 0;
+
+    switch (token->kind) {
+        case FORMAT_YEAR: fields->time.tm_year = value - 1900; break;
+        case FORMAT_MONTH: fields->time.tm_mon = value - 1; break;
+        case FORMAT_DAY: fields->time.tm_mday = value; break;
+        case FORMAT_HOUR: fields->time.tm_hour = value; break;
+        case FORMAT_MINUTE: fields->time.tm_min = value; break;
+        case FORMAT_SECOND: fields->time.tm_sec = value; break;
+        default: break;
+    }
+    return 1;
+}
+
+int housemotion_format_match (int instance, const char *relative,
+                              HouseMotionPathInfo *info) {
+
+    if ((instance < 0) || (instance >= MOTION_FORMAT_INSTANCES)) return 0;
+    MotionFormatSet *set = HouseMotionFormats + instance;
+
+    int i;
+    for (i = 0; i < set->count; ++i) {
+        MotionFormat *format = set->formats + i;
+        struct housemotion_format_fields fields;
+        memset (&fields, 0, sizeof(fields));
+        fields.event = -1;
+        if (!housemotion_format_recurse (format->tokens, format->count,
+                                         relative, &fields)) continue;
+
+        info->camera = fields.camera ?
+            housemotion_format_camera (fields.camera, fields.cameralength) : 0;
+        info->event = fields.event;
+        info->timestamp = 0;
+        if (fields.time.tm_year > 0) {
+            fields.time.tm_isdst = -1;
+            info->timestamp = mktime (&fields.time);
+        }
+        return 1;
+    }
+    return 0;
+}
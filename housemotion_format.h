@@ -0,0 +1,34 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_format.h - Decode the names of the Motion recording files.
+ */
+typedef struct {
+    const char *camera; // 0 if unknown.
+    int         event;  // -1 if unknown.
+    time_t      timestamp; // 0 if unknown.
+} HouseMotionPathInfo;
+
+void housemotion_format_clear (int instance);
+void housemotion_format_event (int instance, const char *format);
+void housemotion_format_compile (int instance, const char *format);
+
+int  housemotion_format_match (int instance, const char *relative,
+                               HouseMotionPathInfo *info);
@@ -0,0 +1,1019 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_index.c - An in-memory index of the Motion recording files.
+ *
+ * SYNOPSYS:
+ *
+ * This module maintains a list of all the recording files, with their
+ * attributes, so that the storage does not need to be fully walked
+ * each time the list of recordings is needed.
+ *
+ * In both scanning modes, a directory is read again only if its
+ * modification time has changed, if it contains files that may still be
+ * written to, or if it was last read more than a TTL ago: the cost of a
+ * refresh is proportional to the number of changed directories. New files
+ * are learnt through the Motion hooks (see housemotion_index_notify()) or
+ * the next directory change. The two modes differ when a directory is
+ * read again:
+ *
+ * - local: every file in the directory is checked. This is the most
+ *   accurate mode, and its cost is acceptable when the storage is on a
+ *   local disk.
+ *
+ * - network: the attributes of a file are reused if the file is not being
+ *   written to and its attributes are more recent than the TTL. This mode
+ *   is intended for network file systems (e.g. NFS), where each stat(2)
+ *   is a network round trip.
+ *
+ * void housemotion_index_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_index_location (int instance, const char *root);
+ *
+ *    Set the root directory of the recording files for one Motion
+ *    instance. There is one root per Motion instance, and all roots are
+ *    part of the same index. Changing the root directory of an instance
+ *    clears the index for that instance.
+ *
+ * void housemotion_index_refresh (time_t now);
+ *
+ *    Update the index to reflect the current content of the storage.
+ *    A refresh walks the whole storage, which may take a long time. It is
+ *    done in slices: each call processes directories for a limited time,
+ *    and the next call resumes where the previous one stopped, so that
+ *    the Motion hooks are never delayed by a long walk. A new refresh
+ *    starts only when requested (see housemotion_index_request()) or
+ *    when the scan period has elapsed, and at most once per second. The
+ *    first refresh starts immediately.
+ *
+ * void housemotion_index_request (void);
+ *
+ *    Request a new refresh, typically because a listing is being served.
+ *    The refresh is done in the background, as described above.
+ *
+ * int housemotion_index_ready (void);
+ *
+ *    Return 1 if the whole storage was walked at least once. Until then,
+ *    the index may miss old recordings.
+ *
+ * void housemotion_index_background (time_t now);
+ *
+ *    Detect the content type of the files that were recently added,
+ *    a few files at a time. The content type is detected only once per
+ *    file, using libmagic, when the file is no longer being written to.
+ *    The new files are queued for detection when they are indexed, so
+ *    that the cost of each call does not depend on the size of the index.
+ *
+ * The camera, event number and time of each new file are decoded once
+ * from its path, using the Motion file name formats (see
+ * housemotion_format.c).
+ *
+ * const HouseMotionFile *housemotion_index_notify (const char *path);
+ *
+ *    Update the attributes of one file following a Motion notification.
+ *    The path is the full path of the file, as reported by Motion.
+ *    Return the updated index entry, or 0 if the file is not indexed.
+ *
+ * void housemotion_index_remove (const char *path);
+ *
+ *    Remove one file from the index (typically after it was deleted).
+ *    The path is the full path of the file.
+ *
+ * const HouseMotionFile *housemotion_index_lookup (const char *relative,
+ *                                                 const char **root);
+ *
+ *    Return the index entry for the file, or 0 if the file is not known.
+ *    The path is relative to the root directory, which is returned in
+ *    root (if not null).
+ *
+ * int housemotion_index_enumerate (int instance,
+ *                                  housemotion_index_iterator *iterator,
+ *                                  void *context);
+ *
+ *    Call the iterator for each file in the index for the specified
+ *    Motion instance (or all instances if -1), until the iterator returns
+ *    a non-zero value. Return 1 if the enumeration was stopped by the
+ *    iterator, 0 otherwise.
+ *
+ * void housemotion_index_listen (housemotion_index_listener *listener);
+ *
+ *    Register a function to be called each time a file is added to the
+ *    index (previous is 0), modified (size or modification time changed)
+ *    or removed (file is 0). The path is relative to the root of the
+ *    Motion instance.
+ *
+ * long long housemotion_index_version (void);
+ *
+ *    Return a value that changes each time a file is added, removed or
+ *    modified in the index. This is used to invalidate derived data.
+ *
+ * int housemotion_index_status (char *buffer, int size);
+ *
+ *    Populate a JSON overview of the index and of the last refresh.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <magic.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_format.h"
+#include "housemotion_dirent.h"
+#include "housemotion_index.h"
+#include "housemotion_pressure.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+// Any file modified less than this many seconds ago may still be written
+// to by Motion, and its cached attributes cannot be trusted.
+//
+#define MOTION_INDEX_HOT 120
+
+typedef struct {
+    int    root;
+    char  *path; // Relative to the root, "" for the root itself.
+    time_t mtime;
+    time_t scanned;
+    int    generation;
+    int    hot;
+    char **subdirs;
+    int    subcount;
+    HouseMotionFile *files;
+    int    count;
+} HouseMotionDirectory;
+
+static HouseMotionDirectory *HouseMotionDirs = 0;
+static int                   HouseMotionDirsCount = 0;
+static int                   HouseMotionDirsSize = 0;
+
+#define MOTION_INDEX_ROOTS 8
+
+static char *HouseMotionIndexRoots[MOTION_INDEX_ROOTS];
+static int   HouseMotionIndexRootsCount = 0;
+static int   HouseMotionIndexNetwork = 0;
+static int   HouseMotionIndexTtl = 300;
+static int   HouseMotionIndexPeriod = 300;
+static int   HouseMotionIndexRequested = 1; // The first refresh.
+static int   HouseMotionIndexGeneration = 0;
+static time_t HouseMotionIndexLastRefresh = 0;
+static int   HouseMotionIndexPasses = 0;
+
+// The directories still to be walked during the current refresh.
+//
+#define MOTION_INDEX_SLICE 50 // milliseconds.
+#define MOTION_INDEX_DEFER 10 // seconds.
+
+typedef struct {
+    int   root;
+    char *path;
+} HouseMotionPendingDir;
+
+static HouseMotionPendingDir *HouseMotionIndexPending = 0;
+static int                    HouseMotionIndexPendingCount = 0;
+static int                    HouseMotionIndexPendingSize = 0;
+static int                    HouseMotionIndexInProgress = 0;
+
+static long long HouseMotionIndexFiles = 0;
+static long long HouseMotionIndexVersion = 0;
+
+#define MOTION_INDEX_LISTENERS 8
+
+static housemotion_index_listener *HouseMotionIndexListeners[MOTION_INDEX_LISTENERS];
+static int HouseMotionIndexListenersCount = 0;
+
+// The files for which the content type was not detected yet, in the
+// order they were indexed. Each call visits a limited number of entries,
+// whether their type could be detected or not.
+//
+#define MOTION_INDEX_TYPE_BATCH 20
+
+typedef struct {
+    int   root;
+    char *relative;
+} HouseMotionUntyped;
+
+static magic_t HouseMotionMagic = 0;
+static HouseMotionUntyped *HouseMotionTypeQueue = 0;
+static int HouseMotionTypeFirst = 0;
+static int HouseMotionTypeCount = 0;
+static int HouseMotionTypeSize = 0;
+static long long HouseMotionTypeDetected = 0;
+
+static const char *HouseMotionTypes[64];
+static int HouseMotionTypesCount = 0;
+
+// Statistics about the last refresh.
+static int HouseMotionIndexRescanned = 0;
+static int HouseMotionIndexSkipped = 0;
+static int HouseMotionIndexStatCount = 0;
+
+
+// The directories are sorted by root, then path.
+//
+static int housemotion_index_search (int root, const char *path, int *position) {
+
+    int low = 0;
+    int high = HouseMotionDirsCount - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int delta = root - HouseMotionDirs[middle].root;
+        if (!delta) delta = strcmp (path, HouseMotionDirs[middle].path);
+        if (delta == 0) return middle;
+        if (delta < 0) high = middle - 1;
+        else           low = middle + 1;
+    }
+    if (position) *position = low;
+    return -1;
+}
+
+static HouseMotionDirectory *housemotion_index_directory (int root,
+                                                          const char *path,
+                                                          int create) {
+    int position;
+    int i = housemotion_index_search (root, path, &position);
+    if (i >= 0) return HouseMotionDirs + i;
+    if (!create) return 0;
+
+    if (HouseMotionDirsCount >= HouseMotionDirsSize) {
+        HouseMotionDirsSize += 64;
+        HouseMotionDirs = realloc (HouseMotionDirs,
+                                   HouseMotionDirsSize * sizeof(HouseMotionDirectory));
+    }
+    HouseMotionDirectory *dir = HouseMotionDirs + position;
+    if (position < HouseMotionDirsCount) {
+        memmove (dir+1, dir,
+                 (HouseMotionDirsCount - position) * sizeof(HouseMotionDirectory));
+    }
+    HouseMotionDirsCount += 1;
+    memset (dir, 0, sizeof(HouseMotionDirectory));
+    dir->root = root;
+    dir->path = strdup (path);
+    return dir;
+}
+
+static void housemotion_index_free_subdirs (HouseMotionDirectory *dir) {
+    int i;
+    for (i = 0; i < dir->subcount; ++i) free (dir->subdirs[i]);
+    if (dir->subdirs) free (dir->subdirs);
+    dir->subdirs = 0;
+    dir->subcount = 0;
+}
+
+static void housemotion_index_changed (const HouseMotionDirectory *dir,
+                                       const HouseMotionFile *file,
+                                       const HouseMotionFile *previous) {
+
+    if (!HouseMotionIndexListenersCount) return;
+
+    char relative[1024];
+    const char *name = file ? file->name : previous->name;
+    if (dir->path[0])
+        snprintf (relative, sizeof(relative), "%s/%s", dir->path, name);
+    else
+        strtcpy (relative, name, sizeof(relative));
+
+    int i;
+    for (i = 0; i < HouseMotionIndexListenersCount; ++i) {
+        HouseMotionIndexListeners[i] (dir->root, relative, file, previous);
+    }
+}
+
+static void housemotion_index_free_files (HouseMotionDirectory *dir) {
+    int i;
+    for (i = 0; i < dir->count; ++i) free (dir->files[i].name);
+    if (dir->files) free (dir->files);
+    HouseMotionIndexFiles -= dir->count;
+    dir->files = 0;
+    dir->count = 0;
+}
+
+// Same as above, for files that are no longer present.
+//
+static void housemotion_index_forget_files (HouseMotionDirectory *dir) {
+    int i;
+    for (i = 0; i < dir->count; ++i) {
+        housemotion_index_changed (dir, 0, dir->files + i);
+    }
+    housemotion_index_free_files (dir);
+}
+
+static void housemotion_index_clear (int root) {
+    int i, k = 0;
+    HouseMotionIndexVersion += 1;
+    for (i = 0; i < HouseMotionDirsCount; ++i) {
+        HouseMotionDirectory *dir = HouseMotionDirs + i;
+        if (dir->root == root) {
+            housemotion_index_forget_files (dir);
+            housemotion_index_free_subdirs (dir);
+            free (dir->path);
+            continue;
+        }
+        if (k < i) HouseMotionDirs[k] = *dir;
+        k += 1;
+    }
+    HouseMotionDirsCount = k;
+}
+
+// Two Motion instances may share the same storage: index it only once.
+//
+static int housemotion_index_alias (int root) {
+    int i;
+    if (!HouseMotionIndexRoots[root]) return 1;
+    for (i = 0; i < root; ++i) {
+        if (!HouseMotionIndexRoots[i]) continue;
+        if (!strcmp (HouseMotionIndexRoots[i], HouseMotionIndexRoots[root]))
+            return 1;
+    }
+    return 0;
+}
+
+static int housemotion_index_compare (const void *a, const void *b) {
+    return strcmp (((const HouseMotionFile *)a)->name,
+                   ((const HouseMotionFile *)b)->name);
+}
+
+static const char *housemotion_index_fullpath (char *buffer, int size,
+                                               const HouseMotionDirectory *dir,
+                                               const char *name) {
+    const char *root = HouseMotionIndexRoots[dir->root];
+    if (dir->path[0])
+        snprintf (buffer, size, "%s/%s/%s", root, dir->path, name);
+    else
+        snprintf (buffer, size, "%s/%s", root, name);
+    return buffer;
+}
+
+static int housemotion_index_stat (const HouseMotionDirectory *dir,
+                                   HouseMotionFile *file, time_t now) {
+    char path[1024];
+    struct stat filestat;
+
+    HouseMotionIndexStatCount += 1;
+    housemotion_index_fullpath (path, sizeof(path), dir, file->name);
+    if (stat (path, &filestat)) return -1; // Cannot access, skip.
+    file->mtime = filestat.st_mtime;
+    file->size = (long long)(filestat.st_size);
+    file->checked = now;
+    return 0;
+}
+
+static void housemotion_index_untyped (int root, const char *relative) {
+
+    if (!HouseMotionMagic) return;
+
+    if (HouseMotionTypeFirst + HouseMotionTypeCount >= HouseMotionTypeSize) {
+        if (HouseMotionTypeFirst > 0) {
+            memmove (HouseMotionTypeQueue,
+                     HouseMotionTypeQueue + HouseMotionTypeFirst,
+                     HouseMotionTypeCount * sizeof(HouseMotionUntyped));
+            HouseMotionTypeFirst = 0;
+        }
+        if (HouseMotionTypeCount >= HouseMotionTypeSize) {
+            HouseMotionTypeSize += 1024;
+            HouseMotionTypeQueue =
+                realloc (HouseMotionTypeQueue,
+                         HouseMotionTypeSize * sizeof(HouseMotionUntyped));
+        }
+    }
+    HouseMotionUntyped *untyped =
+        HouseMotionTypeQueue + HouseMotionTypeFirst + (HouseMotionTypeCount++);
+    untyped->root = root;
+    untyped->relative = strdup (relative);
+}
+
+// A new file: decode its name, and queue it for content type detection.
+//
+static void housemotion_index_decode (const HouseMotionDirectory *dir,
+                                      HouseMotionFile *file) {
+
+    char relative[1024];
+    HouseMotionPathInfo info;
+
+    if (dir->path[0])
+        snprintf (relative, sizeof(relative), "%s/%s", dir->path, file->name);
+    else
+        strtcpy (relative, file->name, sizeof(relative));
+
+    if (housemotion_format_match (dir->root, relative, &info)) {
+        file->camera = info.camera;
+        file->event = info.event;
+        file->recorded = info.timestamp;
+    } else {
+        file->camera = 0;
+        file->event = -1;
+        file->recorded = 0;
+    }
+    housemotion_index_untyped (dir->root, relative);
+}
+
+// The attributes of a file are reused only if they are recent enough and
+// the file is not being written to.
+//
+static int housemotion_index_cached (const HouseMotionFile *file, time_t now) {
+    if (!HouseMotionIndexNetwork) return 0;
+    if (file->checked + HouseMotionIndexTtl <= now) return 0;
+    return (file->mtime < file->checked - MOTION_INDEX_HOT);
+}
+
+struct housemotion_index_listing {
+    HouseMotionFile *files;
+    int count;
+    int size;
+    char **subdirs;
+    int subcount;
+    int subsize;
+};
+
+static int housemotion_index_entry (const char *name, int type,
+                                    void *context) {
+
+    struct housemotion_index_listing *listing =
+        (struct housemotion_index_listing *)context;
+
+    if (type == HOUSEMOTION_DIRENT_FILE) {
+        if (listing->count >= listing->size) {
+            listing->size = listing->size ? listing->size * 2 : 64;
+            listing->files = realloc (listing->files,
+                                      listing->size * sizeof(HouseMotionFile));
+        }
+        memset (listing->files+listing->count, 0, sizeof(HouseMotionFile));
+        listing->files[listing->count++].name = strdup (name);
+    } else {
+        if (listing->subcount >= listing->subsize) {
+            listing->subsize += 16;
+            listing->subdirs = realloc (listing->subdirs,
+                                        listing->subsize * sizeof(char *));
+        }
+        listing->subdirs[listing->subcount++] = strdup (name);
+    }
+    return 0;
+}
+
+static void housemotion_index_scan (HouseMotionDirectory *dir,
+                                    const char *fullpath,
+                                    const struct stat *dirstat, time_t now) {
+
+    struct housemotion_index_listing listing;
+    memset (&listing, 0, sizeof(listing));
+
+    int status =
+        housemotion_dirent_scan (fullpath, housemotion_index_entry, &listing);
+
+    HouseMotionFile *files = listing.files;
+    int count = listing.count;
+    char **subdirs = listing.subdirs;
+    int subcount = listing.subcount;
+
+    if (status < 0) {
+        // Keep the previous content, this is retried on the next pass.
+        int i;
+        for (i = 0; i < count; ++i) free (files[i].name);
+        free (files);
+        for (i = 0; i < subcount; ++i) free (subdirs[i]);
+        free (subdirs);
+        return;
+    }
+
+    if (count > 1) qsort (files, count, sizeof(HouseMotionFile),
+                          housemotion_index_compare);
+
+    // Merge with the existing list (both are sorted): reuse the cached
+    // attributes when allowed, otherwise get the current attributes.
+    //
+    int i, j = 0, k = 0;
+    int hot = 0;
+    int changed = 0;
+    for (i = 0; i < count; ++i) {
+        HouseMotionFile *file = files + i;
+        while ((j < dir->count) && (strcmp (dir->files[j].name, file->name) < 0))
+            housemotion_index_changed (dir, 0, dir->files + (j++)); // Gone.
+        HouseMotionFile *known = 0;
+        if ((j < dir->count) && (!strcmp (dir->files[j].name, file->name)))
+            known = dir->files + (j++);
+
+        if (known && housemotion_index_cached (known, now)) {
+            file->mtime = known->mtime;
+            file->size = known->size;
+            file->checked = known->checked;
+        } else if (housemotion_index_stat (dir, file, now)) {
+            if (known) housemotion_index_changed (dir, 0, known);
+            free (file->name);
+            continue;
+        }
+        if (known) {
+            file->type = known->type;
+            file->camera = known->camera;
+            file->event = known->event;
+            file->recorded = known->recorded;
+            if ((known->mtime != file->mtime) || (known->size != file->size)) {
+                housemotion_index_changed (dir, file, known);
+                changed = 1;
+            }
+        } else {
+            housemotion_index_decode (dir, file);
+            housemotion_index_changed (dir, file, 0);
+            changed = 1;
+        }
+        if (file->mtime >= now - MOTION_INDEX_HOT) hot += 1;
+        if (k < i) files[k] = *file;
+        k += 1;
+    }
+    while (j < dir->count)
+        housemotion_index_changed (dir, 0, dir->files + (j++)); // Gone.
+
+    if (k != dir->count) changed = 1; // Some files were removed.
+    if (changed) HouseMotionIndexVersion += 1;
+
+    housemotion_index_free_files (dir);
+    dir->files = files;
+    dir->count = k;
+    HouseMotionIndexFiles += k;
+    dir->hot = hot;
+
+    housemotion_index_free_subdirs (dir);
+    dir->subdirs = subdirs;
+    dir->subcount = subcount;
+
+    dir->mtime = dirstat->st_mtime;
+    dir->scanned = now;
+    HouseMotionIndexRescanned += 1;
+}
+
+static void housemotion_index_pending (int root, const char *relative) {
+
+    if (HouseMotionIndexPendingCount >= HouseMotionIndexPendingSize) {
+        HouseMotionIndexPendingSize += 64;
+        HouseMotionIndexPending =
+            realloc (HouseMotionIndexPending,
+                     HouseMotionIndexPendingSize * sizeof(HouseMotionPendingDir));
+    }
+    HouseMotionPendingDir *pending =
+        HouseMotionIndexPending + (HouseMotionIndexPendingCount++);
+    pending->root = root;
+    pending->path = strdup (relative);
+}
+
+static void housemotion_index_pending_clear (void) {
+    int i;
+    for (i = 0; i < HouseMotionIndexPendingCount; ++i) {
+        free (HouseMotionIndexPending[i].path);
+    }
+    HouseMotionIndexPendingCount = 0;
+    HouseMotionIndexInProgress = 0;
+}
+
+// Refresh one directory, and queue its subdirectories for later.
+//
+static void housemotion_index_refresh_one (int root,
+                                           const char *relative,
+                                           time_t now) {
+    char fullpath[1024];
+    struct stat dirstat;
+
+    if (relative[0])
+        snprintf (fullpath, sizeof(fullpath),
+                  "%s/%s", HouseMotionIndexRoots[root], relative);
+    else
+        strtcpy (fullpath, HouseMotionIndexRoots[root], sizeof(fullpath));
+
+    HouseMotionIndexStatCount += 1;
+    if (stat (fullpath, &dirstat)) return; // Gone: forgotten later.
+    if (!S_ISDIR(dirstat.st_mode)) return;
+
+    HouseMotionDirectory *dir = housemotion_index_directory (root, relative, 1);
+    dir->generation = HouseMotionIndexGeneration;
+
+    // A directory modified during the same second as the last scan may
+    // have changed after that scan: do not trust it.
+    //
+    int unchanged = dir->scanned
+                        && (dirstat.st_mtime == dir->mtime)
+                        && (dir->mtime < dir->scanned)
+                        && (now < dir->scanned + HouseMotionIndexTtl)
+                        && (dir->hot == 0);
+    if (unchanged)
+        HouseMotionIndexSkipped += 1;
+    else
+        housemotion_index_scan (dir, fullpath, &dirstat, now);
+
+    // Queued in reverse order, so that the walk is done in the
+    // directory order, depth first.
+    //
+    int i;
+    for (i = dir->subcount - 1; i >= 0; --i) {
+        char child[1024];
+        if (relative[0])
+            snprintf (child, sizeof(child), "%s/%s", relative, dir->subdirs[i]);
+        else
+            strtcpy (child, dir->subdirs[i], sizeof(child));
+        housemotion_index_pending (root, child);
+    }
+}
+
+static int housemotion_index_defer (void) {
+    return HouseMotionIndexPasses && housemotion_pressure_defer ();
+}
+
+static long long housemotion_index_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+void housemotion_index_refresh (time_t now) {
+
+    if (!HouseMotionIndexRootsCount) return;
+
+    if (!HouseMotionIndexInProgress) {
+        if (now == HouseMotionIndexLastRefresh) return;
+        if (!HouseMotionIndexRequested) {
+            if (HouseMotionIndexPeriod <= 0) return;
+            if (now < HouseMotionIndexLastRefresh + HouseMotionIndexPeriod)
+                return;
+        }
+
+        // Under pressure, new files are still learnt from the Motion hooks:
+        // walk the storage less often.
+        if ((now < HouseMotionIndexLastRefresh + MOTION_INDEX_DEFER) &&
+            housemotion_index_defer ()) return;
+        HouseMotionIndexLastRefresh = now;
+        HouseMotionIndexRequested = 0;
+
+        HouseMotionIndexGeneration += 1;
+        HouseMotionIndexRescanned = 0;
+        HouseMotionIndexSkipped = 0;
+        HouseMotionIndexStatCount = 0;
+
+        int root;
+        for (root = HouseMotionIndexRootsCount - 1; root >= 0; --root) {
+            if (housemotion_index_alias (root)) continue;
+            housemotion_index_pending (root, "");
+        }
+        HouseMotionIndexInProgress = 1;
+    }
+
+    // Process at least one directory per slice, so that the refresh
+    // always progresses.
+    //
+    long long deadline = housemotion_index_clock () + MOTION_INDEX_SLICE;
+    while (HouseMotionIndexPendingCount > 0) {
+        HouseMotionPendingDir *pending =
+            HouseMotionIndexPending + (--HouseMotionIndexPendingCount);
+        char *relative = pending->path;
+        housemotion_index_refresh_one (pending->root, relative, now);
+        free (relative);
+        if (housemotion_index_clock () >= deadline) return;
+    }
+    HouseMotionIndexInProgress = 0;
+    HouseMotionIndexPasses += 1;
+
+    // Forget all the directories that were not found during this refresh.
+    //
+    int i, k = 0;
+    for (i = 0; i < HouseMotionDirsCount; ++i) {
+        HouseMotionDirectory *dir = HouseMotionDirs + i;
+        if (dir->generation != HouseMotionIndexGeneration) {
+            if (dir->count) HouseMotionIndexVersion += 1;
+            housemotion_index_forget_files (dir);
+            housemotion_index_free_subdirs (dir);
+            free (dir->path);
+            continue;
+        }
+        if (k < i) HouseMotionDirs[k] = *dir;
+        k += 1;
+    }
+    HouseMotionDirsCount = k;
+
+    DEBUG ("Index refresh: %d directories scanned, %d skipped, %d stat\n",
+           HouseMotionIndexRescanned, HouseMotionIndexSkipped,
+           HouseMotionIndexStatCount);
+}
+
+// Split a relative path into the directory entry and file name.
+//
+static HouseMotionDirectory *housemotion_index_split_relative
+                                 (int root, const char *relative,
+                                  const char **name) {
+    const char *sep = strrchr (relative, '/');
+    if (!sep) {
+        *name = relative;
+        return housemotion_index_directory (root, "", 0);
+    }
+    char directory[1024];
+    int dirlength = sep - relative;
+    if (dirlength >= sizeof(directory)) return 0;
+    memcpy (directory, relative, dirlength);
+    directory[dirlength] = 0;
+    *name = sep + 1;
+    return housemotion_index_directory (root, directory, 0);
+}
+
+// Split a full path into the directory entry and file name.
+//
+static HouseMotionDirectory *housemotion_index_split (const char *path,
+                                                      const char **name) {
+    int root;
+    for (root = 0; root < HouseMotionIndexRootsCount; ++root) {
+        if (housemotion_index_alias (root)) continue;
+        const char *rootpath = HouseMotionIndexRoots[root];
+        int length = strlen (rootpath);
+        if (strncmp (path, rootpath, length)) continue;
+        if (path[length] != '/') continue;
+        return housemotion_index_split_relative (root, path + length + 1, name);
+    }
+    return 0;
+}
+
+static int housemotion_index_find (HouseMotionDirectory *dir,
+                                   const char *name, int *position) {
+    int low = 0;
+    int high = dir->count - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int delta = strcmp (name, dir->files[middle].name);
+        if (delta == 0) return middle;
+        if (delta < 0) high = middle - 1;
+        else           low = middle + 1;
+    }
+    if (position) *position = low;
+    return -1;
+}
+
+static void housemotion_index_delete (HouseMotionDirectory *dir, int i) {
+    housemotion_index_changed (dir, 0, dir->files + i);
+    free (dir->files[i].name);
+    dir->count -= 1;
+    if (i < dir->count) {
+        memmove (dir->files+i, dir->files+i+1,
+                 (dir->count - i) * sizeof(HouseMotionFile));
+    }
+    HouseMotionIndexFiles -= 1;
+    HouseMotionIndexVersion += 1;
+}
+
+const HouseMotionFile *housemotion_index_notify (const char *path) {
+
+    const char *name;
+    HouseMotionDirectory *dir = housemotion_index_split (path, &name);
+    if (!dir) { // Unknown directory: the next refresh will find it.
+        HouseMotionIndexRequested = 1;
+        return 0;
+    }
+
+    time_t now = time(0);
+    HouseMotionFile update;
+    update.name = (char *)name;
+    int position;
+    int i = housemotion_index_find (dir, name, &position);
+
+    if (housemotion_index_stat (dir, &update, now)) {
+        if (i >= 0) housemotion_index_delete (dir, i);
+        return 0;
+    }
+    HouseMotionFile previous;
+    if (i < 0) {
+        dir->files = realloc (dir->files,
+                              (dir->count + 1) * sizeof(HouseMotionFile));
+        if (position < dir->count) {
+            memmove (dir->files+position+1, dir->files+position,
+                     (dir->count - position) * sizeof(HouseMotionFile));
+        }
+        dir->count += 1;
+        HouseMotionIndexFiles += 1;
+        i = position;
+        dir->files[i].name = strdup (name);
+        dir->files[i].type = 0;
+        housemotion_index_decode (dir, dir->files + i);
+        previous.name = 0; // New file.
+    } else {
+        previous = dir->files[i];
+    }
+    dir->files[i].mtime = update.mtime;
+    dir->files[i].size = update.size;
+    dir->files[i].checked = now;
+    if (update.mtime >= now - MOTION_INDEX_HOT) dir->hot += 1;
+    HouseMotionIndexVersion += 1;
+    if (!previous.name)
+        housemotion_index_changed (dir, dir->files + i, 0);
+    else if ((previous.mtime != update.mtime) || (previous.size != update.size))
+        housemotion_index_changed (dir, dir->files + i, &previous);
+    return dir->files + i;
+}
+
+void housemotion_index_remove (const char *path) {
+
+    const char *name;
+    HouseMotionDirectory *dir = housemotion_index_split (path, &name);
+    if (!dir) return;
+
+    int i = housemotion_index_find (dir, name, 0);
+    if (i >= 0) housemotion_index_delete (dir, i);
+}
+
+const HouseMotionFile *housemotion_index_lookup (const char *relative,
+                                                const char **root) {
+    int r;
+    for (r = 0; r < HouseMotionIndexRootsCount; ++r) {
+        if (housemotion_index_alias (r)) continue;
+        const char *name;
+        HouseMotionDirectory *dir =
+            housemotion_index_split_relative (r, relative, &name);
+        if (!dir) continue;
+
+        int i = housemotion_index_find (dir, name, 0);
+        if (i < 0) continue;
+        if (root) *root = HouseMotionIndexRoots[r];
+        return dir->files + i;
+    }
+    return 0;
+}
+
+// There are only a few distinct content types: keep only one copy of each.
+//
+static const char *housemotion_index_intern (const char *type) {
+
+    int i;
+    for (i = 0; i < HouseMotionTypesCount; ++i) {
+        if (!strcmp (HouseMotionTypes[i], type)) return HouseMotionTypes[i];
+    }
+    if (HouseMotionTypesCount >= sizeof(HouseMotionTypes)/sizeof(char *))
+        return "application/octet-stream";
+    HouseMotionTypes[HouseMotionTypesCount] = strdup (type);
+    return HouseMotionTypes[HouseMotionTypesCount++];
+}
+
+void housemotion_index_background (time_t now) {
+
+    if ((!HouseMotionMagic) || (!HouseMotionTypeCount)) return;
+    if (housemotion_pressure_defer ()) return; // Not urgent.
+
+    // A file still being written is moved to the end of the queue, and
+    // retried once all the other files were visited.
+    //
+    int visited = 0;
+    while ((visited++ < MOTION_INDEX_TYPE_BATCH) && (HouseMotionTypeCount > 0)) {
+
+        HouseMotionUntyped untyped = HouseMotionTypeQueue[HouseMotionTypeFirst];
+        HouseMotionTypeFirst += 1;
+        HouseMotionTypeCount -= 1;
+        if (!HouseMotionTypeCount) HouseMotionTypeFirst = 0;
+
+        const char *name;
+        HouseMotionDirectory *dir =
+            housemotion_index_split_relative (untyped.root,
+                                              untyped.relative, &name);
+        int i = dir ? housemotion_index_find (dir, name, 0) : -1;
+        if ((i < 0) || dir->files[i].type) { // Gone, or already known.
+            free (untyped.relative);
+            continue;
+        }
+        HouseMotionFile *file = dir->files + i;
+        if (file->mtime >= now - MOTION_INDEX_HOT) {
+            housemotion_index_untyped (untyped.root, untyped.relative);
+            free (untyped.relative);
+            continue;
+        }
+        char path[1024];
+        housemotion_index_fullpath (path, sizeof(path), dir, file->name);
+        const char *type = magic_file (HouseMotionMagic, path);
+        file->type =
+            housemotion_index_intern (type?type:"application/octet-stream");
+        HouseMotionTypeDetected += 1;
+        free (untyped.relative);
+    }
+}
+
+int housemotion_index_enumerate (int instance,
+                                 housemotion_index_iterator *iterator,
+                                 void *context) {
+    int i, j;
+    for (i = 0; i < HouseMotionDirsCount; ++i) {
+        HouseMotionDirectory *dir = HouseMotionDirs + i;
+        if ((instance >= 0) && (dir->root != instance)) continue;
+        const char *root = HouseMotionIndexRoots[dir->root];
+        for (j = 0; j < dir->count; ++j) {
+            if (iterator (root, dir->path, dir->files+j, context)) return 1;
+        }
+    }
+    return 0;
+}
+
+void housemotion_index_request (void) {
+    HouseMotionIndexRequested = 1;
+}
+
+int housemotion_index_ready (void) {
+    return HouseMotionIndexPasses > 0;
+}
+
+void housemotion_index_listen (housemotion_index_listener *listener) {
+    if (HouseMotionIndexListenersCount >= MOTION_INDEX_LISTENERS) return;
+    HouseMotionIndexListeners[HouseMotionIndexListenersCount++] = listener;
+}
+
+long long housemotion_index_version (void) {
+    return HouseMotionIndexVersion;
+}
+
+int housemotion_index_status (char *buffer, int size) {
+
+    return snprintf (buffer, size,
+                     "\"scan\":{\"mode\":\"%s\",\"ttl\":%d,\"period\":%d,"
+                         "\"directories\":%d,\"files\":%lld,"
+                         "\"rescanned\":%d,\"skipped\":%d,\"stat\":%d,"
+                         "\"typed\":%lld,\"untyped\":%d}",
+                     HouseMotionIndexNetwork?"network":"local",
+                     HouseMotionIndexTtl, HouseMotionIndexPeriod,
+                     HouseMotionDirsCount, HouseMotionIndexFiles,
+                     HouseMotionIndexRescanned, HouseMotionIndexSkipped,
+                     HouseMotionIndexStatCount, HouseMotionTypeDetected,
+                     HouseMotionTypeCount);
+}
+
+void housemotion_index_location (int instance, const char *root) {
+
+    if ((instance < 0) || (instance >= MOTION_INDEX_ROOTS)) return;
+
+    char *existing = HouseMotionIndexRoots[instance];
+    if (existing) {
+        if (!strcmp (existing, root)) return; // No change.
+        free (existing);
+    }
+    housemotion_index_clear (instance);
+    HouseMotionIndexRoots[instance] = strdup (root);
+    if (instance >= HouseMotionIndexRootsCount)
+        HouseMotionIndexRootsCount = instance + 1;
+    HouseMotionIndexLastRefresh = 0;
+    HouseMotionIndexRequested = 1;
+
+    // Restart the current refresh, if any, so that it covers the new root.
+    housemotion_index_pending_clear ();
+}
+
+void housemotion_index_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *mode = 0;
+    const char *ttl = 0;
+    const char *period = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-scan=", argv[i], &mode);
+        echttp_option_match ("-motion-scan-ttl=", argv[i], &ttl);
+        echttp_option_match ("-motion-scan-period=", argv[i], &period);
+    }
+    if (mode) {
+        if (!strcmp (mode, "network")) {
+            HouseMotionIndexNetwork = 1;
+        } else if (strcmp (mode, "local")) {
+            houselog_trace (HOUSE_FAILURE, "OPTION",
+                            "invalid scan mode %s", mode);
+        }
+    }
+    if (ttl) {
+        HouseMotionIndexTtl = atoi(ttl);
+        if (HouseMotionIndexTtl < 10) HouseMotionIndexTtl = 10;
+    }
+    if (period) {
+        HouseMotionIndexPeriod = atoi(period);
+        if (HouseMotionIndexPeriod < 0) HouseMotionIndexPeriod = 0;
+    }
+
+    HouseMotionMagic = magic_open (MAGIC_MIME_TYPE);
+    if (HouseMotionMagic && magic_load (HouseMotionMagic, 0)) {
+        houselog_trace (HOUSE_FAILURE, "libmagic",
+                        "%s", magic_error (HouseMotionMagic));
+        magic_close (HouseMotionMagic);
+        HouseMotionMagic = 0;
+    }
+}
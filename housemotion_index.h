@@ -0,0 +1,61 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_index.h - An in-memory index of the Motion recording files.
+ */
+typedef struct {
+    char     *name;
+    time_t    mtime;
+    long long size;
+    time_t    checked;
+    const char *type;
+    const char *camera;   // Decoded from the file name, 0 if unknown.
+    int         event;    // Decoded from the file name, -1 if unknown.
+    time_t      recorded; // Decoded from the file name, 0 if unknown.
+} HouseMotionFile;
+
+void housemotion_index_initialize (int argc, const char **argv);
+void housemotion_index_location (int instance, const char *root);
+
+void housemotion_index_refresh (time_t now);
+void housemotion_index_request (void);
+int  housemotion_index_ready (void);
+void housemotion_index_background (time_t now);
+const HouseMotionFile *housemotion_index_notify (const char *path);
+void housemotion_index_remove (const char *path);
+
+const HouseMotionFile *housemotion_index_lookup (const char *relative,
+                                                const char **root);
+
+typedef int housemotion_index_iterator (const char *root,
+                                        const char *directory,
+                                        const HouseMotionFile *file,
+                                        void *context);
+int  housemotion_index_enumerate (int instance,
+                                  housemotion_index_iterator *iterator,
+                                  void *context);
+
+typedef void housemotion_index_listener (int root, const char *relative,
+                                         const HouseMotionFile *file,
+                                         const HouseMotionFile *previous);
+void housemotion_index_listen (housemotion_index_listener *listener);
+
+long long housemotion_index_version (void);
+int  housemotion_index_status (char *buffer, int size);
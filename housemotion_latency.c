@@ -0,0 +1,363 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_latency.c - Measure the detection to archive latency.
+ *
+ * SYNOPSYS:
+ *
+ * This module follows each Motion event from the end of the detection
+ * to the moment every file of that event has been downloaded, and keeps
+ * statistics (per camera) about each stage of this pipeline:
+ *
+ * - stable: from the Motion end hook to the moment all the indexed
+ *   files of the event are stable, i.e. could be downloaded.
+ * - poll: from the stable transition to the first download request
+ *   for a file of the event.
+ * - transfer: from the first download request to the download request
+ *   for the last file of the event. (The end of the actual transfer is
+ *   not visible to this service, since it is handled by echttp.) Only
+ *   the first complete download of each file counts: downloading the
+ *   same file again, or a part of it, does not end the event sooner.
+ * - total: from the Motion end hook to the last download request.
+ *
+ * The files of an event are identified by the event text being part of
+ * the file name (see the README file). They are learnt from the index,
+ * whichever way they were found (Motion hooks or storage walk), so that
+ * the measure does not depend on which listing the DVR polls.
+ *
+ * void housemotion_latency_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_latency_start (const char *camera, const char *event);
+ *
+ *    Start tracking an event, so that its files are counted as they are
+ *    indexed.
+ *
+ * void housemotion_latency_end (const char *camera, const char *event,
+ *                               time_t start, int files);
+ *
+ *    Mark an event as ended (tracking it if its start was not seen). The
+ *    start time and number of files are from the active events table
+ *    (0 if unknown).
+ *
+ * void housemotion_latency_served (const char *relative, int complete);
+ *
+ *    Observe a download request for one recording file. The complete flag
+ *    indicates that the response reaches the end of a stable file.
+ *
+ * void housemotion_latency_background (time_t now);
+ *
+ *    Detect the events that became stable, and forget the events that
+ *    were never fully downloaded.
+ *
+ * int housemotion_latency_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the latency percentiles for each camera.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_index.h"
+#include "housemotion_latency.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define LATENCY_STABLE   0
+#define LATENCY_POLL     1
+#define LATENCY_TRANSFER 2
+#define LATENCY_TOTAL    3
+#define LATENCY_STAGES   4
+
+static const char *LatencyStageNames[LATENCY_STAGES] = {
+    "stable", "poll", "transfer", "total"
+};
+
+// The events being followed, from their start to their full download.
+//
+struct HouseMotionTracked {
+    char      camera[32];
+    char      id[128];
+    time_t    start;
+    long long ended;    // All times are in milliseconds, 0 if not yet.
+    long long stable;
+    long long first;
+    int       files;
+    int       served;
+    unsigned int *done; // The hash of each file served, to ignore repeats.
+    int       indexed;  // Number of files of the event found in the index.
+    time_t    latest;   // Most recent modification of these files.
+};
+
+#define LATENCY_TRACKED 64
+#define LATENCY_TIMEOUT 86400
+
+// A file is stable if it was not modified after the end of its event,
+// or else for this many seconds (see housemotion_store.c).
+//
+#define LATENCY_QUIET 60
+
+static struct HouseMotionTracked LatencyTracked[LATENCY_TRACKED];
+static int LatencyTrackedCount = 0;
+
+// The most recent samples for each camera.
+//
+#define LATENCY_SAMPLES 100
+#define LATENCY_CAMERAS 32
+
+struct HouseMotionLatency {
+    char camera[32];
+    int  count;
+    int  cursor;
+    int  samples[LATENCY_STAGES][LATENCY_SAMPLES];
+};
+
+static struct HouseMotionLatency LatencyCameras[LATENCY_CAMERAS];
+static int LatencyCamerasCount = 0;
+
+
+static long long housemotion_latency_now (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return ((long long)(now.tv_sec) * 1000) + (now.tv_usec / 1000);
+}
+
+static void housemotion_latency_forget (int i) {
+    if (LatencyTracked[i].done) free (LatencyTracked[i].done);
+    LatencyTrackedCount -= 1;
+    if (i < LatencyTrackedCount) {
+        memmove (LatencyTracked+i, LatencyTracked+i+1,
+                 (LatencyTrackedCount - i) * sizeof(LatencyTracked[0]));
+    }
+}
+
+static struct HouseMotionTracked *housemotion_latency_track
+                                       (const char *camera, const char *event) {
+
+    if (LatencyTrackedCount >= LATENCY_TRACKED)
+        housemotion_latency_forget (0); // Give up on the oldest.
+
+    struct HouseMotionTracked *tracked =
+        LatencyTracked + (LatencyTrackedCount++);
+    memset (tracked, 0, sizeof(*tracked));
+    strtcpy (tracked->camera, camera, sizeof(tracked->camera));
+    strtcpy (tracked->id, event, sizeof(tracked->id));
+    return tracked;
+}
+
+void housemotion_latency_start (const char *camera, const char *event) {
+
+    struct HouseMotionTracked *tracked =
+        housemotion_latency_track (camera?camera:"cctv", event);
+    tracked->start = time(0);
+}
+
+void housemotion_latency_end (const char *camera, const char *event,
+                              time_t start, int files) {
+
+    int i;
+    struct HouseMotionTracked *tracked = 0;
+    for (i = LatencyTrackedCount - 1; i >= 0; --i) {
+        if (LatencyTracked[i].ended) continue;
+        if (strcmp (LatencyTracked[i].id, event)) continue;
+        tracked = LatencyTracked + i;
+        break;
+    }
+    if (!tracked) tracked = housemotion_latency_track (camera, event);
+
+    tracked->ended = housemotion_latency_now ();
+    if (start) tracked->start = start;
+    if (!tracked->start) tracked->start = (tracked->ended / 1000) - 3600;
+    if (files > tracked->files) tracked->files = files;
+}
+
+// Follow the files of the events being tracked, as they are indexed.
+//
+static void housemotion_latency_indexed (int root, const char *relative,
+                                         const HouseMotionFile *file,
+                                         const HouseMotionFile *previous) {
+    int i;
+    if (!file) return; // Deleted files do not matter here.
+
+    for (i = 0; i < LatencyTrackedCount; ++i) {
+        struct HouseMotionTracked *tracked = LatencyTracked + i;
+        if (tracked->stable) continue;
+        if (file->mtime < tracked->start) continue; // Quick elimination.
+        if (!strstr (relative, tracked->id)) continue;
+        if (!previous) tracked->indexed += 1;
+        if (file->mtime > tracked->latest) tracked->latest = file->mtime;
+    }
+}
+
+static struct HouseMotionLatency *housemotion_latency_camera (const char *camera) {
+
+    int i;
+    for (i = 0; i < LatencyCamerasCount; ++i) {
+        if (!strcmp (LatencyCameras[i].camera, camera))
+            return LatencyCameras + i;
+    }
+    if (LatencyCamerasCount >= LATENCY_CAMERAS) return 0;
+
+    struct HouseMotionLatency *latency = LatencyCameras + (LatencyCamerasCount++);
+    memset (latency, 0, sizeof(*latency));
+    strtcpy (latency->camera, camera, sizeof(latency->camera));
+    return latency;
+}
+
+static void housemotion_latency_complete (int i) {
+
+    struct HouseMotionTracked *tracked = LatencyTracked + i;
+    struct HouseMotionLatency *latency =
+        housemotion_latency_camera (tracked->camera);
+
+    if (latency) {
+        long long now = housemotion_latency_now ();
+        int cursor = latency->cursor;
+        latency->samples[LATENCY_STABLE][cursor] =
+            (int)(tracked->stable - tracked->ended);
+        latency->samples[LATENCY_POLL][cursor] =
+            (int)(tracked->first - tracked->stable);
+        latency->samples[LATENCY_TRANSFER][cursor] =
+            (int)(now - tracked->first);
+        latency->samples[LATENCY_TOTAL][cursor] =
+            (int)(now - tracked->ended);
+        latency->cursor = (cursor + 1) % LATENCY_SAMPLES;
+        if (latency->count < LATENCY_SAMPLES) latency->count += 1;
+    }
+    housemotion_latency_forget (i);
+}
+
+static unsigned int housemotion_latency_hash (const char *relative) {
+    unsigned int hash = 2166136261u;
+    while (*relative) {
+        hash ^= (unsigned char)(*relative++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void housemotion_latency_served (const char *relative, int complete) {
+
+    int i;
+    for (i = LatencyTrackedCount - 1; i >= 0; --i) {
+        struct HouseMotionTracked *tracked = LatencyTracked + i;
+        if (!tracked->stable) continue; // Not offered yet.
+        if (!strstr (relative, tracked->id)) continue;
+
+        if (!tracked->first) tracked->first = housemotion_latency_now ();
+        if (!complete) return;
+
+        // A file downloaded again does not count twice.
+        int j;
+        unsigned int hash = housemotion_latency_hash (relative);
+        for (j = 0; j < tracked->served; ++j) {
+            if (tracked->done[j] == hash) return;
+        }
+        unsigned int *done =
+            realloc (tracked->done, (tracked->served + 1) * sizeof(hash));
+        if (!done) return;
+        done[tracked->served++] = hash;
+        tracked->done = done;
+
+        if (tracked->served >= tracked->files)
+            housemotion_latency_complete (i);
+        return;
+    }
+}
+
+void housemotion_latency_background (time_t now) {
+
+    int i;
+    long long stable = 0;
+    for (i = 0; i < LatencyTrackedCount; ++i) {
+        struct HouseMotionTracked *tracked = LatencyTracked + i;
+        if ((!tracked->ended) || tracked->stable) continue;
+        if (tracked->indexed <= 0) continue; // No file found yet.
+        if ((tracked->latest > tracked->ended / 1000) &&
+            (tracked->latest >= now - LATENCY_QUIET)) continue;
+        if (!stable) stable = housemotion_latency_now ();
+        tracked->stable = stable;
+        if (tracked->files < tracked->indexed) tracked->files = tracked->indexed;
+    }
+
+    for (i = LatencyTrackedCount - 1; i >= 0; --i) {
+        if (LatencyTracked[i].start < now - LATENCY_TIMEOUT)
+            housemotion_latency_forget (i);
+    }
+}
+
+void housemotion_latency_initialize (int argc, const char **argv) {
+    housemotion_index_listen (housemotion_latency_indexed);
+}
+
+static int housemotion_latency_compare (const void *a, const void *b) {
+    return *((const int *)a) - *((const int *)b);
+}
+
+int housemotion_latency_status (char *buffer, int size) {
+
+    int i, j;
+    int cursor = snprintf (buffer, size, "\"latency\":{");
+    if (cursor >= size) goto overflow;
+
+    const char *prefix = "";
+    for (i = 0; i < LatencyCamerasCount; ++i) {
+        struct HouseMotionLatency *latency = LatencyCameras + i;
+        if (!latency->count) continue;
+
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":{\"count\":%d",
+                            prefix, latency->camera, latency->count);
+        if (cursor >= size) goto overflow;
+
+        for (j = 0; j < LATENCY_STAGES; ++j) {
+            int sorted[LATENCY_SAMPLES];
+            int count = latency->count;
+            memcpy (sorted, latency->samples[j], count * sizeof(int));
+            qsort (sorted, count, sizeof(int), housemotion_latency_compare);
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                ",\"%s\":[%d,%d,%d]",
+                                LatencyStageNames[j],
+                                sorted[(count * 50) / 100],
+                                sorted[(count * 90) / 100],
+                                sorted[count - 1]);
+            if (cursor >= size) goto overflow;
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
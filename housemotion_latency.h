@@ -0,0 +1,32 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_latency.h - Measure the detection to archive latency.
+ */
+void housemotion_latency_initialize (int argc, const char **argv);
+
+void housemotion_latency_start (const char *camera, const char *event);
+void housemotion_latency_end (const char *camera, const char *event,
+                              time_t start, int files);
+
+void housemotion_latency_served (const char *relative, int complete);
+
+void housemotion_latency_background (time_t now);
+int  housemotion_latency_status (char *buffer, int size);
@@ -0,0 +1,408 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_manifest.c - Block hash manifests of the recordings.
+ *
+ * SYNOPSYS:
+ *
+ * A large movie downloaded over an unreliable link may be corrupted. The
+ * manifest of a recording lists the SHA-256 hash of each fixed size block
+ * of the file, so that a DVR can verify each block and fetch again only
+ * the blocks that failed (see the offset and length parameters of the
+ * /cctv/recording endpoint).
+ *
+ * The manifests are computed in the background, on demand: the first
+ * request for a manifest queues the file and is answered with a 503
+ * status and a Retry-After header. The hashing is done in short time
+ * slices, reading 64 KB at a time, so that it never stalls the service, and is postponed when
+ * the system is under pressure. The most recent manifests are kept in
+ * memory, and are discarded when the file changes, or when the system
+ * is short of memory.
+ *
+ * void housemotion_manifest_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_manifest_background (void);
+ *
+ *    Hash the next blocks of the pending files, for a short time. The
+ *    completed manifests are released under memory pressure.
+ *
+ * int housemotion_manifest_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the manifest statistics.
+ *
+ * The manifest of a recording is retrieved using the following request:
+ *
+ *    GET /cctv/recording-manifest/PATH
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_pressure.h"
+#include "housemotion_store.h"
+#include "housemotion_manifest.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_MANIFEST_MAX     64
+#define MOTION_MANIFEST_PENDING 16
+#define MOTION_MANIFEST_SLICE   50 // milliseconds.
+#define MOTION_MANIFEST_HASH    32 // SHA-256.
+#define MOTION_MANIFEST_READ    (64 * 1024)
+
+typedef struct {
+    char     *relative;
+    long long size;
+    time_t    mtime;
+    int       count;      // Number of blocks hashed so far.
+    unsigned char *hashes;
+    time_t    used;
+} MotionManifest;
+
+static MotionManifest HouseMotionManifests[MOTION_MANIFEST_MAX];
+
+static long long HouseMotionBlockSize = 4 * 1024 * 1024;
+
+// The manifests being computed, first in first out. Only the first one
+// has its file open. Each block is read and hashed in small parts, so
+// that a slice may end in the middle of a block.
+//
+static int HouseMotionPending[MOTION_MANIFEST_PENDING];
+static int HouseMotionPendingCount = 0;
+static int HouseMotionPendingFd = -1;
+static EVP_MD_CTX *HouseMotionDigest = 0;
+static long long HouseMotionBlockDone = 0; // Bytes hashed in this block.
+static unsigned char HouseMotionBlock[MOTION_MANIFEST_READ];
+
+static int HouseMotionManifestKept = 0; // Completed manifests in memory.
+
+static long long HouseMotionManifestServed = 0;
+static long long HouseMotionManifestComputed = 0;
+static long long HouseMotionManifestBytes = 0;
+
+static long long housemotion_manifest_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static int housemotion_manifest_blocks (long long size) {
+    return (int)((size + HouseMotionBlockSize - 1) / HouseMotionBlockSize);
+}
+
+static void housemotion_manifest_clear (MotionManifest *manifest) {
+    free (manifest->relative);
+    free (manifest->hashes);
+    memset (manifest, 0, sizeof(*manifest));
+}
+
+static MotionManifest *housemotion_manifest_search (const char *relative) {
+    int i;
+    for (i = 0; i < MOTION_MANIFEST_MAX; ++i) {
+        MotionManifest *manifest = HouseMotionManifests + i;
+        if (manifest->relative && (!strcmp (manifest->relative, relative)))
+            return manifest;
+    }
+    return 0;
+}
+
+static int housemotion_manifest_is_pending (int slot) {
+    int i;
+    for (i = 0; i < HouseMotionPendingCount; ++i) {
+        if (HouseMotionPending[i] == slot) return 1;
+    }
+    return 0;
+}
+
+// Reuse the least recently used manifest that is not being computed.
+//
+static MotionManifest *housemotion_manifest_new (const char *relative,
+                                                 long long size,
+                                                 time_t mtime) {
+    int i;
+    MotionManifest *manifest = 0;
+    for (i = 0; i < MOTION_MANIFEST_MAX; ++i) {
+        if (housemotion_manifest_is_pending (i)) continue;
+        MotionManifest *candidate = HouseMotionManifests + i;
+        if ((!manifest) || (candidate->used < manifest->used))
+            manifest = candidate;
+    }
+    if (!manifest) return 0;
+
+    housemotion_manifest_clear (manifest);
+    manifest->relative = strdup (relative);
+    manifest->size = size;
+    manifest->mtime = mtime;
+    manifest->hashes = malloc (housemotion_manifest_blocks(size)
+                                   * MOTION_MANIFEST_HASH + 1);
+    manifest->used = time(0);
+    return manifest;
+}
+
+static void housemotion_manifest_next (void) {
+    if (HouseMotionPendingFd >= 0) close (HouseMotionPendingFd);
+    HouseMotionPendingFd = -1;
+    HouseMotionBlockDone = 0;
+    HouseMotionPendingCount -= 1;
+    if (HouseMotionPendingCount > 0)
+        memmove (HouseMotionPending, HouseMotionPending+1,
+                 HouseMotionPendingCount * sizeof(HouseMotionPending[0]));
+}
+
+// Release all the completed manifests: they are computed again on demand.
+//
+static void housemotion_manifest_shrink (void) {
+    int i;
+    for (i = 0; i < MOTION_MANIFEST_MAX; ++i) {
+        if (housemotion_manifest_is_pending (i)) continue;
+        housemotion_manifest_clear (HouseMotionManifests + i);
+    }
+    HouseMotionManifestKept = 0;
+}
+
+void housemotion_manifest_background (void) {
+
+    if (HouseMotionManifestKept && housemotion_pressure_shrink ())
+        housemotion_manifest_shrink ();
+
+    if (!HouseMotionPendingCount) return;
+    if (housemotion_pressure_defer ()) return; // Try again later.
+
+    long long deadline = housemotion_manifest_clock() + MOTION_MANIFEST_SLICE;
+
+    while (HouseMotionPendingCount > 0) {
+
+        MotionManifest *manifest = HouseMotionManifests + HouseMotionPending[0];
+        int blocks = housemotion_manifest_blocks (manifest->size);
+
+        if (HouseMotionPendingFd < 0) {
+            long long size;
+            time_t mtime;
+            const char *type;
+            HouseMotionPendingFd =
+                housemotion_store_open (manifest->relative, &size, &mtime, &type);
+            if ((HouseMotionPendingFd < 0) ||
+                (size != manifest->size) || (mtime != manifest->mtime)) {
+                // The file was deleted or changed since it was queued.
+                housemotion_manifest_clear (manifest);
+                housemotion_manifest_next ();
+                continue;
+            }
+            // The file is positioned at the start of the recording (which
+            // is not the start of the file for a packed picture).
+            if (manifest->count > 0)
+                lseek (HouseMotionPendingFd,
+                       manifest->count * HouseMotionBlockSize, SEEK_CUR);
+        }
+
+        while (manifest->count < blocks) {
+            long long remaining =
+                manifest->size - (manifest->count * HouseMotionBlockSize);
+            long long length = (remaining < HouseMotionBlockSize) ?
+                                   remaining : HouseMotionBlockSize;
+            if (!HouseMotionBlockDone)
+                EVP_DigestInit_ex (HouseMotionDigest, EVP_sha256(), 0);
+            while (HouseMotionBlockDone < length) {
+                long long wanted = length - HouseMotionBlockDone;
+                if (wanted > MOTION_MANIFEST_READ) wanted = MOTION_MANIFEST_READ;
+                int n = read (HouseMotionPendingFd, HouseMotionBlock, wanted);
+                if (n <= 0) break;
+                EVP_DigestUpdate (HouseMotionDigest, HouseMotionBlock, n);
+                HouseMotionBlockDone += n;
+                HouseMotionManifestBytes += n;
+                if ((HouseMotionBlockDone < length) &&
+                    (housemotion_manifest_clock() >= deadline)) return;
+            }
+            if (HouseMotionBlockDone < length) {
+                houselog_trace (HOUSE_FAILURE, manifest->relative,
+                                "short read at block %d", manifest->count);
+                housemotion_manifest_clear (manifest);
+                break;
+            }
+            unsigned int hashlength;
+            EVP_DigestFinal_ex (HouseMotionDigest,
+                                manifest->hashes
+                                    + (manifest->count * MOTION_MANIFEST_HASH),
+                                &hashlength);
+            manifest->count += 1;
+            HouseMotionBlockDone = 0;
+
+            if (housemotion_manifest_clock() >= deadline) return;
+        }
+        if (manifest->relative) {
+            HouseMotionManifestComputed += 1;
+            HouseMotionManifestKept = 1;
+            DEBUG ("Manifest of %s: %d blocks\n", manifest->relative, blocks);
+        }
+        housemotion_manifest_next ();
+    }
+}
+
+static const char *housemotion_manifest_serve (const MotionManifest *manifest) {
+
+    static char *buffer = 0;
+    static int buffersize = 0;
+
+    int i, j;
+    int blocks = housemotion_manifest_blocks (manifest->size);
+    int needed = 512 + strlen(manifest->relative)
+                     + (blocks * (MOTION_MANIFEST_HASH * 2 + 4));
+    if (needed > buffersize) {
+        buffersize = needed;
+        buffer = realloc (buffer, buffersize);
+    }
+    int cursor = snprintf (buffer, buffersize,
+                           "{\"path\":\"%s\",\"size\":%lld,\"mtime\":%lld,"
+                               "\"block\":%lld,\"algorithm\":\"sha256\","
+                               "\"blocks\":[",
+                           manifest->relative, manifest->size,
+                           (long long)(manifest->mtime), HouseMotionBlockSize);
+    for (i = 0; i < blocks; ++i) {
+        const unsigned char *hash =
+            manifest->hashes + (i * MOTION_MANIFEST_HASH);
+        if (i > 0) buffer[cursor++] = ',';
+        buffer[cursor++] = '"';
+        for (j = 0; j < MOTION_MANIFEST_HASH; ++j) {
+            cursor += snprintf (buffer+cursor, buffersize-cursor,
+                                "%02x", hash[j]);
+        }
+        buffer[cursor++] = '"';
+    }
+    snprintf (buffer+cursor, buffersize-cursor, "]}");
+    echttp_content_type_json ();
+    HouseMotionManifestServed += 1;
+    return buffer;
+}
+
+static const char *housemotion_manifest_request (const char *method,
+                                                 const char *uri,
+                                                 const char *data,
+                                                 int length) {
+
+    const char *relative = uri + strlen("/cctv/recording-manifest");
+    while (*relative == '/') relative += 1;
+
+    if ((!relative[0]) || strstr (relative, "..")) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+
+    // Verify that the file did not change since the manifest was computed.
+    long long size;
+    time_t mtime;
+    const char *type;
+    int fd = housemotion_store_open (relative, &size, &mtime, &type);
+    if (fd < 0) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    close (fd);
+
+    MotionManifest *manifest = housemotion_manifest_search (relative);
+    if (manifest && ((manifest->size != size) || (manifest->mtime != mtime))) {
+        if ((HouseMotionPendingCount > 0) &&
+            (manifest == HouseMotionManifests + HouseMotionPending[0])) {
+            housemotion_manifest_next (); // Stop hashing an obsolete file.
+        }
+        if (!housemotion_manifest_is_pending (manifest-HouseMotionManifests)) {
+            housemotion_manifest_clear (manifest);
+            manifest = 0;
+        }
+    }
+    if (manifest) {
+        manifest->used = time(0);
+        if (manifest->count >= housemotion_manifest_blocks (manifest->size))
+            return housemotion_manifest_serve (manifest);
+    } else {
+        if (HouseMotionPendingCount >= MOTION_MANIFEST_PENDING) {
+            echttp_attribute_set ("Retry-After", "10");
+            echttp_error (503, "Too many manifests pending");
+            return "";
+        }
+        manifest = housemotion_manifest_new (relative, size, mtime);
+        if (!manifest) {
+            echttp_attribute_set ("Retry-After", "10");
+            echttp_error (503, "No manifest available");
+            return "";
+        }
+        HouseMotionPending[HouseMotionPendingCount++] =
+            manifest - HouseMotionManifests;
+    }
+
+    // Estimate how long the hashing will take, assuming that about 50 MB
+    // are hashed every second.
+    //
+    char ascii[32];
+    long long remaining =
+        manifest->size - (manifest->count * HouseMotionBlockSize);
+    snprintf (ascii, sizeof(ascii), "%lld", 1 + (remaining / 50000000));
+    echttp_attribute_set ("Retry-After", ascii);
+    echttp_error (503, "Manifest in progress");
+    return "";
+}
+
+int housemotion_manifest_status (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size,
+                           "\"manifests\":{\"block\":%lld,\"pending\":%d,"
+                               "\"computed\":%lld,\"served\":%lld,"
+                               "\"bytes\":%lld}",
+                           HouseMotionBlockSize, HouseMotionPendingCount,
+                           HouseMotionManifestComputed,
+                           HouseMotionManifestServed,
+                           HouseMotionManifestBytes);
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+void housemotion_manifest_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *block = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-block=", argv[i], &block);
+    }
+    if (block) {
+        HouseMotionBlockSize = atoll (block) * 1024;
+        if (HouseMotionBlockSize < 64 * 1024) HouseMotionBlockSize = 64 * 1024;
+    }
+    HouseMotionDigest = EVP_MD_CTX_new ();
+
+    echttp_route_match ("/cctv/recording-manifest",
+                        housemotion_manifest_request);
+}
@@ -0,0 +1,523 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_order.c - Keep the recordings sorted by age and size.
+ *
+ * SYNOPSYS:
+ *
+ * This module keeps sorted views of the recordings, which are updated
+ * each time a file is added, modified or removed from the index (see
+ * housemotion_index_listen()) or from the packs (see
+ * housemotion_pack_listen()). This is used by the cleanup to find the
+ * oldest event, and to list the recordings, without walking and sorting
+ * the whole index each time.
+ *
+ * Each order is made of two sorted arrays: the base, which is large and
+ * only rebuilt once in a while, and the overlay, which is small and holds
+ * the files added or modified since the base was last built. A removed
+ * or modified file is only marked as stale in the base. The overlay is
+ * merged into the base, and the stale elements dropped, when it has grown
+ * larger than a fraction of the base: this is a linear merge, so that the
+ * cost of keeping the order is proportional to the number of changes.
+ *
+ * void housemotion_order_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * int housemotion_order_enumerate (int order, int descending, long long from,
+ *                                  housemotion_order_iterator *iterator,
+ *                                  void *context);
+ *
+ *    Call the iterator for each recording, in the specified order, starting
+ *    at the first recording with a key equal or above from (or equal or
+ *    below when descending), until the iterator returns a non-zero value.
+ *    Return 1 if the enumeration was stopped by the iterator, 0 otherwise.
+ *    The iterator must not cause any change to the index or the packs.
+ *    The packed pictures are flagged as such.
+ *
+ * void housemotion_order_start (HouseMotionOrderCursor *cursor);
+ * int housemotion_order_resume (int order, HouseMotionOrderCursor *cursor,
+ *                               housemotion_order_iterator *iterator,
+ *                               void *context);
+ *
+ *    Enumerate the recordings in ascending order, in several steps: each
+ *    call resumes after the last recording passed to the iterator during
+ *    the previous call (or from the start, after housemotion_order_start),
+ *    until the iterator returns a non-zero value. Return 0 once all the
+ *    recordings have been enumerated. Recordings added or modified in
+ *    between are only enumerated if they sort after the cursor.
+ *
+ * int housemotion_order_status (char *buffer, int size);
+ *
+ *    Populate a JSON overview of the sorted arrays.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_index.h"
+#include "housemotion_pack.h"
+#include "housemotion_order.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+// An entry is either in the base arrays or in the overlay arrays,
+// never in both.
+//
+#define MOTION_ORDER_BASE    1
+#define MOTION_ORDER_OVERLAY 2
+
+// The overlay is merged once it holds more than this many entries, or
+// more than 1/16th of all the entries.
+//
+#define MOTION_ORDER_MERGE 1024
+
+typedef struct {
+    HouseMotionRecording recording; // The entry is free if relative is 0.
+    int flags;
+    int next; // Next entry in the same hash bucket, or in the free list.
+} HouseMotionOrdered;
+
+static HouseMotionOrdered *HouseMotionOrderEntries = 0;
+static int HouseMotionOrderEntriesCount = 0;
+static int HouseMotionOrderEntriesSize = 0;
+static int HouseMotionOrderFree = -1;
+static int HouseMotionOrderLive = 0;
+
+static int *HouseMotionOrderBuckets = 0;
+static int  HouseMotionOrderBucketsCount = 0;
+
+typedef struct {
+    long long key;
+    int       id;
+} HouseMotionOrderKey;
+
+typedef struct {
+    HouseMotionOrderKey *base;
+    HouseMotionOrderKey *overlay;
+    int head; // There is no valid base element before this position.
+} HouseMotionOrderList;
+
+static HouseMotionOrderList HouseMotionOrders[HOUSEMOTION_ORDER_COUNT];
+
+static int HouseMotionOrderBaseCount = 0; // Same for all orders.
+static int HouseMotionOrderOverlayCount = 0;
+static int HouseMotionOrderOverlaySize = 0;
+static int HouseMotionOrderStale = 0;
+static long long HouseMotionOrderMerges = 0;
+
+
+static long long housemotion_order_key (int order,
+                                        const HouseMotionRecording *recording) {
+    switch (order) {
+        case HOUSEMOTION_ORDER_TIME: return (long long)(recording->mtime);
+        case HOUSEMOTION_ORDER_SIZE: return recording->size;
+    }
+    return 0;
+}
+
+static int housemotion_order_compare (const HouseMotionOrderKey *a,
+                                      long long key, int id) {
+    if (a->key != key) return (a->key < key) ? -1 : 1;
+    if (a->id != id) return (a->id < id) ? -1 : 1;
+    return 0;
+}
+
+// Return the position of the first element equal or above (key, id).
+//
+static int housemotion_order_search (const HouseMotionOrderKey *list, int count,
+                                     long long key, int id) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (housemotion_order_compare (list + middle, key, id) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// A picture is briefly both in the index and in a pack while it is
+// being packed: the packed pictures are distinct entries.
+//
+static unsigned int housemotion_order_hash (int root, const char *relative,
+                                            int packed) {
+    unsigned int hash = 2166136261u ^ (unsigned int)(root * 2 + packed);
+    for (; *relative; ++relative) {
+        hash ^= (unsigned char)(*relative);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int housemotion_order_find (int root, const char *relative,
+                                   int packed) {
+
+    if (!HouseMotionOrderBucketsCount) return -1;
+
+    unsigned int bucket = housemotion_order_hash (root, relative, packed)
+                              % HouseMotionOrderBucketsCount;
+    int id = HouseMotionOrderBuckets[bucket];
+    while (id >= 0) {
+        HouseMotionRecording *recording = &(HouseMotionOrderEntries[id].recording);
+        if ((recording->root == root) && (recording->packed == packed) &&
+            (!strcmp (recording->relative, relative)))
+            return id;
+        id = HouseMotionOrderEntries[id].next;
+    }
+    return -1;
+}
+
+static void housemotion_order_hash_add (int id) {
+    HouseMotionRecording *recording = &(HouseMotionOrderEntries[id].recording);
+    unsigned int bucket =
+        housemotion_order_hash (recording->root, recording->relative,
+                                recording->packed)
+            % HouseMotionOrderBucketsCount;
+    HouseMotionOrderEntries[id].next = HouseMotionOrderBuckets[bucket];
+    HouseMotionOrderBuckets[bucket] = id;
+}
+
+static void housemotion_order_rehash (void) {
+
+    int i;
+    free (HouseMotionOrderBuckets);
+    HouseMotionOrderBucketsCount = 2 * HouseMotionOrderLive + 1021;
+    HouseMotionOrderBuckets = malloc (HouseMotionOrderBucketsCount * sizeof(int));
+    for (i = 0; i < HouseMotionOrderBucketsCount; ++i)
+        HouseMotionOrderBuckets[i] = -1;
+    for (i = 0; i < HouseMotionOrderEntriesCount; ++i) {
+        if (HouseMotionOrderEntries[i].recording.relative)
+            housemotion_order_hash_add (i);
+    }
+}
+
+static int housemotion_order_new (int root, const char *relative,
+                                  int packed) {
+
+    int id;
+    if (HouseMotionOrderFree >= 0) {
+        id = HouseMotionOrderFree;
+        HouseMotionOrderFree = HouseMotionOrderEntries[id].next;
+    } else {
+        if (HouseMotionOrderEntriesCount >= HouseMotionOrderEntriesSize) {
+            HouseMotionOrderEntriesSize += 4096;
+            HouseMotionOrderEntries =
+                realloc (HouseMotionOrderEntries,
+                         HouseMotionOrderEntriesSize * sizeof(HouseMotionOrdered));
+        }
+        id = HouseMotionOrderEntriesCount++;
+    }
+    HouseMotionOrdered *entry = HouseMotionOrderEntries + id;
+    memset (entry, 0, sizeof(HouseMotionOrdered));
+    entry->recording.relative = strdup (relative);
+    entry->recording.root = root;
+    entry->recording.packed = packed;
+    HouseMotionOrderLive += 1;
+
+    if (HouseMotionOrderLive > HouseMotionOrderBucketsCount)
+        housemotion_order_rehash (); // Includes the new entry.
+    else
+        housemotion_order_hash_add (id);
+    return id;
+}
+
+static void housemotion_order_release (int id) {
+
+    HouseMotionRecording *recording = &(HouseMotionOrderEntries[id].recording);
+    unsigned int bucket =
+        housemotion_order_hash (recording->root, recording->relative,
+                                recording->packed)
+            % HouseMotionOrderBucketsCount;
+    int *link = HouseMotionOrderBuckets + bucket;
+    while (*link != id) link = &(HouseMotionOrderEntries[*link].next);
+    *link = HouseMotionOrderEntries[id].next;
+
+    free (recording->relative);
+    recording->relative = 0;
+    HouseMotionOrderEntries[id].flags = 0;
+    HouseMotionOrderEntries[id].next = HouseMotionOrderFree;
+    HouseMotionOrderFree = id;
+    HouseMotionOrderLive -= 1;
+}
+
+// Remove the entry from the sorted arrays, before it is changed.
+//
+static void housemotion_order_detach (int id) {
+
+    HouseMotionOrdered *entry = HouseMotionOrderEntries + id;
+    int order;
+
+    if (entry->flags & MOTION_ORDER_OVERLAY) {
+        for (order = 0; order < HOUSEMOTION_ORDER_COUNT; ++order) {
+            HouseMotionOrderKey *overlay = HouseMotionOrders[order].overlay;
+            long long key = housemotion_order_key (order, &(entry->recording));
+            int i = housemotion_order_search (overlay,
+                                              HouseMotionOrderOverlayCount,
+                                              key, id);
+            if (i >= HouseMotionOrderOverlayCount) continue; // Not expected.
+            memmove (overlay + i, overlay + i + 1,
+                     (HouseMotionOrderOverlayCount - i - 1)
+                         * sizeof(HouseMotionOrderKey));
+        }
+        HouseMotionOrderOverlayCount -= 1;
+    }
+    if (entry->flags & MOTION_ORDER_BASE) HouseMotionOrderStale += 1;
+    entry->flags = 0;
+}
+
+static void housemotion_order_attach (int id) {
+
+    HouseMotionOrdered *entry = HouseMotionOrderEntries + id;
+    int order;
+
+    if (HouseMotionOrderOverlayCount >= HouseMotionOrderOverlaySize) {
+        HouseMotionOrderOverlaySize += MOTION_ORDER_MERGE;
+        for (order = 0; order < HOUSEMOTION_ORDER_COUNT; ++order) {
+            HouseMotionOrders[order].overlay =
+                realloc (HouseMotionOrders[order].overlay,
+                         HouseMotionOrderOverlaySize * sizeof(HouseMotionOrderKey));
+        }
+    }
+    for (order = 0; order < HOUSEMOTION_ORDER_COUNT; ++order) {
+        HouseMotionOrderKey *overlay = HouseMotionOrders[order].overlay;
+        long long key = housemotion_order_key (order, &(entry->recording));
+        int i = housemotion_order_search (overlay,
+                                          HouseMotionOrderOverlayCount, key, id);
+        memmove (overlay + i + 1, overlay + i,
+                 (HouseMotionOrderOverlayCount - i) * sizeof(HouseMotionOrderKey));
+        overlay[i].key = key;
+        overlay[i].id = id;
+    }
+    HouseMotionOrderOverlayCount += 1;
+    entry->flags = MOTION_ORDER_OVERLAY;
+}
+
+static int housemotion_order_valid (const HouseMotionOrderKey *element) {
+    return HouseMotionOrderEntries[element->id].flags & MOTION_ORDER_BASE;
+}
+
+// Merge the overlay into the base, dropping the stale elements. All the
+// orders are merged at the same time, since an entry is either in all
+// the base arrays or in none.
+//
+static void housemotion_order_merge (void) {
+
+    int order, i, j, k = 0;
+    int total = HouseMotionOrderBaseCount - HouseMotionOrderStale
+                    + HouseMotionOrderOverlayCount;
+
+    for (order = 0; order < HOUSEMOTION_ORDER_COUNT; ++order) {
+        HouseMotionOrderList *list = HouseMotionOrders + order;
+        HouseMotionOrderKey *merged =
+            malloc ((total + 1) * sizeof(HouseMotionOrderKey));
+        i = j = k = 0;
+        while ((i < HouseMotionOrderBaseCount) ||
+               (j < HouseMotionOrderOverlayCount)) {
+            if (i < HouseMotionOrderBaseCount) {
+                const HouseMotionOrderKey *base = list->base + i;
+                if (!housemotion_order_valid (base)) {
+                    i += 1;
+                    continue;
+                }
+                if ((j >= HouseMotionOrderOverlayCount) ||
+                    (housemotion_order_compare (base, list->overlay[j].key,
+                                                list->overlay[j].id) < 0)) {
+                    merged[k++] = *base;
+                    i += 1;
+                    continue;
+                }
+            }
+            merged[k++] = list->overlay[j++];
+        }
+        free (list->base);
+        list->base = merged;
+        list->head = 0;
+    }
+    for (j = 0; j < HouseMotionOrderOverlayCount; ++j) {
+        HouseMotionOrderEntries[HouseMotionOrders[0].overlay[j].id].flags =
+            MOTION_ORDER_BASE;
+    }
+    HouseMotionOrderBaseCount = k;
+    HouseMotionOrderOverlayCount = 0;
+    HouseMotionOrderStale = 0;
+    HouseMotionOrderMerges += 1;
+}
+
+static void housemotion_order_update (int root, const char *relative,
+                                      int packed, const HouseMotionFile *file) {
+
+    int id = housemotion_order_find (root, relative, packed);
+    if (id >= 0) housemotion_order_detach (id);
+
+    if (!file) {
+        if (id >= 0) housemotion_order_release (id);
+    } else {
+        if (id < 0) id = housemotion_order_new (root, relative, packed);
+        HouseMotionRecording *recording = &(HouseMotionOrderEntries[id].recording);
+        recording->mtime = file->mtime;
+        recording->size = file->size;
+        recording->camera = file->camera;
+        recording->event = file->event;
+        housemotion_order_attach (id);
+    }
+
+    int limit = HouseMotionOrderLive / 16;
+    if (limit < MOTION_ORDER_MERGE) limit = MOTION_ORDER_MERGE;
+    if (HouseMotionOrderOverlayCount + HouseMotionOrderStale > limit)
+        housemotion_order_merge ();
+}
+
+static void housemotion_order_indexed (int root, const char *relative,
+                                       const HouseMotionFile *file,
+                                       const HouseMotionFile *previous) {
+    housemotion_order_update (root, relative, 0, file);
+}
+
+static void housemotion_order_packed (int root, const char *relative,
+                                      const HouseMotionFile *file,
+                                      const HouseMotionFile *previous) {
+    housemotion_order_update (root, relative, 1, file);
+}
+
+// Enumerate in ascending order, starting at (key, id) included.
+//
+static int housemotion_order_ascend (int order, long long key, int id,
+                                     HouseMotionOrderCursor *cursor,
+                                     housemotion_order_iterator *iterator,
+                                     void *context) {
+
+    HouseMotionOrderList *list = HouseMotionOrders + order;
+    const HouseMotionOrderKey *base = list->base;
+    const HouseMotionOrderKey *overlay = list->overlay;
+    const HouseMotionOrderKey *next;
+    int bases = HouseMotionOrderBaseCount;
+    int overlays = HouseMotionOrderOverlayCount;
+
+    int i = housemotion_order_search (base, bases, key, id);
+    int j = housemotion_order_search (overlay, overlays, key, id);
+    if (i < list->head) i = list->head;
+    for (;;) {
+        while ((i < bases) && (!housemotion_order_valid (base + i))) {
+            if (i == list->head) list->head += 1;
+            i += 1;
+        }
+        if (i < bases) {
+            if ((j >= overlays) ||
+                (housemotion_order_compare (base + i,
+                                            overlay[j].key,
+                                            overlay[j].id) < 0))
+                next = base + (i++);
+            else
+                next = overlay + (j++);
+        } else if (j < overlays) {
+            next = overlay + (j++);
+        } else {
+            break;
+        }
+        if (cursor) {
+            cursor->key = next->key;
+            cursor->id = next->id;
+        }
+        if (iterator (&(HouseMotionOrderEntries[next->id].recording), context))
+            return 1;
+    }
+    return 0;
+}
+
+void housemotion_order_start (HouseMotionOrderCursor *cursor) {
+    cursor->key = LLONG_MIN;
+    cursor->id = INT_MIN;
+}
+
+int housemotion_order_resume (int order, HouseMotionOrderCursor *cursor,
+                              housemotion_order_iterator *iterator,
+                              void *context) {
+
+    if ((order < 0) || (order >= HOUSEMOTION_ORDER_COUNT)) return 0;
+
+    // Resume strictly after the last recording enumerated.
+    return housemotion_order_ascend (order, cursor->key, cursor->id + 1,
+                                     cursor, iterator, context);
+}
+
+int housemotion_order_enumerate (int order, int descending, long long from,
+                                 housemotion_order_iterator *iterator,
+                                 void *context) {
+
+    if ((order < 0) || (order >= HOUSEMOTION_ORDER_COUNT)) return 0;
+
+    if (!descending)
+        return housemotion_order_ascend (order, from, INT_MIN, 0,
+                                         iterator, context);
+
+    HouseMotionOrderList *list = HouseMotionOrders + order;
+    const HouseMotionOrderKey *base = list->base;
+    const HouseMotionOrderKey *overlay = list->overlay;
+    const HouseMotionOrderKey *next;
+    int bases = HouseMotionOrderBaseCount;
+    int overlays = HouseMotionOrderOverlayCount;
+
+    int i = housemotion_order_search (base, bases, from, INT_MAX) - 1;
+    int j = housemotion_order_search (overlay, overlays, from, INT_MAX) - 1;
+    for (;;) {
+        while ((i >= 0) && (!housemotion_order_valid (base + i))) i -= 1;
+        if (i >= 0) {
+            if ((j < 0) ||
+                (housemotion_order_compare (base + i,
+                                            overlay[j].key,
+                                            overlay[j].id) > 0))
+                next = base + (i--);
+            else
+                next = overlay + (j--);
+        } else if (j >= 0) {
+            next = overlay + (j--);
+        } else {
+            break;
+        }
+        if (iterator (&(HouseMotionOrderEntries[next->id].recording), context))
+            return 1;
+    }
+    return 0;
+}
+
+int housemotion_order_status (char *buffer, int size) {
+
+    return snprintf (buffer, size,
+                     "\"order\":{\"recordings\":%d,\"base\":%d,\"overlay\":%d,"
+                         "\"stale\":%d,\"merges\":%lld}",
+                     HouseMotionOrderLive, HouseMotionOrderBaseCount,
+                     HouseMotionOrderOverlayCount, HouseMotionOrderStale,
+                     HouseMotionOrderMerges);
+}
+
+void housemotion_order_initialize (int argc, const char **argv) {
+    housemotion_index_listen (housemotion_order_indexed);
+    housemotion_pack_listen (housemotion_order_packed);
+}
@@ -0,0 +1,56 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_order.h - Keep the recordings sorted by age and size.
+ */
+#define HOUSEMOTION_ORDER_TIME  0
+#define HOUSEMOTION_ORDER_SIZE  1
+#define HOUSEMOTION_ORDER_COUNT 2
+
+typedef struct {
+    char       *relative;
+    int         root;
+    time_t      mtime;
+    long long   size;
+    const char *camera;
+    int         event;
+    int         packed;
+} HouseMotionRecording;
+
+typedef int housemotion_order_iterator (const HouseMotionRecording *recording,
+                                        void *context);
+
+void housemotion_order_initialize (int argc, const char **argv);
+
+int  housemotion_order_enumerate (int order, int descending, long long from,
+                                  housemotion_order_iterator *iterator,
+                                  void *context);
+
+typedef struct {
+    long long key;
+    int       id;
+} HouseMotionOrderCursor;
+
+void housemotion_order_start (HouseMotionOrderCursor *cursor);
+int  housemotion_order_resume (int order, HouseMotionOrderCursor *cursor,
+                               housemotion_order_iterator *iterator,
+                               void *context);
+
+int  housemotion_order_status (char *buffer, int size);
@@ -0,0 +1,868 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_pack.c - Pack the old pictures into one file per day.
+ *
+ * SYNOPSYS:
+ *
+ * Motion may save a picture every time motion is detected, which results
+ * in tens of thousands of small files per day. This module moves the
+ * pictures older than a few days into one pack file per day, to limit
+ * the number of inodes used and the time spent scanning the storage.
+ *
+ * The packs are stored in the hidden ".housemotion" directory at the
+ * root of the storage (hidden directories are not indexed). Each pack
+ * is made of two files: YYYYMMDD.pack contains the pictures data, one
+ * after the other, and YYYYMMDD.idx lists the pictures, one per line:
+ * offset, size, modification time and path relative to the root.
+ *
+ * The packed pictures are still listed and served individually, using
+ * their original path.
+ *
+ * void housemotion_pack_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Pictures are packed only if the
+ *    --motion-pack=DAYS option is present.
+ *
+ * void housemotion_pack_location (int instance, const char *root);
+ *
+ *    Set the root directory of the recording files for one Motion
+ *    instance, and load the existing packs for that instance.
+ *
+ * int housemotion_pack_enumerate (int instance,
+ *                                 housemotion_index_iterator *iterator,
+ *                                 void *context);
+ *
+ *    Call the iterator for each packed picture, as if it was a file in
+ *    the index. The rules are the same as for housemotion_index_enumerate.
+ *
+ * int housemotion_pack_open (const char *relative, long long *size);
+ *
+ *    Return a file descriptor positioned at the start of the packed
+ *    picture, or -1 if the picture is not in any pack.
+ *
+ * time_t housemotion_pack_oldest (int instance);
+ * void housemotion_pack_delete_oldest (int instance);
+ *
+ *    Return the time of the most recent picture in the oldest pack, or 0
+ *    if the instance has no pack, and delete that oldest pack. A pack
+ *    is always deleted as a whole.
+ *
+ * void housemotion_pack_background (time_t now);
+ *
+ *    Start packing a batch of old pictures, if none is in progress.
+ *
+ * void housemotion_pack_refresh (void);
+ *
+ *    Continue the batch in progress, for a short time: the pictures are
+ *    selected, oldest first, and copied in short slices, so that the
+ *    Motion hooks are processed in between. The pictures are listed in
+ *    the packs, and the original files deleted, only once the packs are
+ *    safely on disk. This must be called as often as possible.
+ *
+ * void housemotion_pack_listen (housemotion_index_listener *listener);
+ *
+ *    Register a function to be called each time a picture is added to a
+ *    pack (previous is 0) or removed, when its pack is deleted (file is 0).
+ *    The rules are the same as for housemotion_index_listen.
+ *
+ * long long housemotion_pack_version (void);
+ *
+ *    Return a value that changes each time pictures are packed or deleted.
+ *
+ * int housemotion_pack_status (char *buffer, int size);
+ *
+ *    Populate a JSON object that describes the existing packs.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_event.h"
+#include "housemotion_format.h"
+#include "housemotion_index.h"
+#include "housemotion_order.h"
+#include "housemotion_dirent.h"
+#include "housemotion_pack.h"
+#include "housemotion_pressure.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_PACK_DIR ".housemotion"
+#define MOTION_PACK_ROOTS 8
+#define MOTION_PACK_BATCH 256
+#define MOTION_PACK_OPEN 8
+
+typedef struct {
+    char     *name; // Relative to the root.
+    time_t    mtime;
+    long long offset;
+    long long size;
+    HouseMotionPathInfo info;
+} PackedPicture;
+
+typedef struct {
+    int    instance;
+    int    day;    // YYYYMMDD, local time.
+    time_t newest;
+    long long bytes;
+    PackedPicture *pictures;
+    int    count;
+    int    size;
+} PictureArchive;
+
+static int HouseMotionPackDays = 0; // Default is no packing.
+
+static char *HouseMotionPackRoots[MOTION_PACK_ROOTS];
+static int   HouseMotionPackRootsCount = 0;
+
+static PictureArchive *HouseMotionPacks = 0;
+static int             HouseMotionPacksCount = 0;
+static int             HouseMotionPacksSize = 0;
+
+static long long HouseMotionPackedTotal = 0;
+static long long HouseMotionPackVersion = 0;
+
+#define MOTION_PACK_LISTENERS 4
+
+static housemotion_index_listener *HouseMotionPackListeners[MOTION_PACK_LISTENERS];
+static int HouseMotionPackListenersCount = 0;
+
+static void housemotion_pack_path (char *buffer, int size,
+                                   const PictureArchive *archive,
+                                   const char *extension) {
+    snprintf (buffer, size, "%s/" MOTION_PACK_DIR "/%08d.%s",
+              HouseMotionPackRoots[archive->instance], archive->day, extension);
+}
+
+static void housemotion_pack_file (const PackedPicture *picture,
+                                   HouseMotionFile *file) {
+    const char *sep = strrchr (picture->name, '/');
+    file->name = sep ? (char *)sep + 1 : picture->name;
+    file->mtime = picture->mtime;
+    file->size = picture->size;
+    file->checked = 0;
+    file->type = "image/jpeg";
+    file->camera = picture->info.camera;
+    file->event = picture->info.event;
+    file->recorded = picture->info.timestamp;
+}
+
+static void housemotion_pack_changed (const PictureArchive *archive,
+                                      const PackedPicture *picture,
+                                      int added) {
+    int i;
+    HouseMotionFile file;
+    housemotion_pack_file (picture, &file);
+    for (i = 0; i < HouseMotionPackListenersCount; ++i) {
+        if (added)
+            HouseMotionPackListeners[i] (archive->instance, picture->name,
+                                         &file, 0);
+        else
+            HouseMotionPackListeners[i] (archive->instance, picture->name,
+                                         0, &file);
+    }
+}
+
+static int housemotion_pack_search (const PictureArchive *archive,
+                                    const char *name, int *position) {
+    int low = 0;
+    int high = archive->count - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int delta = strcmp (name, archive->pictures[middle].name);
+        if (!delta) return middle;
+        if (delta < 0) high = middle - 1;
+        else           low = middle + 1;
+    }
+    if (position) *position = low;
+    return -1;
+}
+
+// Motion names its files after the time, so the new pictures are
+// normally added at the end.
+//
+static int housemotion_pack_insert (PictureArchive *archive, const char *name,
+                                    time_t mtime,
+                                    long long offset, long long size) {
+    int position;
+    if (housemotion_pack_search (archive, name, &position) >= 0) return 0;
+
+    if (archive->count >= archive->size) {
+        archive->size += 1024;
+        archive->pictures =
+            realloc (archive->pictures, archive->size * sizeof(PackedPicture));
+    }
+    if (position < archive->count) {
+        memmove (archive->pictures + position + 1,
+                 archive->pictures + position,
+                 (archive->count - position) * sizeof(PackedPicture));
+    }
+    PackedPicture *picture = archive->pictures + position;
+    picture->name = strdup (name);
+    picture->mtime = mtime;
+    picture->offset = offset;
+    picture->size = size;
+    if (!housemotion_format_match (archive->instance, name, &(picture->info))) {
+        picture->info.camera = 0;
+        picture->info.event = -1;
+        picture->info.timestamp = 0;
+    }
+    archive->count += 1;
+    archive->bytes += size;
+    if (mtime > archive->newest) archive->newest = mtime;
+    HouseMotionPackedTotal += 1;
+    HouseMotionPackVersion += 1;
+    housemotion_pack_changed (archive, picture, 1);
+    return 1;
+}
+
+static PictureArchive *housemotion_pack_archive (int instance, int day,
+                                                 int create) {
+    int i;
+    for (i = 0; i < HouseMotionPacksCount; ++i) {
+        PictureArchive *archive = HouseMotionPacks + i;
+        if ((archive->instance == instance) && (archive->day == day))
+            return archive;
+    }
+    if (!create) return 0;
+
+    if (HouseMotionPacksCount >= HouseMotionPacksSize) {
+        HouseMotionPacksSize += 32;
+        HouseMotionPacks =
+            realloc (HouseMotionPacks,
+                     HouseMotionPacksSize * sizeof(PictureArchive));
+    }
+    PictureArchive *archive = HouseMotionPacks + (HouseMotionPacksCount++);
+    memset (archive, 0, sizeof(PictureArchive));
+    archive->instance = instance;
+    archive->day = day;
+    return archive;
+}
+
+// A batch of pictures is packed in three steps, each done in short slices
+// so that the Motion hooks are processed in between: select the oldest
+// pictures (using the recordings sorted by age), append each picture to
+// the pack of its day, and finally commit the batch.
+//
+#define MOTION_PACK_SLICE  50   // milliseconds.
+#define MOTION_PACK_RESCAN 3600 // Restart the selection every hour.
+
+#define MOTION_PACK_IDLE   0
+#define MOTION_PACK_SELECT 1
+#define MOTION_PACK_COPY   2
+
+// The pack files currently open for writing during a batch. A pack is
+// designated by its instance and day, since the list of packs may be
+// reallocated between two slices.
+//
+struct housemotion_pack_writer {
+    int   instance;
+    int   day;
+    int   data;
+    off_t start; // Size of the pack before this batch.
+};
+
+struct housemotion_pack_candidate {
+    char      path[1024];
+    char      relative[1024];
+    int       instance;
+    int       day;
+    time_t    mtime;
+    long long size;
+    int       writer; // -1 if not copied.
+    long long offset;
+    int       packed; // Already in a pack, only the file remains.
+};
+
+static int       HouseMotionPackStep = MOTION_PACK_IDLE;
+static time_t    HouseMotionPackLimit = 0;
+static time_t    HouseMotionPackFrom = 0; // Where the next batch starts.
+static time_t    HouseMotionPackRescan = 0;
+static long long HouseMotionPackDeadline = 0;
+static HouseMotionOrderCursor HouseMotionPackCursor;
+
+static struct housemotion_pack_candidate *HouseMotionPackCandidates = 0;
+static int HouseMotionPackCandidatesCount = 0;
+static int HouseMotionPackNext = 0;
+
+static struct housemotion_pack_writer HouseMotionPackWriters[MOTION_PACK_OPEN];
+static int HouseMotionPackWritersCount = 0;
+
+static long long housemotion_pack_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+// Close the packs and forget the current batch. On rollback, the packs
+// are restored to their size before the batch.
+//
+static void housemotion_pack_end (int rollback) {
+    int i;
+    for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+        struct housemotion_pack_writer *writer = HouseMotionPackWriters + i;
+        if (rollback && ftruncate (writer->data, writer->start)) {
+            houselog_trace (HOUSE_FAILURE, "ftruncate(2)",
+                            "%s", strerror(errno));
+        }
+        close (writer->data);
+    }
+    HouseMotionPackWritersCount = 0;
+    free (HouseMotionPackCandidates);
+    HouseMotionPackCandidates = 0;
+    HouseMotionPackCandidatesCount = 0;
+    HouseMotionPackNext = 0;
+    HouseMotionPackStep = MOTION_PACK_IDLE;
+}
+
+static void housemotion_pack_forget (int i) {
+
+    PictureArchive *archive = HouseMotionPacks + i;
+    int j;
+
+    // The batch in progress might refer to this pack.
+    if (HouseMotionPackStep != MOTION_PACK_IDLE) housemotion_pack_end (1);
+
+    for (j = 0; j < archive->count; ++j) {
+        housemotion_pack_changed (archive, archive->pictures + j, 0);
+        free (archive->pictures[j].name);
+    }
+    if (archive->pictures) free (archive->pictures);
+    HouseMotionPackedTotal -= archive->count;
+    HouseMotionPackVersion += 1;
+
+    HouseMotionPacksCount -= 1;
+    if (i < HouseMotionPacksCount) {
+        memmove (HouseMotionPacks+i, HouseMotionPacks+i+1,
+                 (HouseMotionPacksCount - i) * sizeof(PictureArchive));
+    }
+}
+
+static void housemotion_pack_load (int instance, int day) {
+
+    char path[1024];
+    char line[1200];
+    PictureArchive *archive = housemotion_pack_archive (instance, day, 1);
+
+    housemotion_pack_path (path, sizeof(path), archive, "idx");
+    FILE *fd = fopen (path, "r");
+    if (!fd) return;
+
+    while (fgets (line, sizeof(line), fd)) {
+        long long offset, size, mtime;
+        int consumed = 0;
+        if (sscanf (line, "%lld %lld %lld %n",
+                    &offset, &size, &mtime, &consumed) != 3) continue;
+        char *name = line + consumed;
+        char *eol = strchr (name, '\n');
+        if (!eol) continue; // Incomplete line, the last write failed.
+        *eol = 0;
+        housemotion_pack_insert (archive, name, (time_t)mtime, offset, size);
+    }
+    fclose (fd);
+}
+
+static int housemotion_pack_found (const char *name, int type,
+                                   void *context) {
+    int day;
+    char extension[8];
+    if (type != HOUSEMOTION_DIRENT_FILE) return 0;
+    if (sscanf (name, "%8d.%7s", &day, extension) != 2) return 0;
+    if (strcmp (extension, "idx")) return 0;
+    housemotion_pack_load (*((int *)context), day);
+    return 0;
+}
+
+void housemotion_pack_location (int instance, const char *root) {
+
+    if ((instance < 0) || (instance >= MOTION_PACK_ROOTS)) return;
+
+    char *existing = HouseMotionPackRoots[instance];
+    if (existing) {
+        if (!strcmp (existing, root)) return; // No change.
+        free (existing);
+    }
+    int i;
+    for (i = HouseMotionPacksCount - 1; i >= 0; --i) {
+        if (HouseMotionPacks[i].instance == instance)
+            housemotion_pack_forget (i);
+    }
+    HouseMotionPackRoots[instance] = strdup (root);
+    if (instance >= HouseMotionPackRootsCount)
+        HouseMotionPackRootsCount = instance + 1;
+
+    char path[1024];
+    snprintf (path, sizeof(path), "%s/" MOTION_PACK_DIR, root);
+    housemotion_dirent_scan (path, housemotion_pack_found, &instance);
+}
+
+int housemotion_pack_enumerate (int instance,
+                                housemotion_index_iterator *iterator,
+                                void *context) {
+    int i, j;
+    for (i = 0; i < HouseMotionPacksCount; ++i) {
+        PictureArchive *archive = HouseMotionPacks + i;
+        if ((instance >= 0) && (archive->instance != instance)) continue;
+        const char *root = HouseMotionPackRoots[archive->instance];
+
+        for (j = 0; j < archive->count; ++j) {
+            PackedPicture *picture = archive->pictures + j;
+            char directory[1024];
+            HouseMotionFile file;
+
+            housemotion_pack_file (picture, &file);
+            strtcpy (directory, picture->name, sizeof(directory));
+            char *sep = strrchr (directory, '/');
+            if (sep)
+                *sep = 0;
+            else
+                directory[0] = 0;
+            if (iterator (root, directory, &file, context)) return 1;
+        }
+    }
+    return 0;
+}
+
+int housemotion_pack_open (const char *relative, long long *size) {
+
+    int i;
+    for (i = 0; i < HouseMotionPacksCount; ++i) {
+        PictureArchive *archive = HouseMotionPacks + i;
+        int j = housemotion_pack_search (archive, relative, 0);
+        if (j < 0) continue;
+
+        char path[1024];
+        housemotion_pack_path (path, sizeof(path), archive, "pack");
+        int fd = open (path, O_RDONLY);
+        if (fd < 0) return -1;
+        if (lseek (fd, (off_t)(archive->pictures[j].offset), SEEK_SET) < 0) {
+            close (fd);
+            return -1;
+        }
+        *size = archive->pictures[j].size;
+        return fd;
+    }
+    return -1;
+}
+
+static int housemotion_pack_oldest_index (int instance) {
+    int i;
+    int oldest = -1;
+    for (i = 0; i < HouseMotionPacksCount; ++i) {
+        PictureArchive *archive = HouseMotionPacks + i;
+        if (archive->instance != instance) continue;
+        if ((oldest < 0) || (archive->day < HouseMotionPacks[oldest].day))
+            oldest = i;
+    }
+    return oldest;
+}
+
+time_t housemotion_pack_oldest (int instance) {
+    int i = housemotion_pack_oldest_index (instance);
+    if (i < 0) return 0;
+    return HouseMotionPacks[i].newest;
+}
+
+void housemotion_pack_delete_oldest (int instance) {
+
+    int i = housemotion_pack_oldest_index (instance);
+    if (i < 0) return;
+
+    char path[1024];
+    PictureArchive *archive = HouseMotionPacks + i;
+
+    housemotion_pack_path (path, sizeof(path), archive, "pack");
+    houselog_event ("SERVICE", "cctv", "DELETE",
+                    "%s (%d pictures)", path, archive->count);
+    if (unlink (path) && (errno != ENOENT)) {
+        houselog_trace (HOUSE_FAILURE, "unlink(2)",
+                        "%s: %s", path, strerror(errno));
+    }
+    housemotion_pack_path (path, sizeof(path), archive, "idx");
+    unlink (path);
+    housemotion_pack_forget (i);
+}
+
+static int housemotion_pack_picture (const HouseMotionFile *file) {
+    if (file->type) return !strcmp (file->type, "image/jpeg");
+    const char *extension = strrchr (file->name, '.');
+    if (!extension) return 0;
+    return (!strcasecmp (extension, ".jpg")) ||
+           (!strcasecmp (extension, ".jpeg"));
+}
+
+static int housemotion_pack_day (time_t mtime) {
+    struct tm local;
+    localtime_r (&mtime, &local);
+    return ((local.tm_year + 1900) * 10000)
+               + ((local.tm_mon + 1) * 100) + local.tm_mday;
+}
+
+struct housemotion_pack_selection {
+    int examined;
+    int done;
+};
+
+// Stop when the slice is over: the selection then resumes after this
+// recording (see housemotion_order_resume()).
+//
+static int housemotion_pack_next (struct housemotion_pack_selection *selection) {
+    selection->examined += 1;
+    if ((selection->examined % 64) != 0) return 0;
+    return housemotion_pack_clock () >= HouseMotionPackDeadline;
+}
+
+static int housemotion_pack_select (const HouseMotionRecording *recording,
+                                    void *context) {
+
+    struct housemotion_pack_selection *selection =
+        (struct housemotion_pack_selection *)context;
+
+    if (recording->mtime >= HouseMotionPackLimit) {
+        selection->done = 1;
+        return 1;
+    }
+    HouseMotionPackFrom = recording->mtime;
+
+    if (recording->packed) return housemotion_pack_next (selection);
+    int instance = recording->root;
+    if ((instance < 0) || (instance >= HouseMotionPackRootsCount)) return housemotion_pack_next (selection);
+    if (!HouseMotionPackRoots[instance]) return housemotion_pack_next (selection);
+
+    const char *root;
+    const HouseMotionFile *file =
+        housemotion_index_lookup (recording->relative, &root);
+    if (!file) return housemotion_pack_next (selection);
+    if (!housemotion_pack_picture (file)) return housemotion_pack_next (selection);
+
+    struct housemotion_pack_candidate *candidate =
+        HouseMotionPackCandidates + HouseMotionPackCandidatesCount;
+
+    // A truncated path could designate another file: skip it.
+    int length = snprintf (candidate->relative, sizeof(candidate->relative),
+                           "%s", recording->relative);
+    if (length >= sizeof(candidate->relative)) return housemotion_pack_next (selection);
+    length = snprintf (candidate->path, sizeof(candidate->path),
+                       "%s/%s", root, candidate->relative);
+    if (length >= sizeof(candidate->path)) return housemotion_pack_next (selection);
+    if (housemotion_event_active (candidate->path)) return housemotion_pack_next (selection);
+
+    candidate->instance = instance;
+    candidate->mtime = recording->mtime;
+    candidate->size = recording->size;
+    candidate->day = housemotion_pack_day (recording->mtime);
+    candidate->writer = -1;
+    candidate->offset = -1;
+    candidate->packed = 0;
+    HouseMotionPackCandidatesCount += 1;
+    if (HouseMotionPackCandidatesCount >= MOTION_PACK_BATCH) return 1;
+    return housemotion_pack_next (selection);
+}
+
+static int housemotion_pack_writer (int instance, int day) {
+
+    int i;
+    for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+        struct housemotion_pack_writer *writer = HouseMotionPackWriters + i;
+        if ((writer->instance == instance) && (writer->day == day)) return i;
+    }
+    if (HouseMotionPackWritersCount >= MOTION_PACK_OPEN) return -1; // Next batch.
+
+    char path[1024];
+    snprintf (path, sizeof(path),
+              "%s/" MOTION_PACK_DIR, HouseMotionPackRoots[instance]);
+    mkdir (path, 0755);
+
+    snprintf (path, sizeof(path), "%s/" MOTION_PACK_DIR "/%08d.pack",
+              HouseMotionPackRoots[instance], day);
+    int data = open (path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if (data < 0) {
+        houselog_trace (HOUSE_FAILURE, "open(2)",
+                        "%s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct housemotion_pack_writer *writer =
+        HouseMotionPackWriters + HouseMotionPackWritersCount;
+    writer->instance = instance;
+    writer->day = day;
+    writer->data = data;
+    writer->start = lseek (data, 0, SEEK_END);
+    return HouseMotionPackWritersCount++;
+}
+
+// Append the content of the picture to the pack. Return the offset of
+// the picture in the pack, or -1 on failure (the pack is then restored
+// to its previous size).
+//
+static long long housemotion_pack_copy (int data, const char *path,
+                                        long long size) {
+
+    char buffer[65536];
+    int in = open (path, O_RDONLY);
+    if (in < 0) return -1;
+
+    off_t offset = lseek (data, 0, SEEK_END);
+    long long copied = 0;
+    while (copied < size) {
+        int length = read (in, buffer, sizeof(buffer));
+        if (length <= 0) break;
+        if (write (data, buffer, length) != length) break;
+        copied += length;
+    }
+    close (in);
+
+    if (copied != size) {
+        if (ftruncate (data, offset)) {
+            houselog_trace (HOUSE_FAILURE, "ftruncate(2)",
+                            "%s", strerror(errno));
+        }
+        return -1;
+    }
+    return (long long)offset;
+}
+
+static void housemotion_pack_copy_next (long long deadline) {
+
+    while (HouseMotionPackNext < HouseMotionPackCandidatesCount) {
+
+        if (housemotion_pack_clock () >= deadline) return;
+
+        struct housemotion_pack_candidate *candidate =
+            HouseMotionPackCandidates + (HouseMotionPackNext++);
+
+        PictureArchive *archive =
+            housemotion_pack_archive (candidate->instance, candidate->day, 0);
+        if (archive &&
+            (housemotion_pack_search (archive, candidate->relative, 0) >= 0)) {
+            candidate->packed = 1; // Packed before a restart, not deleted yet.
+            continue;
+        }
+        int writer = housemotion_pack_writer (candidate->instance,
+                                              candidate->day);
+        if (writer < 0) continue;
+
+        candidate->offset =
+            housemotion_pack_copy (HouseMotionPackWriters[writer].data,
+                                   candidate->path, candidate->size);
+        if (candidate->offset >= 0) candidate->writer = writer;
+    }
+}
+
+// Make sure that the pictures are on disk, and listed in the pack index
+// files, before listing them in memory and deleting the original files.
+// If anything fails, the packs are restored to their previous size and
+// the original files are kept.
+//
+static void housemotion_pack_commit (void) {
+
+    int i;
+    char path[1024];
+    FILE *index[MOTION_PACK_OPEN];
+    long  indexstart[MOTION_PACK_OPEN];
+    const char *failure = 0;
+
+    for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+        index[i] = 0;
+        indexstart[i] = 0;
+        if ((!failure) && fsync (HouseMotionPackWriters[i].data))
+            failure = strerror(errno);
+    }
+    for (i = 0; (!failure) && (i < HouseMotionPackWritersCount); ++i) {
+        struct housemotion_pack_writer *writer = HouseMotionPackWriters + i;
+        snprintf (path, sizeof(path), "%s/" MOTION_PACK_DIR "/%08d.idx",
+                  HouseMotionPackRoots[writer->instance], writer->day);
+        index[i] = fopen (path, "a");
+        if (!index[i]) {
+            failure = strerror(errno);
+            break;
+        }
+        fseek (index[i], 0, SEEK_END);
+        indexstart[i] = ftell (index[i]);
+    }
+    if (!failure) {
+        for (i = 0; i < HouseMotionPackCandidatesCount; ++i) {
+            struct housemotion_pack_candidate *candidate =
+                HouseMotionPackCandidates + i;
+            if (candidate->writer < 0) continue;
+            if (access (candidate->path, F_OK)) {
+                candidate->writer = -1; // Deleted by the cleanup meanwhile.
+                continue;
+            }
+            fprintf (index[candidate->writer], "%lld %lld %lld %s\n",
+                     candidate->offset, candidate->size,
+                     (long long)(candidate->mtime), candidate->relative);
+        }
+        for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+            if (fflush (index[i]) || fsync (fileno(index[i]))) {
+                failure = strerror(errno);
+                break;
+            }
+        }
+    }
+    for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+        if (index[i]) fclose (index[i]);
+    }
+
+    if (failure) {
+        houselog_trace (HOUSE_FAILURE, "fsync(2)", "%s", failure);
+        for (i = 0; i < HouseMotionPackWritersCount; ++i) {
+            struct housemotion_pack_writer *writer = HouseMotionPackWriters + i;
+            if (!index[i]) continue;
+            snprintf (path, sizeof(path), "%s/" MOTION_PACK_DIR "/%08d.idx",
+                      HouseMotionPackRoots[writer->instance], writer->day);
+            if (truncate (path, indexstart[i])) {
+                houselog_trace (HOUSE_FAILURE, "truncate(2)",
+                                "%s: %s", path, strerror(errno));
+            }
+        }
+        housemotion_pack_end (1);
+        return;
+    }
+
+    int count = 0;
+    for (i = 0; i < HouseMotionPackCandidatesCount; ++i) {
+        struct housemotion_pack_candidate *candidate =
+            HouseMotionPackCandidates + i;
+        if (candidate->writer >= 0) {
+            PictureArchive *archive =
+                housemotion_pack_archive (candidate->instance,
+                                          candidate->day, 1);
+            housemotion_pack_insert (archive, candidate->relative,
+                                     candidate->mtime,
+                                     candidate->offset, candidate->size);
+        } else if (!candidate->packed) {
+            continue;
+        }
+        char *path = candidate->path;
+        if (unlink (path)) continue;
+        housemotion_index_remove (path);
+        char *s = strrchr (path, '/');
+        if (s) {
+            *s = 0;
+            rmdir (path); // Nothing done if the directory is not empty.
+        }
+        count += 1;
+    }
+    DEBUG ("Packed %d pictures\n", count);
+    housemotion_pack_end (0);
+}
+
+void housemotion_pack_refresh (void) {
+
+    if (HouseMotionPackStep == MOTION_PACK_IDLE) return;
+
+    long long deadline = housemotion_pack_clock () + MOTION_PACK_SLICE;
+
+    if (HouseMotionPackStep == MOTION_PACK_SELECT) {
+        struct housemotion_pack_selection selection;
+        selection.examined = 0;
+        selection.done = 0;
+        HouseMotionPackDeadline = deadline;
+        if (!housemotion_order_resume (HOUSEMOTION_ORDER_TIME,
+                                       &HouseMotionPackCursor,
+                                       housemotion_pack_select, &selection))
+            selection.done = 1; // No more recordings.
+        if ((!selection.done) &&
+            (HouseMotionPackCandidatesCount < MOTION_PACK_BATCH))
+            return; // Continue on the next slice.
+        HouseMotionPackStep = MOTION_PACK_COPY;
+    }
+    housemotion_pack_copy_next (deadline);
+    if (HouseMotionPackNext < HouseMotionPackCandidatesCount) return;
+    housemotion_pack_commit ();
+}
+
+void housemotion_pack_background (time_t now) {
+
+    if (HouseMotionPackDays <= 0) return;
+    if (HouseMotionPackStep != MOTION_PACK_IDLE) return; // Batch in progress.
+    if (housemotion_pressure_defer ()) return; // Try again later.
+
+    // The selection resumes where the previous batch stopped. Once in a
+    // while, it restarts from the oldest recording, in case older
+    // pictures were found by the storage walk since.
+    //
+    if (now >= HouseMotionPackRescan) {
+        HouseMotionPackFrom = 0;
+        HouseMotionPackRescan = now + MOTION_PACK_RESCAN;
+    }
+    housemotion_order_start (&HouseMotionPackCursor);
+    HouseMotionPackCursor.key = HouseMotionPackFrom;
+    HouseMotionPackLimit = now - (HouseMotionPackDays * 86400);
+    HouseMotionPackCandidates =
+        malloc (MOTION_PACK_BATCH * sizeof(struct housemotion_pack_candidate));
+    HouseMotionPackCandidatesCount = 0;
+    HouseMotionPackNext = 0;
+    HouseMotionPackStep = MOTION_PACK_SELECT;
+}
+
+void housemotion_pack_listen (housemotion_index_listener *listener) {
+    if (HouseMotionPackListenersCount >= MOTION_PACK_LISTENERS) return;
+    HouseMotionPackListeners[HouseMotionPackListenersCount++] = listener;
+}
+
+long long housemotion_pack_version (void) {
+    return HouseMotionPackVersion;
+}
+
+int housemotion_pack_status (char *buffer, int size) {
+
+    int i;
+    long long bytes = 0;
+    for (i = 0; i < HouseMotionPacksCount; ++i) {
+        bytes += HouseMotionPacks[i].bytes;
+    }
+    int cursor = snprintf (buffer, size,
+                           "\"packs\":{\"days\":%d,\"count\":%d,"
+                               "\"pictures\":%lld,\"bytes\":%lld}",
+                           HouseMotionPackDays, HouseMotionPacksCount,
+                           HouseMotionPackedTotal, bytes);
+    if (cursor >= size) {
+        houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+        buffer[0] = 0;
+        return 0;
+    }
+    return cursor;
+}
+
+void housemotion_pack_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *days = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-pack=", argv[i], &days);
+    }
+    if (days) HouseMotionPackDays = atoi(days);
+}
@@ -0,0 +1,38 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_pack.h - Pack the old pictures into one file per day.
+ */
+void housemotion_pack_initialize (int argc, const char **argv);
+void housemotion_pack_location (int instance, const char *root);
+
+int  housemotion_pack_enumerate (int instance,
+                                 housemotion_index_iterator *iterator,
+                                 void *context);
+int  housemotion_pack_open (const char *relative, long long *size);
+
+time_t housemotion_pack_oldest (int instance);
+void   housemotion_pack_delete_oldest (int instance);
+
+void housemotion_pack_background (time_t now);
+void housemotion_pack_refresh (void);
+void housemotion_pack_listen (housemotion_index_listener *listener);
+long long housemotion_pack_version (void);
+int  housemotion_pack_status (char *buffer, int size);
@@ -0,0 +1,715 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_peer.c - Aggregate the recordings of all HouseMotion peers.
+ *
+ * SYNOPSYS:
+ *
+ * A site may run several Motion servers, each with its own HouseMotion
+ * service. In aggregator mode (--motion-aggregate), this module finds
+ * all the cctv services, using HouseDiscover or the --motion-peers list,
+ * and maintains a merged copy of their recordings lists, their feeds
+ * and their storage summary. This merged copy is served as one single
+ * listing.
+ *
+ * Each peer is fully synchronized using its catalog every 5 minutes,
+ * which also accounts for deleted recordings. In between, the peer is
+ * checked every 10 seconds, and only the recordings modified recently
+ * are requested when its "updated" timestamp changed. These recordings
+ * are requested a page at a time, in time order, each page starting at
+ * the time of the last recording received, until a short page is
+ * received: the peer's recordings list is limited in size. If the peer
+ * is overloaded and rejects a page, the same page is requested again
+ * after a short delay, which doubles on each rejection: the pages
+ * already received are not requested again.
+ *
+ * There is only one request pending per peer at any given time: the
+ * check, status and recordings requests are chained.
+ *
+ * void housemotion_peer_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_peer_background (time_t now);
+ *
+ *    Discover the peers and query them periodically.
+ *
+ * int housemotion_peer_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the aggregation statistics.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housediscover.h"
+#include "housemotion_peer.h"
+#include "housemotion_admit.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_PEER_MAX     32
+#define MOTION_PEER_FEEDS   32
+#define MOTION_PEER_PERIOD  10  // Check each peer every 10 seconds.
+#define MOTION_PEER_SYNC    300 // Full synchronization every 5 minutes.
+#define MOTION_PEER_OVERLAP 120 // Files may still change for a while.
+#define MOTION_PEER_TIMEOUT 60  // Forget a pending request after a minute.
+#define MOTION_PEER_PAGE    100 // Recordings per request, well below 64 KB.
+#define MOTION_PEER_BACKOFF 8   // Longest delay before asking a page again.
+
+typedef struct {
+    char     *path;
+    char     *camera;
+    time_t    mtime;
+    long long size;
+    int       stable;
+} PeerRecording;
+
+typedef struct {
+    char     *url;
+    char      host[128];
+    long long updated;
+    time_t    synced;
+    time_t    contacted;
+    time_t    pending;
+    char      available[16];
+    char      total[16];
+    char      used[8];
+    int       feeds;
+    char     *feed[MOTION_PEER_FEEDS];
+    char     *feedurl[MOTION_PEER_FEEDS];
+    PeerRecording *recordings;
+    int       count;
+    int       size;
+    time_t    latest;
+    time_t    since; // The start of the current page of recordings.
+    time_t    retry; // When to ask again for the current page (if rejected).
+    int       backoff;
+} MotionPeer;
+
+static int HouseMotionAggregate = 0;
+static char HouseMotionHost[128];
+static char HouseMotionSelf[256];
+
+static MotionPeer HouseMotionPeers[MOTION_PEER_MAX];
+static int HouseMotionPeersCount = 0;
+
+// The merged list, sorted by time, is rebuilt only when a peer changed.
+typedef struct {
+    int peer;
+    const PeerRecording *recording;
+} MergedRecording;
+
+static MergedRecording *HouseMotionMerged = 0;
+static int HouseMotionMergedCount = 0;
+static long long HouseMotionPeerVersion = 0;
+static long long HouseMotionMergedVersion = -1;
+
+static void housemotion_peer_check (MotionPeer *peer);
+
+static MotionPeer *housemotion_peer_add (const char *url) {
+
+    int i;
+    for (i = 0; i < HouseMotionPeersCount; ++i) {
+        if (!strcmp (HouseMotionPeers[i].url, url)) return HouseMotionPeers + i;
+    }
+    if (!strcmp (url, HouseMotionSelf)) return 0; // Local data is not a peer.
+    if (HouseMotionPeersCount >= MOTION_PEER_MAX) return 0;
+
+    MotionPeer *peer = HouseMotionPeers + (HouseMotionPeersCount++);
+    memset (peer, 0, sizeof(*peer));
+    peer->url = strdup (url);
+    houselog_event ("SERVICE", "cctv", "PEER", "ADDED %s", url);
+    return peer;
+}
+
+static void housemotion_peer_discovered (const char *service,
+                                         void *context, const char *url) {
+    housemotion_peer_add (url);
+}
+
+static int housemotion_peer_bypath (const void *a, const void *b) {
+    return strcmp (((const PeerRecording *)a)->path,
+                   ((const PeerRecording *)b)->path);
+}
+
+static void housemotion_peer_clear (MotionPeer *peer) {
+    int i;
+    for (i = 0; i < peer->count; ++i) {
+        free (peer->recordings[i].path);
+        free (peer->recordings[i].camera);
+    }
+    peer->count = 0;
+    peer->latest = 0;
+}
+
+// Add or update one recording. The list is sorted again by the caller
+// when a recording was added.
+//
+static int housemotion_peer_store (MotionPeer *peer, const char *path,
+                                   const char *camera, time_t mtime,
+                                   long long size, int stable, int sorted) {
+
+    PeerRecording *recording = 0;
+    if (sorted) {
+        PeerRecording key;
+        key.path = (char *)path;
+        recording = bsearch (&key, peer->recordings, peer->count,
+                             sizeof(PeerRecording), housemotion_peer_bypath);
+    }
+    int added = 0;
+    if (!recording) {
+        if (peer->count >= peer->size) {
+            peer->size += 1024;
+            peer->recordings = realloc (peer->recordings,
+                                        peer->size * sizeof(PeerRecording));
+        }
+        recording = peer->recordings + (peer->count++);
+        recording->path = strdup (path);
+        recording->camera = strdup (camera?camera:"");
+        added = 1;
+    } else if (camera && strcmp (camera, recording->camera)) {
+        free (recording->camera);
+        recording->camera = strdup (camera);
+    }
+    recording->mtime = mtime;
+    recording->size = size;
+    recording->stable = stable;
+    if (mtime > peer->latest) peer->latest = mtime;
+    return added;
+}
+
+static MotionPeer *housemotion_peer_response (void *origin, int status,
+                                              const char *what) {
+
+    MotionPeer *peer = (MotionPeer *)origin;
+    if (status != 200) {
+        houselog_trace (HOUSE_FAILURE, peer->url, "%s: HTTP code %d",
+                        what, status);
+        peer->pending = 0;
+        return 0;
+    }
+    peer->contacted = time(0);
+    return peer;
+}
+
+static void housemotion_peer_submit (MotionPeer *peer, const char *uri,
+                                     echttp_response *response) {
+
+    char url[512];
+    snprintf (url, sizeof(url), "%s%s", peer->url, uri);
+
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, url, "%s", error);
+        peer->pending = 0;
+        return;
+    }
+    DEBUG ("Peer request: %s\n", url);
+    peer->pending = time(0);
+    echttp_submit (0, 0, response, (void *)peer);
+}
+
+static void housemotion_peer_delta (void *origin,
+                                    int status, char *data, int length);
+
+static void housemotion_peer_page (MotionPeer *peer, time_t since) {
+    char uri[128];
+    peer->since = since;
+    snprintf (uri, sizeof(uri), "/recordings?since=%lld&count=%d",
+              (long long)since, MOTION_PEER_PAGE);
+    housemotion_peer_submit (peer, uri, housemotion_peer_delta);
+}
+
+static void housemotion_peer_delta (void *origin,
+                                    int status, char *data, int length) {
+
+    status = echttp_redirected ("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemotion_peer_delta, origin);
+        return;
+    }
+    if (status == 503) {
+        // The peer is overloaded: ask for the same page again later.
+        MotionPeer *peer = (MotionPeer *)origin;
+        peer->backoff = peer->backoff ? peer->backoff * 2 : 1;
+        if (peer->backoff > MOTION_PEER_BACKOFF)
+            peer->backoff = MOTION_PEER_BACKOFF;
+        peer->retry = time(0) + peer->backoff;
+        peer->pending = 0;
+        return;
+    }
+    MotionPeer *peer = housemotion_peer_response (origin, status, "recordings");
+    if (!peer) {
+        // Ask again on the next check.
+        ((MotionPeer *)origin)->updated = 0;
+        return;
+    }
+    peer->pending = 0;
+    peer->backoff = 0;
+
+    int count = echttp_json_estimate (data);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    const char *error = echttp_json_parse (data, tokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, peer->url, "JSON syntax: %s", error);
+        free (tokens);
+        return;
+    }
+    int list = echttp_json_search (tokens, ".recordings");
+    if ((list > 0) && (tokens[list].type == PARSER_ARRAY)) {
+        int i;
+        int n = tokens[list].length;
+        int *items = calloc (n, sizeof(int));
+        int added = 0;
+        time_t last = peer->since;
+        echttp_json_enumerate (tokens+list, items, n);
+        for (i = 0; i < n; ++i) {
+            // [mtime, path, size, stable, type, camera]
+            ParserToken *item = tokens + list + items[i];
+            if ((item->type != PARSER_ARRAY) || (item->length < 6)) continue;
+            if (item[2].type != PARSER_STRING) continue;
+            added += housemotion_peer_store (peer, item[2].value.string,
+                                             item[6].value.string,
+                                             (time_t)(item[1].value.integer),
+                                             item[3].value.integer,
+                                             item[4].value.bool, 1);
+            if ((time_t)(item[1].value.integer) > last)
+                last = (time_t)(item[1].value.integer);
+        }
+        free (items);
+        if (added) qsort (peer->recordings, peer->count,
+                          sizeof(PeerRecording), housemotion_peer_bypath);
+        HouseMotionPeerVersion += 1;
+
+        // A full page means that there may be more: the next page starts
+        // at the last time received, which is listed again. If the whole
+        // page had the same time, skip that second, to always progress.
+        //
+        if (n >= MOTION_PEER_PAGE) {
+            free (tokens);
+            if (last <= peer->since) last = peer->since + 1;
+            housemotion_peer_page (peer, last);
+            return;
+        }
+    }
+    free (tokens);
+}
+
+static void housemotion_peer_status_update (void *origin,
+                                            int status, char *data, int length) {
+
+    status = echttp_redirected ("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemotion_peer_status_update, origin);
+        return;
+    }
+    MotionPeer *peer = housemotion_peer_response (origin, status, "status");
+    if (!peer) return;
+
+    int count = echttp_json_estimate (data);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    const char *error = echttp_json_parse (data, tokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, peer->url, "JSON syntax: %s", error);
+        free (tokens);
+        peer->pending = 0;
+        return;
+    }
+    int i = echttp_json_search (tokens, ".host");
+    if ((i >= 0) && (tokens[i].type == PARSER_STRING))
+        snprintf (peer->host, sizeof(peer->host), "%s", tokens[i].value.string);
+    i = echttp_json_search (tokens, ".cctv.available");
+    if ((i > 0) && (tokens[i].type == PARSER_STRING))
+        snprintf (peer->available, sizeof(peer->available),
+                  "%s", tokens[i].value.string);
+    i = echttp_json_search (tokens, ".cctv.total");
+    if ((i > 0) && (tokens[i].type == PARSER_STRING))
+        snprintf (peer->total, sizeof(peer->total),
+                  "%s", tokens[i].value.string);
+    i = echttp_json_search (tokens, ".cctv.used");
+    if ((i > 0) && (tokens[i].type == PARSER_STRING))
+        snprintf (peer->used, sizeof(peer->used),
+                  "%s", tokens[i].value.string);
+
+    int feeds = echttp_json_search (tokens, ".cctv.feeds");
+    if ((feeds > 0) && (tokens[feeds].type == PARSER_OBJECT)) {
+        int n = tokens[feeds].length;
+        int *items = calloc (n, sizeof(int));
+        echttp_json_enumerate (tokens+feeds, items, n);
+        for (i = 0; i < peer->feeds; ++i) {
+            free (peer->feed[i]);
+            free (peer->feedurl[i]);
+        }
+        peer->feeds = 0;
+        for (i = 0; (i < n) && (peer->feeds < MOTION_PEER_FEEDS); ++i) {
+            ParserToken *item = tokens + feeds + items[i];
+            if (item->type != PARSER_STRING) continue;
+            peer->feed[peer->feeds] = strdup (item->key);
+            peer->feedurl[peer->feeds] = strdup (item->value.string);
+            peer->feeds += 1;
+        }
+        free (items);
+    }
+    free (tokens);
+    HouseMotionPeerVersion += 1;
+
+    // Now get the recordings that may have changed since the last time.
+    time_t since = peer->latest - MOTION_PEER_OVERLAP;
+    if (since < 0) since = 0;
+    housemotion_peer_page (peer, since);
+}
+
+static void housemotion_peer_checked (void *origin,
+                                      int status, char *data, int length) {
+
+    status = echttp_redirected ("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemotion_peer_checked, origin);
+        return;
+    }
+    MotionPeer *peer = housemotion_peer_response (origin, status, "check");
+    if (!peer) return;
+
+    ParserToken tokens[32];
+    int count = 32;
+    const char *error = echttp_json_parse (data, tokens, &count);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, peer->url, "JSON syntax: %s", error);
+        peer->pending = 0;
+        return;
+    }
+    int i = echttp_json_search (tokens, ".updated");
+    if ((i <= 0) || (tokens[i].type != PARSER_INTEGER)) {
+        peer->pending = 0;
+        return;
+    }
+    if (tokens[i].value.integer == peer->updated) {
+        peer->pending = 0;
+        return; // Nothing new.
+    }
+    peer->updated = tokens[i].value.integer;
+    housemotion_peer_submit (peer, "/status", housemotion_peer_status_update);
+}
+
+static void housemotion_peer_catalog (void *origin,
+                                      int status, char *data, int length) {
+
+    status = echttp_redirected ("GET");
+    if (!status) {
+        echttp_submit (0, 0, housemotion_peer_catalog, origin);
+        return;
+    }
+    if (status == 503) {
+        // The catalog is being produced: ask again on the next check.
+        ((MotionPeer *)origin)->pending = 0;
+        return;
+    }
+    MotionPeer *peer = housemotion_peer_response (origin, status, "catalog");
+    if (!peer) return;
+
+    // The catalog is the complete list: start from scratch.
+    housemotion_peer_clear (peer);
+
+    char *line = data;
+    while (line && *line) {
+        char *eol = strchr (line, '\n');
+        if (eol) *eol = 0;
+
+        ParserToken tokens[16];
+        int count = 16;
+        if (!echttp_json_parse (line, tokens, &count)) {
+            int path = echttp_json_search (tokens, ".path");
+            int camera = echttp_json_search (tokens, ".camera");
+            int mtime = echttp_json_search (tokens, ".mtime");
+            int size = echttp_json_search (tokens, ".size");
+            int stable = echttp_json_search (tokens, ".stable");
+            if ((path > 0) && (mtime > 0) && (size > 0)) {
+                housemotion_peer_store
+                    (peer, tokens[path].value.string,
+                     (camera > 0) ? tokens[camera].value.string : 0,
+                     (time_t)(tokens[mtime].value.integer),
+                     tokens[size].value.integer,
+                     (stable > 0) ? tokens[stable].value.bool : 0, 0);
+            }
+        }
+        line = eol ? eol + 1 : 0;
+    }
+    qsort (peer->recordings, peer->count,
+           sizeof(PeerRecording), housemotion_peer_bypath);
+    peer->synced = time(0);
+    HouseMotionPeerVersion += 1;
+
+    // Also refresh the feeds and storage information.
+    peer->updated = 0;
+    housemotion_peer_check (peer);
+}
+
+static void housemotion_peer_check (MotionPeer *peer) {
+    housemotion_peer_submit (peer, "/check", housemotion_peer_checked);
+}
+
+void housemotion_peer_background (time_t now) {
+
+    static time_t LastCheck = 0;
+    static time_t LastDiscovery = 0;
+
+    if (!HouseMotionAggregate) return;
+
+    // Resume the page requests that were rejected, without waiting for
+    // the next check.
+    int i;
+    for (i = 0; i < HouseMotionPeersCount; ++i) {
+        MotionPeer *peer = HouseMotionPeers + i;
+        if ((!peer->retry) || (now < peer->retry)) continue;
+        peer->retry = 0;
+        housemotion_peer_page (peer, peer->since);
+    }
+
+    if (now < LastCheck + MOTION_PEER_PERIOD) return;
+    LastCheck = now;
+
+    if (housediscover_changed ("cctv", LastDiscovery)) {
+        housediscovered ("cctv", 0, housemotion_peer_discovered);
+        LastDiscovery = now;
+    }
+
+    for (i = 0; i < HouseMotionPeersCount; ++i) {
+        MotionPeer *peer = HouseMotionPeers + i;
+        if (peer->retry) continue; // Still catching up.
+        if (peer->pending) {
+            if (now < peer->pending + MOTION_PEER_TIMEOUT) continue;
+            houselog_trace (HOUSE_FAILURE, peer->url, "no response");
+        }
+        if (now >= peer->synced + MOTION_PEER_SYNC)
+            housemotion_peer_submit (peer, "/catalog", housemotion_peer_catalog);
+        else
+            housemotion_peer_check (peer);
+    }
+}
+
+static int housemotion_peer_bytime (const void *a, const void *b) {
+    time_t ta = ((const MergedRecording *)a)->recording->mtime;
+    time_t tb = ((const MergedRecording *)b)->recording->mtime;
+    if (ta < tb) return -1;
+    if (ta > tb) return 1;
+    return 0;
+}
+
+static void housemotion_peer_merge (void) {
+
+    if (HouseMotionMergedVersion == HouseMotionPeerVersion) return;
+
+    int i, j;
+    int total = 0;
+    for (i = 0; i < HouseMotionPeersCount; ++i)
+        total += HouseMotionPeers[i].count;
+
+    HouseMotionMerged = realloc (HouseMotionMerged,
+                                 (total + 1) * sizeof(MergedRecording));
+    HouseMotionMergedCount = 0;
+    for (i = 0; i < HouseMotionPeersCount; ++i) {
+        for (j = 0; j < HouseMotionPeers[i].count; ++j) {
+            MergedRecording *merged =
+                HouseMotionMerged + (HouseMotionMergedCount++);
+            merged->peer = i;
+            merged->recording = HouseMotionPeers[i].recordings + j;
+        }
+    }
+    qsort (HouseMotionMerged, HouseMotionMergedCount,
+           sizeof(MergedRecording), housemotion_peer_bytime);
+    HouseMotionMergedVersion = HouseMotionPeerVersion;
+}
+
+static int housemotion_peer_list (char *buffer, int size) {
+
+    int i, j;
+    int cursor = snprintf (buffer, size, "\"peers\":[");
+    if (cursor >= size) goto overflow;
+
+    const char *sep = "";
+    for (i = 0; i < HouseMotionPeersCount; ++i) {
+        MotionPeer *peer = HouseMotionPeers + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s{\"url\":\"%s\",\"host\":\"%s\","
+                                "\"updated\":%lld,\"synced\":%lld,"
+                                "\"contacted\":%lld,\"available\":\"%s\","
+                                "\"total\":\"%s\",\"used\":\"%s\","
+                                "\"recordings\":%d,\"feeds\":{",
+                            sep, peer->url, peer->host, peer->updated,
+                            (long long)(peer->synced),
+                            (long long)(peer->contacted),
+                            peer->available, peer->total, peer->used,
+                            peer->count);
+        if (cursor >= size) goto overflow;
+        const char *fsep = "";
+        for (j = 0; j < peer->feeds; ++j) {
+            cursor += snprintf (buffer+cursor, size-cursor, "%s\"%s\":\"%s\"",
+                                fsep, peer->feed[j], peer->feedurl[j]);
+            if (cursor >= size) goto overflow;
+            fsep = ",";
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}}");
+        if (cursor >= size) goto overflow;
+        sep = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+static const char *housemotion_peer_aggregate (const char *method,
+                                               const char *uri,
+                                               const char *data, int length) {
+    static char buffer[131073];
+
+    const char *camera = echttp_parameter_get ("camera");
+    const char *order = echttp_parameter_get ("order");
+    const char *count = echttp_parameter_get ("count");
+    const char *after = echttp_parameter_get ("since");
+
+    // A request whose key was truncated is never shared.
+    char buffer_key[512];
+    const char *key = buffer_key;
+    if (snprintf (buffer_key, sizeof(buffer_key),
+                  "/cctv/aggregate?%s&%s&%s&%s",
+                  camera?camera:"", order?order:"",
+                  count?count:"", after?after:"") >= sizeof(buffer_key))
+        key = 0;
+    const char *shared = housemotion_admit_shared (key);
+    if (shared) {
+        echttp_content_type_json ();
+        return shared;
+    }
+    if (!housemotion_admit_request ("/cctv/aggregate")) return "";
+
+    if (camera && (!camera[0])) camera = 0;
+    int descending = (order && (!strcmp (order, "desc")));
+    int max = count ? atoi(count) : 0;
+    time_t since = after ? (time_t)atoll(after) : 0;
+
+    housemotion_peer_merge ();
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,",
+                           HouseMotionHost, (long long)time(0));
+    cursor += housemotion_peer_list (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                        ",\"recordings\":[");
+
+    const char *sep = "";
+    int listed = 0;
+    int i;
+    for (i = 0; i < HouseMotionMergedCount; ++i) {
+
+        if ((max > 0) && (listed >= max)) break;
+
+        int j = descending ? HouseMotionMergedCount - 1 - i : i;
+        const MergedRecording *merged = HouseMotionMerged + j;
+        const PeerRecording *recording = merged->recording;
+        if (recording->mtime < since) continue;
+        if (camera && strcmp (camera, recording->camera)) continue;
+
+        int saved = cursor;
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            "%s[%lld,%d,\"%s\",%lld,%s,\"%s\"]",
+                            sep,
+                            (long long)(recording->mtime),
+                            merged->peer,
+                            recording->path,
+                            recording->size,
+                            recording->stable?"true":"false",
+                            recording->camera);
+        if (cursor >= sizeof(buffer) - 8) {
+            cursor = saved; // Keep what fits, and end the JSON data.
+            break;
+        }
+        sep = ",";
+        listed += 1;
+    }
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "]}");
+    echttp_content_type_json ();
+    return housemotion_admit_save (key, buffer);
+}
+
+int housemotion_peer_status (char *buffer, int size) {
+
+    if (!HouseMotionAggregate) return 0;
+
+    int i;
+    long long recordings = 0;
+    for (i = 0; i < HouseMotionPeersCount; ++i)
+        recordings += HouseMotionPeers[i].count;
+
+    int cursor = snprintf (buffer, size,
+                           "\"aggregate\":{\"peers\":%d,\"recordings\":%lld}",
+                           HouseMotionPeersCount, recordings);
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+void housemotion_peer_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *peers = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-motion-aggregate", argv[i]))
+            HouseMotionAggregate = 1;
+        echttp_option_match ("-motion-peers=", argv[i], &peers);
+    }
+    if (peers) HouseMotionAggregate = 1;
+    if (!HouseMotionAggregate) return;
+
+    gethostname (HouseMotionHost, sizeof(HouseMotionHost));
+    snprintf (HouseMotionSelf, sizeof(HouseMotionSelf),
+              "http://%s:%d/cctv", HouseMotionHost, echttp_port(4));
+
+    // The explicit list of peers is a comma-separated list of URLs.
+    if (peers) {
+        char *list = strdup (peers);
+        char *url = strtok (list, ",");
+        while (url) {
+            housemotion_peer_add (url);
+            url = strtok (0, ",");
+        }
+        free (list);
+    }
+    echttp_route_uri ("/cctv/aggregate", housemotion_peer_aggregate);
+}
@@ -0,0 +1,202 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_pressure.c - Adapt to the system memory and I/O pressure.
+ *
+ * SYNOPSYS:
+ *
+ * HouseMotion often runs on small computers, next to Motion, which must
+ * never run out of memory or be slowed down by HouseMotion's own disk
+ * accesses. This module reads the Linux pressure stall information
+ * (/proc/pressure/memory and /proc/pressure/io) and tells the other
+ * modules when to release their optional caches, or when to postpone
+ * their optional background work.
+ *
+ * A pressure is detected when the "some" 10 seconds average reaches the
+ * configured threshold, and ends when it falls below half that threshold.
+ * If the kernel does not support PSI, no pressure is ever detected.
+ *
+ * void housemotion_pressure_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_pressure_background (time_t now);
+ *
+ *    Read the current pressure, every few seconds.
+ *
+ * int housemotion_pressure_shrink (void);
+ *
+ *    Return 1 if the optional caches should be released (memory
+ *    pressure), 0 otherwise.
+ *
+ * int housemotion_pressure_defer (void);
+ *
+ *    Return 1 if the optional background work should be postponed (I/O
+ *    or memory pressure), 0 otherwise.
+ *
+ * int housemotion_pressure_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the latest pressure readings and the
+ *    number of decisions made because of pressure.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_pressure.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_PRESSURE_PERIOD 5
+
+typedef struct {
+    const char *path;
+    const char *name;
+    int    available;
+    double some;
+    double full;
+    double threshold;
+    int    active;
+    time_t since;
+} MotionPressure;
+
+static MotionPressure HouseMotionMemory = {"/proc/pressure/memory", "memory", 1, 0, 0, 10.0, 0, 0};
+static MotionPressure HouseMotionIo = {"/proc/pressure/io", "io", 1, 0, 0, 20.0, 0, 0};
+
+static long long HouseMotionShrinkCount = 0;
+static long long HouseMotionDeferCount = 0;
+
+static void housemotion_pressure_read (MotionPressure *pressure, time_t now) {
+
+    if (!pressure->available) return;
+
+    FILE *fd = fopen (pressure->path, "r");
+    if (!fd) {
+        pressure->available = 0;
+        return;
+    }
+    char line[256];
+    while (fgets (line, sizeof(line), fd)) {
+        double avg10;
+        if (sscanf (line, "some avg10=%lf", &avg10) == 1)
+            pressure->some = avg10;
+        else if (sscanf (line, "full avg10=%lf", &avg10) == 1)
+            pressure->full = avg10;
+    }
+    fclose (fd);
+
+    if (pressure->active) {
+        if (pressure->some < pressure->threshold / 2) {
+            pressure->active = 0;
+            houselog_event ("SERVICE", "cctv", "PRESSURE",
+                            "%s pressure ended (%.1f%%)",
+                            pressure->name, pressure->some);
+        }
+    } else if (pressure->some >= pressure->threshold) {
+        pressure->active = 1;
+        pressure->since = now;
+        houselog_event ("SERVICE", "cctv", "PRESSURE",
+                        "%s pressure detected (%.1f%%)",
+                        pressure->name, pressure->some);
+    }
+}
+
+void housemotion_pressure_background (time_t now) {
+
+    static time_t LastCheck = 0;
+
+    if (now < LastCheck + MOTION_PRESSURE_PERIOD) return;
+    LastCheck = now;
+
+    housemotion_pressure_read (&HouseMotionMemory, now);
+    housemotion_pressure_read (&HouseMotionIo, now);
+}
+
+int housemotion_pressure_shrink (void) {
+    if (!HouseMotionMemory.active) return 0;
+    HouseMotionShrinkCount += 1;
+    return 1;
+}
+
+int housemotion_pressure_defer (void) {
+    if ((!HouseMotionMemory.active) && (!HouseMotionIo.active)) return 0;
+    HouseMotionDeferCount += 1;
+    return 1;
+}
+
+static int housemotion_pressure_item (char *buffer, int size,
+                                      const MotionPressure *pressure) {
+    if (!pressure->available)
+        return snprintf (buffer, size, "\"%s\":null", pressure->name);
+
+    return snprintf (buffer, size,
+                     "\"%s\":{\"some\":%.2f,\"full\":%.2f,"
+                         "\"threshold\":%.1f,\"active\":%s,\"since\":%lld}",
+                     pressure->name, pressure->some, pressure->full,
+                     pressure->threshold, pressure->active?"true":"false",
+                     (long long)(pressure->active?pressure->since:0));
+}
+
+int housemotion_pressure_status (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size, "\"pressure\":{");
+    if (cursor >= size) goto overflow;
+    cursor += housemotion_pressure_item (buffer+cursor, size-cursor,
+                                         &HouseMotionMemory);
+    if (cursor >= size) goto overflow;
+    cursor += snprintf (buffer+cursor, size-cursor, ",");
+    if (cursor >= size) goto overflow;
+    cursor += housemotion_pressure_item (buffer+cursor, size-cursor,
+                                         &HouseMotionIo);
+    if (cursor >= size) goto overflow;
+    cursor += snprintf (buffer+cursor, size-cursor,
+                        ",\"shrunk\":%lld,\"deferred\":%lld}",
+                        HouseMotionShrinkCount, HouseMotionDeferCount);
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+void housemotion_pressure_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *memory = 0;
+    const char *io = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-psi-memory=", argv[i], &memory);
+        echttp_option_match ("-motion-psi-io=", argv[i], &io);
+    }
+    if (memory) HouseMotionMemory.threshold = atof (memory);
+    if (io) HouseMotionIo.threshold = atof (io);
+
+    housemotion_pressure_read (&HouseMotionMemory, time(0));
+    housemotion_pressure_read (&HouseMotionIo, time(0));
+}
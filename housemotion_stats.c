@@ -0,0 +1,263 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_stats.c - Rolling per-camera activity statistics.
+ *
+ * SYNOPSYS:
+ *
+ * This module maintains, for each camera, the number of events per hour
+ * and the number of recorded bytes and the event durations per day, over
+ * the last 7 days. The counters are kept in circular arrays indexed by
+ * the hour (or day) number, so that each update costs the same regardless
+ * of the history size. The slots that have expired are cleared lazily,
+ * when the camera's counters are next accessed.
+ *
+ * void housemotion_stats_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void housemotion_stats_event (const char *camera, time_t start);
+ *
+ *    Account for a new event.
+ *
+ * void housemotion_stats_duration (const char *camera,
+ *                                  time_t start, time_t end);
+ *
+ *    Account for the duration of an event that ended.
+ *
+ * The recorded bytes are learnt from the recordings index: each new file
+ * is accounted for once, whether it was reported by a Motion hook or found
+ * by the storage walk, and so is any later growth of that file. The bytes
+ * are accounted for on the day the file was last modified, and to the
+ * camera decoded from the file name ("cctv" if unknown).
+ *
+ * The statistics can be queried using the following request:
+ *
+ *    GET /cctv/stats
+ *
+ * All arrays are listed from the oldest to the most recent period. The
+ * "hour" and "day" items are the start times of the most recent periods.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_index.h"
+#include "housemotion_stats.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_STATS_DAYS  7
+#define MOTION_STATS_HOURS (24 * MOTION_STATS_DAYS)
+#define MOTION_STATS_CAMERAS 32
+
+struct HouseMotionCameraStats {
+    char      camera[32];
+    long      hour; // Hours since epoch of the most recent slot.
+    long      day;  // Days since epoch of the most recent slot.
+    int       events[MOTION_STATS_HOURS];
+    int       ended[MOTION_STATS_DAYS];
+    long long duration[MOTION_STATS_DAYS];
+    long long bytes[MOTION_STATS_DAYS];
+};
+
+static struct HouseMotionCameraStats *HouseMotionStats[MOTION_STATS_CAMERAS];
+static int HouseMotionStatsCount = 0;
+
+static char HouseMotionStatsHost[256];
+
+// Move the most recent slot forward to the current time, clearing all
+// slots that are reused. This is at most one full pass on the arrays,
+// however long the camera was idle.
+//
+static void housemotion_stats_advance (struct HouseMotionCameraStats *stats,
+                                       time_t now) {
+    long hour = (long)(now / 3600);
+    long day = (long)(now / 86400);
+
+    if (hour > stats->hour) {
+        long delta = hour - stats->hour;
+        if (delta > MOTION_STATS_HOURS) delta = MOTION_STATS_HOURS;
+        while (delta-- > 0) {
+            stats->events[(hour - delta) % MOTION_STATS_HOURS] = 0;
+        }
+        stats->hour = hour;
+    }
+    if (day > stats->day) {
+        long delta = day - stats->day;
+        if (delta > MOTION_STATS_DAYS) delta = MOTION_STATS_DAYS;
+        while (delta-- > 0) {
+            int slot = (day - delta) % MOTION_STATS_DAYS;
+            stats->ended[slot] = 0;
+            stats->duration[slot] = 0;
+            stats->bytes[slot] = 0;
+        }
+        stats->day = day;
+    }
+}
+
+static struct HouseMotionCameraStats *housemotion_stats_camera
+                                          (const char *camera, time_t now) {
+    int i;
+    if (!camera) camera = "cctv";
+
+    for (i = 0; i < HouseMotionStatsCount; ++i) {
+        if (!strcmp (HouseMotionStats[i]->camera, camera)) {
+            housemotion_stats_advance (HouseMotionStats[i], now);
+            return HouseMotionStats[i];
+        }
+    }
+    if (HouseMotionStatsCount >= MOTION_STATS_CAMERAS) return 0;
+
+    struct HouseMotionCameraStats *stats =
+        calloc (1, sizeof(struct HouseMotionCameraStats));
+    strtcpy (stats->camera, camera, sizeof(stats->camera));
+    stats->hour = (long)(now / 3600);
+    stats->day = (long)(now / 86400);
+    HouseMotionStats[HouseMotionStatsCount++] = stats;
+    return stats;
+}
+
+void housemotion_stats_event (const char *camera, time_t start) {
+
+    struct HouseMotionCameraStats *stats =
+        housemotion_stats_camera (camera, time(0));
+    if (!stats) return;
+
+    long hour = (long)(start / 3600);
+    if ((hour > stats->hour) || (hour <= stats->hour - MOTION_STATS_HOURS))
+        return;
+    stats->events[hour % MOTION_STATS_HOURS] += 1;
+}
+
+void housemotion_stats_duration (const char *camera,
+                                 time_t start, time_t end) {
+
+    if ((!start) || (end < start)) return; // The start was not seen.
+
+    struct HouseMotionCameraStats *stats =
+        housemotion_stats_camera (camera, time(0));
+    if (!stats) return;
+
+    int slot = stats->day % MOTION_STATS_DAYS;
+    stats->ended[slot] += 1;
+    stats->duration[slot] += (long long)(end - start);
+}
+
+static void housemotion_stats_recorded (int root, const char *relative,
+                                        const HouseMotionFile *file,
+                                        const HouseMotionFile *previous) {
+
+    if (!file) return; // A deleted file was still recorded.
+
+    long long size = file->size;
+    if (previous) size -= previous->size;
+    if (size <= 0) return;
+
+    struct HouseMotionCameraStats *stats =
+        housemotion_stats_camera (file->camera, time(0));
+    if (!stats) return;
+
+    long day = (long)(file->mtime / 86400);
+    if (day > stats->day) day = stats->day; // Clock skew.
+    if (day <= stats->day - MOTION_STATS_DAYS) return; // Too old.
+    stats->bytes[day % MOTION_STATS_DAYS] += size;
+}
+
+static const char *housemotion_stats_query (const char *method, const char *uri,
+                                            const char *data, int length) {
+    static char buffer[65537];
+
+    int i, j;
+    time_t now = time(0);
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,"
+                               "\"hour\":%lld,\"day\":%lld,\"cameras\":{",
+                           HouseMotionStatsHost, (long long)now,
+                           (long long)((now / 3600) * 3600),
+                           (long long)((now / 86400) * 86400));
+    if (cursor >= sizeof(buffer)) goto overflow;
+
+    for (i = 0; i < HouseMotionStatsCount; ++i) {
+
+        struct HouseMotionCameraStats *stats = HouseMotionStats[i];
+        housemotion_stats_advance (stats, now);
+
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            "%s\"%s\":{\"events\":[",
+                            i?",":"", stats->camera);
+        if (cursor >= sizeof(buffer)) goto overflow;
+
+        const char *sep = "";
+        for (j = MOTION_STATS_HOURS - 1; j >= 0; --j) {
+            cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "%s%d",
+                                sep, stats->events[(stats->hour - j) % MOTION_STATS_HOURS]);
+            if (cursor >= sizeof(buffer)) goto overflow;
+            sep = ",";
+        }
+
+        int ended = 0;
+        long long duration = 0;
+        for (j = 0; j < MOTION_STATS_DAYS; ++j) {
+            ended += stats->ended[j];
+            duration += stats->duration[j];
+        }
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            "],\"duration\":%lld,\"bytes\":[",
+                            ended ? duration / ended : 0);
+        if (cursor >= sizeof(buffer)) goto overflow;
+
+        sep = "";
+        for (j = MOTION_STATS_DAYS - 1; j >= 0; --j) {
+            cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "%s%lld",
+                                sep, stats->bytes[(stats->day - j) % MOTION_STATS_DAYS]);
+            if (cursor >= sizeof(buffer)) goto overflow;
+            sep = ",";
+        }
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "]}");
+        if (cursor >= sizeof(buffer)) goto overflow;
+    }
+    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    if (cursor >= sizeof(buffer)) goto overflow;
+
+    echttp_content_type_json ();
+    return buffer;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    echttp_error (413, "Payload too large");
+    return "";
+}
+
+void housemotion_stats_initialize (int argc, const char **argv) {
+
+    gethostname (HouseMotionStatsHost, sizeof(HouseMotionStatsHost));
+
+    housemotion_index_listen (housemotion_stats_recorded);
+    echttp_route_uri ("/cctv/stats", housemotion_stats_query);
+}
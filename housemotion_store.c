@@ -29,16 +29,61 @@
  *
  *    Initialize this module.
  *
- * void housemotion_store_location (const char *directory);
+ * void housemotion_store_location (int instance, const char *directory);
  *
  *    Set the location of the Motion recording files, i.e. the directory
- *    where Motion stores them. This may be called multiple times if the
- *    Motion configuration is changed..
+ *    where the specified Motion instance stores them. This may be called
+ *    multiple times if the Motion configuration is changed..
+ *
+ *    Each Motion instance has its own storage and cleanup policy: the
+ *    Nth --motion-clean option applies to the Nth Motion instance, with
+ *    the last option applying to all the remaining instances.
  *
  * void housemotion_store_background (time_t now);
  *
  *    The periodic function that manages the video storage.
  *
+ *    The cleanup deletes whole events, oldest first: all the files that
+ *    belong to the same event as the oldest file are queued for deletion
+ *    together, and the queue is processed a batch at a time, so that a
+ *    large event does not stall the service. The files of an event are
+ *    recognized by their common name (see the README file), and must
+ *    have been written shortly after each other. The oldest event is
+ *    found using the recordings sorted by age (see housemotion_order.c).
+ *
+ *    If the storage usage reaches the critical level, or if the space
+ *    available becomes too small for Motion's next recording, the storage
+ *    enters emergency mode: the oldest events are deleted with no batch
+ *    limit until a safe margin is restored.
+ *
+ * void housemotion_store_refresh (void);
+ *
+ *    Write the next part of the catalog, if one was requested, and delete
+ *    the files of the oldest events while a storage is in emergency mode.
+ *    This is done in short slices, so that the Motion hooks are processed
+ *    in between: this must be called as often as possible.
+ *
+ * The recordings can be queried using the following request:
+ *
+ *    GET /cctv/recordings?camera=ID&sort=mtime|size&order=asc|desc
+ *                        &count=INTEGER&since=TIME
+ *
+ * All parameters are optional. The recordings are listed from the sorted
+ * lists maintained by housemotion_order.c, which are updated as the index
+ * and the packs change.
+ *
+ * int housemotion_store_open (const char *relative, long long *size,
+ *                            time_t *mtime, const char **type);
+ *
+ *    Open a recording, wherever it is stored (including the packs). The
+ *    file is positioned at the start of the recording. The modification
+ *    time is 0 for a packed picture. Return -1 if not found.
+ *
+ * int housemotion_store_emergency (char *buffer, int size);
+ *
+ *    Populate a JSON item that describes the storage emergency, if any.
+ *    Return 0 if no storage is in emergency mode.
+ *
  * long long housemotion_store_check (void);
  *
  *    Return a timestamp value. Any increase to that value indicates that
@@ -51,32 +96,59 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
-#include <dirent.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <echttp.h>
-#include <echttp_static.h>
 #include <echttp_json.h>
 #include <echttp_libc.h>
 
 #include "houselog.h"
+#include "housemotion_event.h"
+#include "housemotion_index.h"
+#include "housemotion_latency.h"
+#include "housemotion_order.h"
+#include "housemotion_pack.h"
+#include "housemotion_admit.h"
+#include "housemotion_stats.h"
 #include "housemotion_store.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
-static int HouseMotionMaxSpace = 0; // Default is no automatic cleanup.
+typedef struct {
+    char  *path;
+    int    maxspace; // Default is no automatic cleanup.
+    time_t emergency;
+    time_t atrisk;
+} MotionStorage;
+
+#define MOTION_STORAGE_MAX 8
+
+static MotionStorage HouseMotionStorage[MOTION_STORAGE_MAX];
+static int           HouseMotionStorageCount = 0;
 
-static char *HouseMotionStorage = 0;
 static time_t HouseMotionChanged = 0;
 
+// In emergency mode, events are queued until this many files are waiting
+// for deletion, and the files are deleted in short slices.
+//
+#define MOTION_EMERGENCY_BATCH 64
+#define MOTION_EMERGENCY_SLICE 50 // milliseconds.
+
+static int       HouseMotionCritical = 98;
+static long long HouseMotionReserve = 0;
+static long long HouseMotionLargestClip = 0;
+
 struct HouseMotionEvent {
     time_t timestamp;
     char   id[32];
@@ -86,6 +158,49 @@ struct HouseMotionEvent {
 static struct HouseMotionEvent HouseMotionRecentEvents[MOTION_EVENT_DEPTH];
 static int HouseMotionEventCursor = 0;
 
+#define MOTION_DELETE_BATCH 32
+
+static char HouseMotionStoreHost[256];
+
+static char **HouseMotionDeleteQueue = 0;
+static int    HouseMotionDeleteCount = 0;
+static int    HouseMotionDeleteSize = 0;
+static int    HouseMotionDeleteNext = 0;
+
+
+// The Motion hooks report the full path of a file, while the recordings
+// are identified by their path relative to their storage.
+//
+static const char *housemotion_store_relative (const char *path) {
+
+    int i;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+        const char *root = HouseMotionStorage[i].path;
+        if (!root) continue;
+        int length = strlen (root);
+        if (strncmp (path, root, length) || (path[length] != '/')) continue;
+        path += length;
+        while (*path == '/') path += 1;
+        return path;
+    }
+    return path;
+}
+
+// The recorded bytes statistics are fed by the index itself.
+//
+static void housemotion_store_file (const char *path) {
+
+    long long size = 0;
+    const HouseMotionFile *file = housemotion_index_notify (path);
+    if (file) {
+        size = file->size;
+    } else {
+        struct stat filestat;
+        if (!stat (path, &filestat)) size = (long long)(filestat.st_size);
+    }
+    if (size > HouseMotionLargestClip) HouseMotionLargestClip = size;
+    housemotion_event_file (housemotion_store_relative (path), size);
+}
 
 static const char *housemotion_store_record (const char *stage,
                                              const char *data, int length) {
@@ -99,11 +214,14 @@ static const char *housemotion_store_record (const char *stage,
     }
     if (event) {
         houselog_event (cat, cam, stage, "EVENT %s", event);
+        housemotion_event_add (cam, stage, event);
         return event;
     }
     const char *file = echttp_parameter_get ("file");
     if (file) {
         houselog_event (cat, cam, "FILE", "%s", file);
+        housemotion_event_add (cam, "FILE", file);
+        housemotion_store_file (file);
     }
     return 0;
 }
@@ -122,24 +240,67 @@ static void housemotion_store_complete (const char *event) {
 
 static const char *housemotion_store_start (const char *method, const char *uri,
                                             const char *data, int length) {
-    housemotion_store_record ("START", data, length);
+    const char *event = housemotion_store_record ("START", data, length);
+    if (event) {
+        const char *camera = echttp_parameter_get ("camera");
+        housemotion_event_start (camera, event);
+        housemotion_latency_start (camera, event);
+        housemotion_stats_event (camera, time(0));
+    }
     return 0;
 }
 
+static void housemotion_store_ended (const char *event) {
+
+    time_t start;
+    const char *camera = echttp_parameter_get ("camera");
+    int files = housemotion_event_end (camera, event, &start);
+    housemotion_latency_end (camera?camera:"cctv", event, start, files);
+    housemotion_stats_duration (camera, start, time(0));
+    housemotion_store_complete (event);
+}
+
 static const char *housemotion_store_end (const char *method, const char *uri,
                                             const char *data, int length) {
     const char *event = housemotion_store_record ("END", data, length);
-    if (event) housemotion_store_complete (event);
+    if (event) housemotion_store_ended (event);
     return 0;
 }
 
 static const char *housemotion_store_event (const char *method, const char *uri,
                                             const char *data, int length) {
     const char *event = housemotion_store_record ("EVENT", data, length);
-    if (event) housemotion_store_complete (event);
+    if (event) housemotion_store_ended (event);
     return 0;
 }
 
+// The content type is normally detected in the background and cached
+// in the index. This is only a fallback for the files that were not
+// processed yet.
+//
+static const char *housemotion_store_type (const char *name) {
+
+    static const char *Types[] = {
+        ".jpg",  "image/jpeg",
+        ".jpeg", "image/jpeg",
+        ".png",  "image/png",
+        ".mp4",  "video/mp4",
+        ".mkv",  "video/x-matroska",
+        ".webm", "video/webm",
+        ".avi",  "video/x-msvideo",
+        ".mov",  "video/quicktime",
+        0, 0
+    };
+    const char *extension = strrchr (name, '.');
+    if (extension) {
+        int i;
+        for (i = 0; Types[i]; i += 2) {
+            if (!strcasecmp (extension, Types[i])) return Types[i+1];
+        }
+    }
+    return "application/octet-stream";
+}
+
 static time_t housemotion_store_matchevent (const char *name) {
     int i;
     for (i = MOTION_EVENT_DEPTH-1; i >= 0; --i) {
@@ -149,20 +310,152 @@ static time_t housemotion_store_matchevent (const char *name) {
     return 0;
 }
 
-void housemotion_store_initialize (int argc, const char **argv) {
+// A file is considered stable if last update was a minute ago,
+// or else if it matches a detected event (and has not changed
+// since then--just to be safe).
+//
+// A file that belongs to an event still in progress is never stable.
+//
+static int housemotion_store_stable (const char *relative,
+                                     time_t mtime, time_t now) {
+    int stable = (mtime < (now - 60));
+    if (! stable) {
+        time_t eventtime = housemotion_store_matchevent (relative);
+        stable = (mtime <= eventtime);
+    }
+    if (stable) stable = !housemotion_event_active (relative);
+    return stable;
+}
 
-    int i;
-    const char *max = 0;
+// A recording still being written can be downloaded progressively: the
+// client requests the data from a given offset, repeatedly, until the
+// recording is reported complete. This service cannot hold a response
+// open while the file grows, so the client polls.
+//
+// The length limits the data returned, so that a client can fetch again
+// one block that failed its manifest verification.
+//
+static long long housemotion_store_offset (int fd, long long size,
+                                           int complete, long long *count) {
 
-    for (i = 1; i < argc; ++i) {
-        echttp_option_match ("-motion-clean=", argv[i], &max);
+    char ascii[32];
+    *count = size;
+    const char *offset = echttp_parameter_get ("offset");
+    if (!offset) return 0;
+
+    long long start = atoll (offset);
+    if (start < 0) start = 0;
+    if (start > size) start = size;
+    if (start > 0) lseek (fd, (off_t)start, SEEK_CUR);
+    *count = size - start;
+
+    const char *length = echttp_parameter_get ("length");
+    if (length) {
+        long long limit = atoll (length);
+        if ((limit >= 0) && (limit < *count)) *count = limit;
     }
-    if (max) {
-        HouseMotionMaxSpace = atoi(max);
+
+    snprintf (ascii, sizeof(ascii), "%lld", size);
+    echttp_attribute_set ("X-Motion-Size", ascii);
+    echttp_attribute_set ("X-Motion-Complete", complete?"true":"false");
+    return start;
+}
+
+int housemotion_store_open (const char *relative, long long *size,
+                            time_t *mtime, const char **type) {
+
+    // Use the index to find which Motion instance stores this file.
+    // A picture that is not in the index may have been packed. If the
+    // file is not indexed yet, try each storage in turn.
+    //
+    char path[1024];
+    const char *root = 0;
+    const HouseMotionFile *file = housemotion_index_lookup (relative, &root);
+    int fd = -1;
+    if (!root) {
+        fd = housemotion_pack_open (relative, size);
+        if (fd >= 0) {
+            // The file is positioned at the start of the picture.
+            *mtime = 0;
+            *type = "image/jpeg";
+            return fd;
+        }
     }
-    echttp_route_uri ("/cctv/motion/event", housemotion_store_event);
-    echttp_route_uri ("/cctv/motion/event/end", housemotion_store_end);
-    echttp_route_uri ("/cctv/motion/event/start", housemotion_store_start);
+    if (root) {
+        snprintf (path, sizeof(path), "%s/%s", root, relative);
+        fd = open (path, O_RDONLY);
+    } else {
+        int i;
+        for (i = 0; (i < HouseMotionStorageCount) && (fd < 0); ++i) {
+            if (!HouseMotionStorage[i].path) continue;
+            snprintf (path, sizeof(path),
+                      "%s/%s", HouseMotionStorage[i].path, relative);
+            fd = open (path, O_RDONLY);
+        }
+    }
+    if (fd < 0) return -1;
+
+    struct stat filestat;
+    if (fstat (fd, &filestat) || (!S_ISREG(filestat.st_mode))) {
+        close (fd);
+        return -1;
+    }
+    *size = (long long)(filestat.st_size);
+    *mtime = filestat.st_mtime;
+    if (file && file->type)
+        *type = file->type;
+    else
+        *type = housemotion_store_type (relative);
+    return fd;
+}
+
+static const char *housemotion_store_recording (const char *method,
+                                                const char *uri,
+                                                const char *data, int length) {
+
+    const char *relative = uri + strlen("/cctv/recording");
+    while (*relative == '/') relative += 1;
+
+    if ((!relative[0]) || strstr (relative, "..")) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    long long size;
+    time_t mtime;
+    const char *type;
+    int fd = housemotion_store_open (relative, &size, &mtime, &type);
+    if (fd < 0) {
+        echttp_error (404, "Not found");
+        return "";
+    }
+    echttp_content_type_set (type);
+
+    // A packed picture is always complete.
+    int complete =
+        (!mtime) || housemotion_store_stable (relative, mtime, time(0));
+    long long count;
+    long long start = housemotion_store_offset (fd, size, complete, &count);
+
+    // echttp_transfer() is limited to 2 GB: a larger range is split, and
+    // the client continues from the next offset. A complete download of
+    // a larger recording is not possible.
+    //
+    if (count > INT_MAX) {
+        if (!echttp_parameter_get ("offset")) {
+            close (fd);
+            echttp_error (413, "Recording too large, use offset");
+            return "";
+        }
+        count = INT_MAX;
+    }
+
+    // A download is only over when it reaches the end of a complete
+    // recording: a progressive download, or the first part of a split
+    // range, is only the start of the transfer.
+    //
+    housemotion_latency_served (relative, complete && (start + count >= size));
+    echttp_transfer (fd, (int)count);
+    return "";
 }
 
 // Calculate storage space information (total, free, %used).
@@ -208,94 +501,457 @@ long long housemotion_store_check (void) {
     return (long long)HouseMotionChanged * 1000;
 }
 
-int housemotion_store_status_recurse (char *buffer, int size,
-                                      char *path, int psize, const char *sep) {
+// List the recordings in the order requested, from the sorted lists that
+// are maintained as the index and the packs change.
+//
+struct housemotion_store_query {
+    char  *buffer;
+    int    size;
+    int    cursor;
+    const char *sep;
+    const char *camera;
+    time_t since;
+    int    sorted; // The order is the time order.
+    int    descending;
+    int    max;
+    int    listed;
+    time_t now;
+};
 
-    int cursor = 0;
-    time_t now = time(0);
+static int housemotion_store_listed (const HouseMotionRecording *recording,
+                                     void *context) {
+
+    struct housemotion_store_query *listing =
+        (struct housemotion_store_query *)context;
+
+    if ((listing->max > 0) && (listing->listed >= listing->max)) return 1;
+    if (recording->mtime < listing->since) {
+        // Nothing more to list when going back in time.
+        return listing->sorted && listing->descending;
+    }
+    if (listing->camera) {
+        if (!recording->camera) return 0;
+        if (strcmp (listing->camera, recording->camera)) return 0;
+    }
+    const char *type = "image/jpeg";
+    int stable = 1;
+    if (!recording->packed) {
+        const HouseMotionFile *file =
+            housemotion_index_lookup (recording->relative, 0);
+        type = (file && file->type) ? file->type : "";
+        stable = housemotion_store_stable (recording->relative,
+                                           recording->mtime, listing->now);
+    }
+    int cursor = listing->cursor;
+    cursor += snprintf (listing->buffer+cursor, listing->size-cursor,
+                        "%s[%lld,\"%s\",%lld,%s,\"%s\",\"%s\"]",
+                        listing->sep,
+                        (long long)(recording->mtime),
+                        recording->relative,
+                        recording->size,
+                        stable?"true":"false",
+                        type,
+                        recording->camera?recording->camera:"");
+    if (cursor >= listing->size - 8) return 1; // Keep what fits.
+    listing->cursor = cursor;
+    listing->sep = ",";
+    listing->listed += 1;
+    return 0;
+}
+
+static const char *housemotion_store_recordings (const char *method,
+                                                 const char *uri,
+                                                 const char *data,
+                                                 int length) {
+    static char buffer[65537];
+
+    const char *camera = echttp_parameter_get ("camera");
+    const char *sort = echttp_parameter_get ("sort");
+    const char *order = echttp_parameter_get ("order");
+    const char *count = echttp_parameter_get ("count");
+    const char *after = echttp_parameter_get ("since");
+
+    // A request whose key was truncated is never shared.
+    char buffer_key[512];
+    const char *key = buffer_key;
+    if (snprintf (buffer_key, sizeof(buffer_key),
+                  "/cctv/recordings?%s&%s&%s&%s&%s",
+                  camera?camera:"", sort?sort:"", order?order:"",
+                  count?count:"", after?after:"") >= sizeof(buffer_key))
+        key = 0;
+    const char *shared = housemotion_admit_shared (key);
+    if (shared) {
+        echttp_content_type_json ();
+        return shared;
+    }
+    if (!housemotion_admit_request ("/cctv/recordings")) return "";
+
+    housemotion_index_request ();
+
+    struct housemotion_store_query listing;
+    listing.camera = (camera && camera[0]) ? camera : 0;
+    listing.descending = (order && (!strcmp (order, "desc")));
+    listing.max = count ? atoi(count) : 0;
+    listing.since = after ? (time_t)atoll(after) : 0;
+    listing.now = time(0);
+    listing.sep = "";
+    listing.listed = 0;
+    listing.buffer = buffer;
+    listing.size = sizeof(buffer);
+    listing.cursor = snprintf (buffer, sizeof(buffer),
+                               "{\"host\":\"%s\",\"timestamp\":%lld,\"recordings\":[",
+                               HouseMotionStoreHost, (long long)(listing.now));
+
+    if (sort && (!strcmp (sort, "size"))) {
+        listing.sorted = 0;
+        housemotion_order_enumerate (HOUSEMOTION_ORDER_SIZE,
+                                     listing.descending,
+                                     listing.descending ? LLONG_MAX : 0,
+                                     housemotion_store_listed, &listing);
+    } else {
+        listing.sorted = 1;
+        housemotion_order_enumerate (HOUSEMOTION_ORDER_TIME,
+                                     listing.descending,
+                                     listing.descending ? LLONG_MAX
+                                                        : listing.since,
+                                     housemotion_store_listed, &listing);
+    }
+    snprintf (buffer+listing.cursor, sizeof(buffer)-listing.cursor, "]}");
+    echttp_content_type_json ();
+    return housemotion_admit_save (key, buffer);
+}
+
+static long long housemotion_store_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+// The catalog is written to a file, one record per line, in short
+// background slices, and then transferred: its size does not depend on
+// any memory buffer, and a large storage does not delay the Motion hooks.
+// The file is in the hidden directory of the first storage (the same as
+// the packs), since /tmp is often kept in memory. A complete catalog is
+// served again until the recordings change, or for a short while after
+// it was completed, since the recordings may change all the time.
+//
+#define MOTION_CATALOG_SLICE 50 // milliseconds.
+#define MOTION_CATALOG_FRESH 30 // seconds.
+#define MOTION_CATALOG_DIR   ".housemotion"
+
+static FILE  *HouseMotionCatalogOut = 0; // The catalog being written.
+static char   HouseMotionCatalogTemp[1024];
+static char   HouseMotionCatalogFile[1024];
+static HouseMotionOrderCursor HouseMotionCatalogCursor;
+static long long HouseMotionCatalogIndexVersion = -1;
+static long long HouseMotionCatalogPackVersion = -1;
+static long  HouseMotionCatalogSize = -1; // -1 if no complete catalog.
+static long long HouseMotionCatalogReadyIndex = -1;
+static long long HouseMotionCatalogReadyPack = -1;
+static time_t    HouseMotionCatalogReady = 0;
 
-    DIR *dir = opendir (path);
-    if (dir) {
-        int offset = strlen(path);
-        char *base = path + offset;
-        *(base++) = '/';
-        int basesize = psize - offset - 1;
-        char *relative = path + strlen(HouseMotionStorage) + 1;
-
-        struct dirent *p;
-        for (p = readdir(dir); p; p = readdir(dir)) {
-            int saved = cursor;
-            if (p->d_name[0] == '.') continue;
-            strtcpy (base, p->d_name, basesize);
-            if (p->d_type == DT_REG) {
-                struct stat filestat;
-                if (stat (path, &filestat)) continue; // Cannot access, skip.
-
-                // A file is considered stable if last update was a minute ago,
-                // or else if it matches a detected event (and has not changed
-                // since then--just to be safe).
-                //
-                int stable = (filestat.st_mtime < (now - 60));
-                if (! stable) {
-                    time_t eventtime = housemotion_store_matchevent (relative);
-                    stable = (filestat.st_mtime <= eventtime);
-                }
-
-                cursor += snprintf (buffer+cursor, size-cursor,
-                                    "%s[%lld,\"%s\",%lld,%s]",
-                                    sep,
-                                    (long long)(filestat.st_mtime),
-                                    relative,
-                                    (long long)(filestat.st_size),
-                                    stable?"true":"false");
-                if (cursor >= size) {
-                    closedir (dir);
-                    return saved;
-                }
-            } else if (p->d_type == DT_DIR) {
-                cursor += housemotion_store_status_recurse
-                             (buffer+cursor, size-cursor, path, psize, sep);
+struct housemotion_store_export {
+    FILE  *out;
+    time_t now;
+    long long deadline;
+};
+
+static int housemotion_store_line (const HouseMotionRecording *recording,
+                                   void *context) {
+
+    struct housemotion_store_export *export =
+        (struct housemotion_store_export *)context;
+
+    const char *type = "image/jpeg";
+    int stable = 1;
+    if (!recording->packed) {
+        const HouseMotionFile *file =
+            housemotion_index_lookup (recording->relative, 0);
+        type = (file && file->type) ? file->type : "";
+        stable = housemotion_store_stable (recording->relative,
+                                           recording->mtime, export->now);
+    }
+    fprintf (export->out,
+             "{\"path\":\"%s\",\"camera\":\"%s\",\"mtime\":%lld,"
+                 "\"size\":%lld,\"type\":\"%s\",\"stable\":%s}\n",
+             recording->relative,
+             recording->camera?recording->camera:"",
+             (long long)(recording->mtime), recording->size,
+             type, stable?"true":"false");
+    return housemotion_store_clock () >= export->deadline;
+}
+
+static void housemotion_store_export (void) {
+
+    if (!HouseMotionCatalogOut) return;
+
+    struct housemotion_store_export export;
+    export.out = HouseMotionCatalogOut;
+    export.now = time(0);
+    export.deadline = housemotion_store_clock () + MOTION_CATALOG_SLICE;
+    if (housemotion_order_resume (HOUSEMOTION_ORDER_TIME,
+                                  &HouseMotionCatalogCursor,
+                                  housemotion_store_line, &export)) return;
+
+    // The catalog is complete: replace the previous one. The transfers in
+    // progress keep reading the previous file.
+    //
+    fflush (HouseMotionCatalogOut);
+    long size = ftell (HouseMotionCatalogOut);
+    int failed = ferror (HouseMotionCatalogOut);
+    if (fclose (HouseMotionCatalogOut)) failed = 1;
+    HouseMotionCatalogOut = 0;
+
+    HouseMotionCatalogSize = -1;
+    if (failed || (size < 0)) {
+        houselog_trace (HOUSE_FAILURE, "CATALOG",
+                        "cannot write %s", HouseMotionCatalogTemp);
+        unlink (HouseMotionCatalogTemp);
+        return;
+    }
+    if (rename (HouseMotionCatalogTemp, HouseMotionCatalogFile)) {
+        houselog_trace (HOUSE_FAILURE, "rename(2)",
+                        "%s: %s", HouseMotionCatalogFile, strerror(errno));
+        unlink (HouseMotionCatalogTemp);
+        return;
+    }
+    HouseMotionCatalogSize = size;
+    HouseMotionCatalogReadyIndex = HouseMotionCatalogIndexVersion;
+    HouseMotionCatalogReadyPack = HouseMotionCatalogPackVersion;
+    HouseMotionCatalogReady = time(0);
+}
+
+static const char *housemotion_store_catalog (const char *method,
+                                              const char *uri,
+                                              const char *data, int length) {
+
+    if (!housemotion_admit_request ("/cctv/catalog")) return "";
+
+    housemotion_index_request ();
+
+    long long indexversion = housemotion_index_version ();
+    long long packversion = housemotion_pack_version ();
+
+    int fresh = (HouseMotionCatalogSize >= 0) &&
+                ((time(0) < HouseMotionCatalogReady + MOTION_CATALOG_FRESH) ||
+                 ((indexversion == HouseMotionCatalogReadyIndex) &&
+                  (packversion == HouseMotionCatalogReadyPack)));
+    if (!fresh) {
+
+        // Start a new catalog, unless one is already being written.
+        //
+        if (!HouseMotionCatalogOut) {
+            const char *root = HouseMotionStorage[0].path;
+            if (!root) {
+                echttp_error (500, "No storage");
+                return "";
             }
-            if (cursor > 0) sep = ",";
+            char directory[1024];
+            snprintf (directory, sizeof(directory),
+                      "%s/" MOTION_CATALOG_DIR, root);
+            mkdir (directory, 0755);
+            snprintf (HouseMotionCatalogTemp, sizeof(HouseMotionCatalogTemp),
+                      "%s/catalog.tmp", directory);
+            snprintf (HouseMotionCatalogFile, sizeof(HouseMotionCatalogFile),
+                      "%s/catalog.ndjson", directory);
+            HouseMotionCatalogOut = fopen (HouseMotionCatalogTemp, "w");
+            if (!HouseMotionCatalogOut) {
+                houselog_trace (HOUSE_FAILURE, "fopen(3)", "%s: %s",
+                                HouseMotionCatalogTemp, strerror(errno));
+                echttp_error (500, "Cannot write the catalog");
+                return "";
+            }
+            housemotion_order_start (&HouseMotionCatalogCursor);
+            HouseMotionCatalogIndexVersion = indexversion;
+            HouseMotionCatalogPackVersion = packversion;
         }
-        closedir (dir);
+        echttp_attribute_set ("Retry-After", "1");
+        echttp_error (503, "Catalog in progress");
+        return "";
     }
-    return cursor;
+
+    // echttp transfers an int size: refuse a catalog that does not fit.
+    if (HouseMotionCatalogSize > INT_MAX) {
+        houselog_trace (HOUSE_FAILURE, "CATALOG",
+                        "too large (%ld bytes)", HouseMotionCatalogSize);
+        echttp_error (500, "Catalog too large");
+        return "";
+    }
+
+    // Each transfer has its own file position.
+    int fd = open (HouseMotionCatalogFile, O_RDONLY);
+    if (fd < 0) {
+        echttp_error (500, "Catalog failed");
+        return "";
+    }
+    echttp_content_type_set ("application/x-ndjson");
+    echttp_transfer (fd, (int)HouseMotionCatalogSize);
+    return "";
 }
 
-int housemotion_store_status (char *buffer, int size) {
+void housemotion_store_initialize (int argc, const char **argv) {
 
-    int cursor = 0;
+    int i;
+    int count = 0;
+    int maxspace = 0;
+    const char *max = 0;
+    const char *critical = 0;
+    const char *reserve = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-motion-clean=", argv[i], &max)) {
+            maxspace = atoi(max);
+            if (count < MOTION_STORAGE_MAX)
+                HouseMotionStorage[count++].maxspace = maxspace;
+        }
+        echttp_option_match ("-motion-critical=", argv[i], &critical);
+        echttp_option_match ("-motion-reserve=", argv[i], &reserve);
+    }
+    if (critical) HouseMotionCritical = atoi(critical);
+    if (reserve) HouseMotionReserve = atoll(reserve) * 1024 * 1024;
+    for (i = count; i < MOTION_STORAGE_MAX; ++i) {
+        HouseMotionStorage[i].maxspace = maxspace;
+    }
+    echttp_route_uri ("/cctv/motion/event", housemotion_store_event);
+    echttp_route_uri ("/cctv/motion/event/end", housemotion_store_end);
+    echttp_route_uri ("/cctv/motion/event/start", housemotion_store_start);
+    echttp_route_match ("/cctv/recording", housemotion_store_recording);
+    echttp_route_uri ("/cctv/recordings", housemotion_store_recordings);
+    echttp_route_uri ("/cctv/catalog", housemotion_store_catalog);
+
+    gethostname (HouseMotionStoreHost, sizeof(HouseMotionStoreHost));
+}
 
-    struct statvfs storage;
+struct housemotion_store_listing {
+    char *buffer;
+    int size;
+    int cursor;
+    const char *sep;
+    time_t now;
+};
 
-    if (!HouseMotionStorage) return 0;
+static int housemotion_store_list (const char *root, const char *directory,
+                                   const HouseMotionFile *file, void *context) {
 
-    if (statvfs (HouseMotionStorage, &storage)) return 0;
+    struct housemotion_store_listing *listing =
+        (struct housemotion_store_listing *)context;
 
-    cursor += snprintf (buffer, size, "\"path\":\"%s\"", HouseMotionStorage);
-    if (cursor >= size) goto overflow;
+    char relative[1024];
+    if (directory[0])
+        snprintf (relative, sizeof(relative), "%s/%s", directory, file->name);
+    else
+        strtcpy (relative, file->name, sizeof(relative));
+
+    int stable = housemotion_store_stable (relative, file->mtime, listing->now);
+
+    int cursor = listing->cursor;
+    cursor += snprintf (listing->buffer+cursor, listing->size-cursor,
+                        "%s[%lld,\"%s\",%lld,%s,\"%s\"]",
+                        listing->sep,
+                        (long long)(file->mtime),
+                        relative,
+                        file->size,
+                        stable?"true":"false",
+                        file->type?file->type:"");
+    if (cursor >= listing->size - 8) return 1; // Keep room for the end.
+
+    listing->cursor = cursor;
+    listing->sep = ",";
+    return 0;
+}
+
+static int housemotion_store_space (char *buffer, int size,
+                                    const MotionStorage *storage) {
+
+    int cursor = 0;
+    struct statvfs fs;
+
+    if (statvfs (storage->path, &fs)) return 0;
+
+    cursor += snprintf (buffer, size, "\"path\":\"%s\"", storage->path);
+    if (cursor >= size) return cursor;
 
     char ascii[64];
     housemotion_store_friendly (ascii, sizeof(ascii),
-                                housemotion_store_free (&storage));
+                                housemotion_store_free (&fs));
     cursor += snprintf (buffer+cursor, size-cursor, ",\"available\":\"%s\"", ascii);
-    if (cursor >= size) goto overflow;
+    if (cursor >= size) return cursor;
     housemotion_store_friendly (ascii, sizeof(ascii),
-                                housemotion_store_total (&storage));
+                                housemotion_store_total (&fs));
     cursor += snprintf (buffer+cursor, size-cursor, ",\"total\":\"%s\"", ascii);
-    if (cursor >= size) goto overflow;
+    if (cursor >= size) return cursor;
     cursor += snprintf (buffer+cursor, size-cursor, ",\"used\":\"%d%%\"",
-                        housemotion_store_used (&storage));
+                        housemotion_store_used (&fs));
+    return cursor;
+}
+
+int housemotion_store_status (char *buffer, int size) {
+
+    int i;
+    int cursor = 0;
+
+    if ((!HouseMotionStorageCount) || (!HouseMotionStorage[0].path)) return 0;
+
+    // The first storage is reported at the top level, for compatibility
+    // with the clients that only know about one Motion instance.
+    //
+    cursor = housemotion_store_space (buffer, size, HouseMotionStorage);
+    if (cursor <= 0) return 0;
+    if (cursor >= size) goto overflow;
+
+    const char *prefix = "";
+    cursor += snprintf (buffer+cursor, size-cursor, ",\"storages\":[");
+    if (cursor >= size) goto overflow;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+        MotionStorage *storage = HouseMotionStorage + i;
+        if (!storage->path) continue;
+        cursor += snprintf (buffer+cursor, size-cursor, "%s{", prefix);
+        if (cursor >= size) goto overflow;
+        int length = housemotion_store_space (buffer+cursor, size-cursor, storage);
+        if (length <= 0) {
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "\"path\":\"%s\"", storage->path);
+        } else {
+            cursor += length;
+        }
+        if (cursor >= size) goto overflow;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"clean\":%d,\"emergency\":%lld}",
+                            storage->maxspace, (long long)(storage->emergency));
+        if (cursor >= size) goto overflow;
+        prefix = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
+
+    cursor += snprintf (buffer+cursor, size-cursor, ",");
+    if (cursor >= size) goto overflow;
+    cursor += housemotion_index_status (buffer+cursor, size-cursor);
+    if (cursor >= size) goto overflow;
+    cursor += snprintf (buffer+cursor, size-cursor, ",");
+    if (cursor >= size) goto overflow;
+    cursor += housemotion_order_status (buffer+cursor, size-cursor);
+    if (cursor >= size) goto overflow;
+    cursor += snprintf (buffer+cursor, size-cursor, ",");
+    if (cursor >= size) goto overflow;
+    cursor += housemotion_pack_status (buffer+cursor, size-cursor);
     if (cursor >= size) goto overflow;
 
     cursor += snprintf (buffer+cursor, size-cursor, ",\"recordings\":[");
     if (cursor >= size) goto overflow;
-    char path[1024];
-    strtcpy (path, HouseMotionStorage, sizeof(path));
-    cursor += housemotion_store_status_recurse
-                  (buffer+cursor, size-cursor, path, sizeof(path), "");
+
+    struct housemotion_store_listing listing;
+    listing.buffer = buffer + cursor;
+    listing.size = size - cursor;
+    listing.cursor = 0;
+    listing.sep = "";
+    listing.now = time(0);
+    if (!housemotion_index_enumerate (-1, housemotion_store_list, &listing))
+        housemotion_pack_enumerate (-1, housemotion_store_list, &listing);
+    cursor += listing.cursor;
+
     cursor += snprintf (buffer+cursor, size-cursor, "]");
+    if (cursor >= size) goto overflow;
 
     return cursor;
 
@@ -305,93 +961,368 @@ overflow:
     return 0;
 }
 
+// The files of an event share the same camera and event number, when
+// these can be decoded from the file names. Otherwise they share the same
+// name, minus the extension and the picture's frame number, if any.
+//
+static void housemotion_store_eventkey (const char *name,
+                                        char *key, int size) {
+    strtcpy (key, name, size);
+    char *dot = strrchr (key, '.');
+    if (dot) *dot = 0;
+    char *dash = strrchr (key, '-');
+    if (dash && dash[1] && (dash > key)) {
+        char *p = dash + 1;
+        while (isdigit(*p)) p += 1;
+        if (!*p) *dash = 0;
+    }
+}
+
+static void housemotion_store_delete_queue (const char *path) {
+
+    if (HouseMotionDeleteCount >= HouseMotionDeleteSize) {
+        HouseMotionDeleteSize += 64;
+        HouseMotionDeleteQueue =
+            realloc (HouseMotionDeleteQueue,
+                     HouseMotionDeleteSize * sizeof(char *));
+    }
+    HouseMotionDeleteQueue[HouseMotionDeleteCount++] = strdup (path);
+}
+
+// Delete up to count queued files, or until the deadline is reached.
+// There is no deadline if it is 0.
+//
+static void housemotion_store_delete_batch (int count, long long deadline) {
+
+    int last = HouseMotionDeleteNext + count;
+    if (last > HouseMotionDeleteCount) last = HouseMotionDeleteCount;
+
+    for (; HouseMotionDeleteNext < last; ++HouseMotionDeleteNext) {
+        if (deadline && (housemotion_store_clock () >= deadline)) break;
+        char *path = HouseMotionDeleteQueue[HouseMotionDeleteNext];
+        if (unlink (path) && (errno != ENOENT)) {
+            houselog_trace (HOUSE_FAILURE, "unlink(2)",
+                            "%s: %s", path, strerror(errno));
+        }
+        char *s = strrchr (path, '/');
+        if (s) {
+            *s = 0;
+            rmdir (path); // Nothing done if the directory is not empty.
+        }
+        free (path);
+    }
+    if (HouseMotionDeleteNext >= HouseMotionDeleteCount) {
+        HouseMotionDeleteNext = HouseMotionDeleteCount = 0;
+    }
+}
+
+// Motion restarts its event numbers (and names) from 1 each time it
+// starts, so the same key may designate several events: the files of the
+// same event are only searched within a short time after the previous
+// file of that event.
+//
+#define MOTION_EVENT_GAP 600
+
 struct filetrack {
+    int instance;
+    const char *root;
+    time_t now;
     time_t modified;
+    time_t last;
     char path[1024];
+    char directory[1024];
+    char event[256];
+    const char *camera;
+    int eventid;
 };
 
-void housemotion_store_oldest (struct filetrack *oldest, const char *parent) {
+static int housemotion_store_oldest (const HouseMotionRecording *recording,
+                                     void *context) {
+
+    struct filetrack *oldest = (struct filetrack *)context;
+
+    if (recording->root != oldest->instance) return 0;
+    if (recording->packed) return 0; // See housemotion_pack_oldest().
+
+    const char *name = strrchr (recording->relative, '/');
+    int length = name ? (int)(name - recording->relative) : 0;
+    name = name ? name + 1 : recording->relative;
 
     char path[1024];
-    struct dirent *p;
-    DIR *dir = opendir (parent);
-    if (!dir) return;
-
-    for (p = readdir(dir); p; p = readdir(dir)) {
-        if (p->d_name[0] == '.') continue;
-        snprintf (path, sizeof(path), "%s/%s", parent, p->d_name);
-        if (p->d_type == DT_REG) {
-            struct stat filestat;
-            if (stat (path, &filestat)) {
-                houselog_trace (HOUSE_FAILURE, "stat(2)",
-                                "%s: %s", path, strerror(errno));
-                continue; // Cannot access, skip.
-            }
-            if (filestat.st_mtime < oldest->modified) {
-                strtcpy (oldest->path, path, sizeof(oldest->path));
-                oldest->modified = filestat.st_mtime;
-            }
-        } else if (p->d_type == DT_DIR) {
-            housemotion_store_oldest (oldest, path);
-        }
+    if (snprintf (path, sizeof(path), "%s/%s",
+                  oldest->root, recording->relative) >= sizeof(path))
+        return 0;
+
+    if (!oldest->path[0]) {
+        // Search for the oldest file that is not being recorded.
+        if (recording->mtime >= oldest->now) return 1;
+        if (length >= sizeof(oldest->directory)) return 0;
+        if (housemotion_event_active (path)) return 0; // Still recording.
+        strtcpy (oldest->path, path, sizeof(oldest->path));
+        memcpy (oldest->directory, recording->relative, length);
+        oldest->directory[length] = 0;
+        housemotion_store_eventkey (name, oldest->event, sizeof(oldest->event));
+        oldest->camera = recording->camera;
+        oldest->eventid = recording->event;
+        oldest->modified = oldest->last = recording->mtime;
+        housemotion_store_delete_queue (path);
+        return 0;
+    }
+
+    // Search for the other files of the same event.
+    //
+    if (recording->mtime > oldest->last + MOTION_EVENT_GAP) return 1;
+
+    if (length != strlen (oldest->directory)) return 0;
+    if (strncmp (recording->relative, oldest->directory, length)) return 0;
+
+    if (oldest->camera && (oldest->eventid >= 0)) {
+        if (recording->camera != oldest->camera) return 0; // Interned.
+        if (recording->event != oldest->eventid) return 0;
+    } else {
+        char key[256];
+        housemotion_store_eventkey (name, key, sizeof(key));
+        if (strcmp (key, oldest->event)) return 0;
     }
-    closedir (dir);
+    housemotion_store_delete_queue (path);
+    oldest->last = recording->mtime;
+    return 0;
 }
 
-static void housemotion_store_cleanup (time_t now) {
+static int housemotion_store_cleanup (int instance, time_t now) {
 
-    // Delete the oldest file.
+    // Delete the oldest event.
     //
+    housemotion_index_request ();
+
     struct filetrack oldest;
-    oldest.modified = now + 60;
+    oldest.instance = instance;
+    oldest.root = HouseMotionStorage[instance].path;
+    oldest.now = now;
     oldest.path[0] = 0;
-    housemotion_store_oldest (&oldest, HouseMotionStorage);
-    if (oldest.modified < now) {
-        houselog_event ("SERVICE", "cctv", "DELETE", "%s", oldest.path);
-        if (unlink (oldest.path)) {
-            houselog_trace (HOUSE_FAILURE, "unlink(2)",
-                            "%s: %s", oldest.path, strerror(errno));
+    int first = HouseMotionDeleteCount;
+    housemotion_order_enumerate (HOUSEMOTION_ORDER_TIME, 0, 0,
+                                 housemotion_store_oldest, &oldest);
+
+    // The packed pictures are deleted a whole day at a time.
+    //
+    time_t packed = housemotion_pack_oldest (instance);
+    if (packed && ((!oldest.path[0]) || (packed < oldest.modified))) {
+        while (HouseMotionDeleteCount > first)
+            free (HouseMotionDeleteQueue[--HouseMotionDeleteCount]);
+        housemotion_pack_delete_oldest (instance);
+        HouseMotionStorage[instance].atrisk = packed;
+        return 1;
+    }
+    if (!oldest.path[0]) return 0;
+
+    houselog_event ("SERVICE", "cctv", "DELETE", "%s (%d files)",
+                    oldest.path, HouseMotionDeleteCount - first);
+
+    // The queued files are no longer listed, even before they are
+    // actually deleted.
+    int i;
+    for (i = first; i < HouseMotionDeleteCount; ++i) {
+        housemotion_index_remove (HouseMotionDeleteQueue[i]);
+    }
+    HouseMotionStorage[instance].atrisk = oldest.modified;
+    return 1;
+}
+
+// Motion must always have enough space to write its next recording:
+// keep room for twice the largest file seen so far.
+//
+static long long housemotion_store_reserve (void) {
+    long long reserve = 2 * HouseMotionLargestClip;
+    return (reserve > HouseMotionReserve) ? reserve : HouseMotionReserve;
+}
+
+static int housemotion_store_critical (const struct statvfs *fs) {
+    if (housemotion_store_used (fs) >= HouseMotionCritical) return 1;
+    return housemotion_store_free (fs) < housemotion_store_reserve ();
+}
+
+static int housemotion_store_safe (const MotionStorage *storage,
+                                   const struct statvfs *fs) {
+    if (housemotion_store_used (fs) >= storage->maxspace) return 0;
+    return housemotion_store_free (fs) >= 2 * housemotion_store_reserve ();
+}
+
+static void housemotion_store_pressure (time_t now) {
+
+    int i;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+
+        MotionStorage *storage = HouseMotionStorage + i;
+        if (!storage->path) continue;
+        if (storage->maxspace <= 0) continue;
+        if (storage->emergency) continue;
+
+        struct statvfs fs;
+        if (statvfs (storage->path, &fs)) continue;
+
+        if (housemotion_store_critical (&fs)) {
+            storage->emergency = now;
+            HouseMotionChanged = now;
+            houselog_event ("SERVICE", "cctv", "EMERGENCY",
+                            "storage %s is %d%% full", storage->path,
+                            housemotion_store_used (&fs));
         }
-        char *s = strrchr (oldest.path, '/');
-        if (s) {
-            *s = 0;
-            rmdir (oldest.path); // Nothing done if the directory is not empty.
+    }
+}
+
+// Queue the oldest events of each storage in emergency mode, a batch of
+// files at a time. This is called only once all the previously queued
+// files have been deleted, so that the space is checked after each batch.
+// A pack is deleted immediately, so the space is checked again after it.
+// Return 1 if something was deleted or queued, 0 otherwise.
+//
+static int housemotion_store_rescue (time_t now) {
+
+    int i;
+    int progress = 0;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+
+        MotionStorage *storage = HouseMotionStorage + i;
+        if (!storage->emergency) continue;
+
+        struct statvfs fs;
+        if (statvfs (storage->path, &fs)) continue;
+        if (housemotion_store_safe (storage, &fs)) {
+            storage->emergency = 0;
+            HouseMotionChanged = now;
+            houselog_event ("SERVICE", "cctv", "NORMAL",
+                            "storage %s is %d%% full", storage->path,
+                            housemotion_store_used (&fs));
+            continue;
+        }
+        while (HouseMotionDeleteCount < MOTION_EMERGENCY_BATCH) {
+            int queued = HouseMotionDeleteCount;
+            if (!housemotion_store_cleanup (i, now)) break;
+            progress = 1;
+            if (HouseMotionDeleteCount == queued) break; // A pack was deleted.
         }
     }
+    return progress;
+}
+
+int housemotion_store_emergency (char *buffer, int size) {
+
+    int i;
+    time_t since = 0;
+    time_t atrisk = 0;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+        MotionStorage *storage = HouseMotionStorage + i;
+        if (!storage->emergency) continue;
+        if ((!since) || (storage->emergency < since)) since = storage->emergency;
+        if (storage->atrisk > atrisk) atrisk = storage->atrisk;
+    }
+    if (!since) return 0;
+
+    int cursor = snprintf (buffer, size,
+                           "\"emergency\":{\"since\":%lld,\"atrisk\":%lld}",
+                           (long long)since, (long long)atrisk);
+    if (cursor >= size) {
+        houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+        buffer[0] = 0;
+        return 0;
+    }
+    return cursor;
 }
 
-static void housemotion_store_monitor (time_t now) {
+// Return 1 if a cleanup is in progress, 0 otherwise.
+//
+static int housemotion_store_monitor (time_t now) {
+
+    int i;
+    int cleaning = 0;
+
+    // Wait until the previous event has been deleted before checking
+    // the storage space again.
+    if (HouseMotionDeleteCount > 0) return 1;
+
+    // Wait until all the recordings are known, so that the oldest event
+    // can be found. The emergency mode does not wait.
+    if (!housemotion_index_ready ()) return 0;
+
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
 
-    if (!HouseMotionStorage) return;
+        MotionStorage *storage = HouseMotionStorage + i;
+        if (!storage->path) continue;
+        if (storage->maxspace <= 0) continue;
+        if (storage->emergency) continue;
 
-    struct statvfs storage;
-    if (statvfs (HouseMotionStorage, &storage)) return ;
+        struct statvfs fs;
+        if (statvfs (storage->path, &fs)) continue;
 
-    if ((HouseMotionMaxSpace > 0) &&
-        (housemotion_store_used (&storage) >= HouseMotionMaxSpace)) {
-        housemotion_store_cleanup (now);
+        if (housemotion_store_used (&fs) >= storage->maxspace) {
+            cleaning |= housemotion_store_cleanup (i, now);
+        }
     }
+    return cleaning;
 }
 
-void housemotion_store_location (const char *directory) {
+void housemotion_store_location (int instance, const char *directory) {
+
+    if ((instance < 0) || (instance >= MOTION_STORAGE_MAX)) return;
 
-    char *existing = HouseMotionStorage;
+    MotionStorage *storage = HouseMotionStorage + instance;
+    char *existing = storage->path;
     if (existing && (!strcmp(existing, directory))) return; // No change.
 
-    HouseMotionStorage = strdup (directory);
-    echttp_static_route ("/cctv/recording", HouseMotionStorage);
+    storage->path = strdup (directory);
+    housemotion_index_location (instance, storage->path);
+    housemotion_pack_location (instance, storage->path);
     if (existing) free (existing);
+    if (instance >= HouseMotionStorageCount)
+        HouseMotionStorageCount = instance + 1;
 
     HouseMotionChanged = time(0);
 }
 
+void housemotion_store_refresh (void) {
+
+    housemotion_store_export ();
+
+    int i;
+    for (i = 0; i < HouseMotionStorageCount; ++i) {
+        if (HouseMotionStorage[i].emergency) break;
+    }
+    if (i >= HouseMotionStorageCount) return; // No emergency.
+
+    // Ignore the usual batch limit, and delete as many events as needed
+    // to restore a safe margin.
+    //
+    long long deadline = housemotion_store_clock () + MOTION_EMERGENCY_SLICE;
+    while (housemotion_store_clock () < deadline) {
+        if (HouseMotionDeleteCount == 0) {
+            if (!housemotion_store_rescue (time(0))) break;
+            continue;
+        }
+        housemotion_store_delete_batch (HouseMotionDeleteCount, deadline);
+    }
+}
+
 void housemotion_store_background (time_t now) {
 
     static time_t Nextcheck = 0;
+    static int Cleaning = 0;
+
+    housemotion_index_background (now);
+    housemotion_latency_background (now);
+    if (HouseMotionDeleteCount > 0)
+        housemotion_store_delete_batch (MOTION_DELETE_BATCH, 0);
+    housemotion_store_pressure (now);
+
+    // The storage is checked every 10 seconds, and then every second
+    // until the cleanup has brought it back below its limit.
+    //
+    if (Cleaning || (now > Nextcheck))
+        Cleaning = housemotion_store_monitor (now);
 
     if (now <= Nextcheck) return;
     Nextcheck = now + 10;
 
-    housemotion_store_monitor (now);
+    housemotion_pack_background (now);
 }
 
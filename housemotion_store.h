@@ -21,9 +21,14 @@
  * housemotion_store.h - Access the videos and image files stored by Motion.
  */
 void housemotion_store_initialize (int argc, const char **argv);
-void housemotion_store_location (const char *directory);
+void housemotion_store_location (int instance, const char *directory);
+
+int  housemotion_store_open (const char *relative, long long *size,
+                             time_t *mtime, const char **type);
 
 long long housemotion_store_check (void);
+void housemotion_store_refresh (void);
 void housemotion_store_background (time_t now);
 int  housemotion_store_status (char *buffer, int size);
+int  housemotion_store_emergency (char *buffer, int size);
 
@@ -0,0 +1,350 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_watchdog.c - Detect and diagnose stalls of the main loop.
+ *
+ * SYNOPSYS:
+ *
+ * HouseMotion is single threaded: a long cleanup, a slow disk or a large
+ * listing delays every other request, and a user only sees that "the
+ * camera service hung". This module measures how long each step of the
+ * main loop (an HTTP request or a background step) runs, and records the
+ * steps that ran longer than the configured limit (--motion-stall).
+ *
+ * A separate thread monitors the main loop. When a step runs past the
+ * limit, this thread sends a signal to the main thread, which captures
+ * a backtrace of where it is stuck. The backtrace is decoded and stored
+ * when the step completes, only the longest stalls are kept.
+ *
+ * This module also sends the systemd notifications (READY, and the
+ * watchdog pings when WatchdogSec is set in the service unit), from the
+ * main loop: if the loop is stuck, systemd will restart the service.
+ *
+ * void housemotion_watchdog_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module and start the monitoring thread.
+ *
+ * void housemotion_watchdog_step (const char *name);
+ *
+ *    Declare the start of a new step of the main loop. This ends the
+ *    previous step, if any.
+ *
+ * void housemotion_watchdog_idle (void);
+ *
+ *    Declare that the main loop is about to wait for I/O.
+ *
+ * void housemotion_watchdog_background (time_t now);
+ *
+ *    Send the systemd watchdog ping when needed.
+ *
+ * int housemotion_watchdog_status (char *buffer, int size);
+ *
+ *    Populate a JSON object with the stall statistics.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <echttp.h>
+#include <echttp_libc.h>
+
+#include "houselog.h"
+#include "housemotion_watchdog.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define MOTION_STALL_WORST  5
+#define MOTION_STALL_FRAMES 16
+#define MOTION_STALL_SKIP   2 // The signal handler and the signal frame.
+
+typedef struct {
+    char   step[128];
+    time_t start;
+    int    duration; // Milliseconds.
+    int    depth;
+    char  *frames[MOTION_STALL_FRAMES];
+} MotionStall;
+
+static int HouseMotionStallLimit = 200; // Milliseconds, 0: disabled.
+
+static MotionStall HouseMotionStallWorst[MOTION_STALL_WORST];
+static int HouseMotionStallWorstCount = 0;
+static long long HouseMotionStallCount = 0;
+static int HouseMotionStallLongest = 0;
+
+// The state shared between the main thread and the monitoring thread.
+// The step start is 0 when the main loop is idle.
+//
+static pthread_t HouseMotionMainThread;
+static long long HouseMotionStepStart = 0;
+static long long HouseMotionStepSignaled = 0;
+
+static char HouseMotionStepName[128];
+
+// These are only accessed by the main thread, including its signal handler.
+static void *HouseMotionStallFrames[MOTION_STALL_FRAMES+MOTION_STALL_SKIP];
+static volatile sig_atomic_t HouseMotionStallDepth = 0;
+
+static int HouseMotionNotifyPeriod = 0; // Seconds, 0: no systemd watchdog.
+
+static long long housemotion_watchdog_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static void housemotion_watchdog_notify (const char *message) {
+
+    const char *path = getenv ("NOTIFY_SOCKET");
+    if ((!path) || (!path[0])) return;
+
+    struct sockaddr_un address;
+    memset (&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return;
+    strncpy (address.sun_path, path, sizeof(address.sun_path)-1);
+    if (address.sun_path[0] == '@') address.sun_path[0] = 0; // Abstract.
+
+    int s = socket (AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if (s < 0) return;
+    socklen_t length = sizeof(sa_family_t) + strlen(path);
+    if (sendto (s, message, strlen(message), 0,
+                (struct sockaddr *)&address, length) < 0) {
+        DEBUG ("systemd notify failed\n");
+    }
+    close (s);
+}
+
+static void housemotion_watchdog_capture (int sig) {
+    HouseMotionStallDepth =
+        backtrace (HouseMotionStallFrames,
+                   MOTION_STALL_FRAMES+MOTION_STALL_SKIP);
+}
+
+static void *housemotion_watchdog_monitor (void *context) {
+
+    int period = HouseMotionStallLimit / 4;
+    if (period < 10) period = 10;
+
+    for (;;) {
+        usleep (period * 1000);
+
+        long long start = __atomic_load_n (&HouseMotionStepStart,
+                                           __ATOMIC_ACQUIRE);
+        if (!start) continue;
+        if (start == __atomic_load_n (&HouseMotionStepSignaled,
+                                      __ATOMIC_ACQUIRE)) continue;
+        if (housemotion_watchdog_clock() - start < HouseMotionStallLimit)
+            continue;
+
+        __atomic_store_n (&HouseMotionStepSignaled, start, __ATOMIC_RELEASE);
+        pthread_kill (HouseMotionMainThread, SIGUSR2);
+    }
+    return 0;
+}
+
+static void housemotion_watchdog_record (long long start, int duration) {
+
+    int i;
+    MotionStall *stall;
+
+    HouseMotionStallCount += 1;
+    if (duration > HouseMotionStallLongest) HouseMotionStallLongest = duration;
+
+    houselog_trace (HOUSE_INFO, "STALL", "%s ran for %d ms",
+                    HouseMotionStepName, duration);
+
+    // Keep the list sorted, longest stall first.
+    if (HouseMotionStallWorstCount < MOTION_STALL_WORST) {
+        stall = HouseMotionStallWorst + HouseMotionStallWorstCount++;
+    } else {
+        stall = HouseMotionStallWorst + MOTION_STALL_WORST - 1;
+        if (stall->duration >= duration) return;
+        for (i = 0; i < stall->depth; ++i) free (stall->frames[i]);
+    }
+    snprintf (stall->step, sizeof(stall->step), "%s", HouseMotionStepName);
+    stall->start = time(0) - (duration / 1000);
+    stall->duration = duration;
+    stall->depth = 0;
+
+    // The backtrace is only valid if it was captured during this step.
+    //
+    int depth = HouseMotionStallDepth;
+    if ((__atomic_load_n (&HouseMotionStepSignaled, __ATOMIC_ACQUIRE) == start)
+        && (depth > MOTION_STALL_SKIP)) {
+        char **symbols =
+            backtrace_symbols (HouseMotionStallFrames+MOTION_STALL_SKIP,
+                               depth - MOTION_STALL_SKIP);
+        if (symbols) {
+            for (i = 0; i < depth - MOTION_STALL_SKIP; ++i) {
+                stall->frames[i] = strdup (symbols[i]);
+            }
+            stall->depth = depth - MOTION_STALL_SKIP;
+            free (symbols);
+        }
+    }
+
+    while (stall > HouseMotionStallWorst && stall[-1].duration < duration) {
+        MotionStall swap = stall[-1];
+        stall[-1] = stall[0];
+        stall[0] = swap;
+        stall -= 1;
+    }
+}
+
+static void housemotion_watchdog_end (long long now) {
+
+    long long start = HouseMotionStepStart;
+    if (!start) return;
+
+    int duration = (int)(now - start);
+    if (duration >= HouseMotionStallLimit)
+        housemotion_watchdog_record (start, duration);
+}
+
+void housemotion_watchdog_step (const char *name) {
+
+    if (!HouseMotionStallLimit) return;
+
+    long long now = housemotion_watchdog_clock();
+    housemotion_watchdog_end (now);
+
+    // Keep only what is safe to report in JSON.
+    int i, j;
+    for (i = j = 0; name[i] && j < (int)sizeof(HouseMotionStepName)-1; ++i) {
+        char c = name[i];
+        if (c == '?') break;
+        if ((c < ' ') || (c == '"') || (c == '\\')) continue;
+        HouseMotionStepName[j++] = c;
+    }
+    HouseMotionStepName[j] = 0;
+
+    HouseMotionStallDepth = 0;
+    __atomic_store_n (&HouseMotionStepStart, now, __ATOMIC_RELEASE);
+}
+
+void housemotion_watchdog_idle (void) {
+
+    if (!HouseMotionStallLimit) return;
+
+    housemotion_watchdog_end (housemotion_watchdog_clock());
+    __atomic_store_n (&HouseMotionStepStart, 0, __ATOMIC_RELEASE);
+}
+
+void housemotion_watchdog_background (time_t now) {
+
+    static time_t LastPing = 0;
+
+    if (!HouseMotionNotifyPeriod) return;
+    if (now < LastPing + HouseMotionNotifyPeriod) return;
+    LastPing = now;
+    housemotion_watchdog_notify ("WATCHDOG=1");
+}
+
+int housemotion_watchdog_status (char *buffer, int size) {
+
+    int i, j;
+    const char *sep = "";
+
+    int cursor = snprintf (buffer, size,
+                           "\"watchdog\":{\"limit\":%d,\"systemd\":%d,"
+                               "\"stalls\":%lld,\"longest\":%d,\"worst\":[",
+                           HouseMotionStallLimit, HouseMotionNotifyPeriod,
+                           HouseMotionStallCount, HouseMotionStallLongest);
+    if (cursor >= size) goto overflow;
+
+    for (i = 0; i < HouseMotionStallWorstCount; ++i) {
+        MotionStall *stall = HouseMotionStallWorst + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s{\"step\":\"%s\",\"start\":%lld,"
+                                "\"duration\":%d,\"backtrace\":[",
+                            sep, stall->step, (long long)stall->start,
+                            stall->duration);
+        if (cursor >= size) goto overflow;
+        const char *fsep = "";
+        for (j = 0; j < stall->depth; ++j) {
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "%s\"%s\"", fsep, stall->frames[j]);
+            if (cursor >= size) goto overflow;
+            fsep = ",";
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "]}");
+        if (cursor >= size) goto overflow;
+        sep = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]}");
+    if (cursor >= size) goto overflow;
+    return cursor;
+
+overflow:
+    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
+    buffer[0] = 0;
+    return 0;
+}
+
+void housemotion_watchdog_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *limit = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-motion-stall=", argv[i], &limit);
+    }
+    if (limit) HouseMotionStallLimit = atoi (limit);
+    if (HouseMotionStallLimit < 0) HouseMotionStallLimit = 0;
+
+    // Ping systemd twice per watchdog period.
+    const char *usec = getenv ("WATCHDOG_USEC");
+    if (usec) {
+        HouseMotionNotifyPeriod = (int)(atoll (usec) / 2000000);
+        if (HouseMotionNotifyPeriod < 1) HouseMotionNotifyPeriod = 1;
+    }
+    housemotion_watchdog_notify ("READY=1");
+
+    if (!HouseMotionStallLimit) return;
+
+    // The first backtrace() call may load a library: not in a signal.
+    backtrace (HouseMotionStallFrames, 1);
+
+    struct sigaction action;
+    memset (&action, 0, sizeof(action));
+    action.sa_handler = housemotion_watchdog_capture;
+    action.sa_flags = SA_RESTART;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGUSR2, &action, 0);
+
+    HouseMotionMainThread = pthread_self();
+    pthread_t monitor;
+    if (pthread_create (&monitor, 0, housemotion_watchdog_monitor, 0)) {
+        houselog_trace (HOUSE_FAILURE, "WATCHDOG", "cannot start thread");
+        HouseMotionStallLimit = 0;
+        return;
+    }
+    pthread_detach (monitor);
+}
@@ -0,0 +1,30 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_watchdog.h - Detect and diagnose stalls of the main loop.
+ */
+void housemotion_watchdog_initialize (int argc, const char **argv);
+
+void housemotion_watchdog_step (const char *name);
+void housemotion_watchdog_idle (void);
+
+void housemotion_watchdog_background (time_t now);
+int  housemotion_watchdog_status (char *buffer, int size);
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Check the aggregator mode against local stand-in peers.
+#
+# Usage: aggregate.sh [PEERS]
+#
+# This starts PEERS test instances (default: 3), each on its own port and
+# with its own synthetic storage (see mkstore.sh), and one aggregator
+# instance that lists these peers explicitly. The test passes if the
+# aggregator reports as many recordings as all peers together.
+#
+cd `dirname $0`
+peers=${1:-3}
+port=${PORT:-8100}
+root=${ROOT:-/tmp/housemotion-aggregate}
+
+rm -rf $root
+pids=
+urls=
+for i in `seq 1 $peers` ; do
+   mkdir -p $root/peer$i
+   ./mkstore.sh $root/peer$i/store ${DAYS:-2} ${FILES:-100} ${CAMERAS:-2}
+   echo "target_dir $root/peer$i/store" > $root/peer$i/motion.conf
+   ../housemotion --http-service=$((port + i)) --motion-conf=$root/peer$i/motion.conf &
+   pids="$pids $!"
+   if [ "x$urls" = "x" ] ; then sep= ; else sep=, ; fi
+   urls="$urls${sep}http://localhost:$((port + i))/cctv"
+done
+
+mkdir -p $root/aggregator/store
+echo "target_dir $root/aggregator/store" > $root/aggregator/motion.conf
+../housemotion --http-service=$port --motion-conf=$root/aggregator/motion.conf --motion-peers=$urls &
+pids="$pids $!"
+
+# Let the peers scan their storage, and the aggregator synchronize.
+sleep ${WAIT:-15}
+
+expected=0
+for i in `seq 1 $peers` ; do
+   count=`curl -s http://localhost:$((port + i))/cctv/catalog | wc -l`
+   expected=$((expected + count))
+done
+actual=`curl -s http://localhost:$port/cctv/status | grep -o '"aggregate":{"peers":[0-9]*,"recordings":[0-9]*}' | sed 's/.*"recordings"://; s/}//'`
+curl -s "http://localhost:$port/cctv/aggregate?order=desc&count=5"
+echo
+
+kill $pids
+wait 2> /dev/null
+
+echo "Peers: $expected recordings, aggregator: ${actual:-0} recordings"
+if [ "x$actual" != "x$expected" ] ; then exit 1 ; fi
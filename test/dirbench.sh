@@ -0,0 +1,17 @@
+#!/bin/bash
+# Compare readdir(3) with the getdents64(2) primitive on a synthetic store.
+#
+# Usage: dirbench.sh [housemotion_dirbench options]
+#
+# The synthetic storage (see mkstore.sh) defaults to a few large day
+# directories, similar to Motion saving a picture on every detection.
+# Its size can be adjusted using the DAYS, FILES and CAMERAS environment
+# variables.
+#
+cd `dirname $0`
+root=${ROOT:-/tmp/housemotion-dirbench}
+if [ ! -x ./housemotion_dirbench ] ; then make -C .. tools || exit 1 ; fi
+if [ ! -d $root/store ] ; then
+   ./mkstore.sh $root/store ${DAYS:-3} ${FILES:-20000} ${CAMERAS:-4}
+fi
+./housemotion_dirbench --root=$root/store "$@"
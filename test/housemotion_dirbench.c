@@ -0,0 +1,152 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_dirbench.c - Compare the directory reading methods.
+ *
+ * SYNOPSYS:
+ *
+ * housemotion_dirbench --root=DIRECTORY [--loops=INTEGER]
+ *
+ * This program walks the specified directory tree (typically a synthetic
+ * storage created by mkstore.sh) repeatedly, first using readdir(3), then
+ * using the getdents64(2) based primitive used by HouseMotion. It reports
+ * the number of entries found and the average time per walk for each
+ * method. Both methods walk a warm cache: this measures the CPU and
+ * system call cost, not the disk.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "../housemotion_dirent.h"
+
+static const char *DirbenchRoot = 0;
+static int DirbenchLoops = 10;
+
+static int dirbench_option (const char *name, const char *arg,
+                            const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, "--", 2)) return 0;
+    if (strncmp (arg+2, name, length)) return 0;
+    *value = arg + 2 + length;
+    return 1;
+}
+
+static double dirbench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+static long dirbench_readdir (const char *path) {
+
+    long count = 0;
+    DIR *handle = opendir (path);
+    if (!handle) return 0;
+
+    struct dirent *p;
+    for (p = readdir(handle); p; p = readdir(handle)) {
+        if (p->d_name[0] == '.') continue;
+        if (p->d_type == DT_REG) {
+            count += 1;
+        } else if (p->d_type == DT_DIR) {
+            char sub[1024];
+            snprintf (sub, sizeof(sub), "%s/%s", path, p->d_name);
+            count += 1 + dirbench_readdir (sub);
+        }
+    }
+    closedir (handle);
+    return count;
+}
+
+struct dirbench_context {
+    const char *path;
+    char **subdirs;
+    int subcount;
+    long count;
+};
+
+static int dirbench_entry (const char *name, int type, void *context) {
+
+    struct dirbench_context *walk = (struct dirbench_context *)context;
+    walk->count += 1;
+    if (type == HOUSEMOTION_DIRENT_DIR) {
+        walk->subdirs =
+            realloc (walk->subdirs, (walk->subcount + 1) * sizeof(char *));
+        walk->subdirs[walk->subcount++] = strdup (name);
+    }
+    return 0;
+}
+
+// The buffer is shared: the subdirectories are walked after the scan,
+// as HouseMotion does.
+//
+static long dirbench_getdents (const char *path) {
+
+    int i;
+    struct dirbench_context walk = {path, 0, 0, 0};
+    housemotion_dirent_scan (path, dirbench_entry, &walk);
+    for (i = 0; i < walk.subcount; ++i) {
+        char sub[1024];
+        snprintf (sub, sizeof(sub), "%s/%s", path, walk.subdirs[i]);
+        walk.count += dirbench_getdents (sub);
+        free (walk.subdirs[i]);
+    }
+    free (walk.subdirs);
+    return walk.count;
+}
+
+static void dirbench_run (const char *name, long (*walk) (const char *)) {
+
+    int i;
+    long count = 0;
+    walk (DirbenchRoot); // Warm up the cache.
+    double start = dirbench_now ();
+    for (i = 0; i < DirbenchLoops; ++i) count = walk (DirbenchRoot);
+    double elapsed = dirbench_now () - start;
+    printf ("%-10s %8ld entries %10.3f ms per walk\n",
+            name, count, (elapsed * 1000) / DirbenchLoops);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (dirbench_option ("root=", argv[i], &DirbenchRoot)) continue;
+        if (dirbench_option ("loops=", argv[i], &value)) {
+            DirbenchLoops = atoi (value);
+        }
+    }
+    if (!DirbenchRoot) {
+        fprintf (stderr, "missing --root option\n");
+        return 2;
+    }
+    if (DirbenchLoops < 1) DirbenchLoops = 1;
+
+    dirbench_run ("readdir", dirbench_readdir);
+    dirbench_run ("getdents", dirbench_getdents);
+    return 0;
+}
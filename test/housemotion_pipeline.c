@@ -0,0 +1,393 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_pipeline.c - An end-to-end benchmark of the recording pipeline.
+ *
+ * SYNOPSYS:
+ *
+ * housemotion_pipeline --root=DIRECTORY [--host=NAME] [--port=INTEGER]
+ *                      [--cameras=INTEGER] [--duration=SECONDS]
+ *                      [--interval=SECONDS] [--pictures=INTEGER]
+ *                      [--movie=KB] [--hooks=yes|no] [--poll=MS]
+ *                      [--drain=SECONDS]
+ *
+ * This program simulates both sides of HouseMotion:
+ *
+ * - A Motion writer: each simulated camera periodically records an event
+ *   in the target directory (root option): a movie file is appended to
+ *   during the event, and pictures are written while the movie is being
+ *   recorded. When hooks are enabled, the same notifications as Motion's
+ *   on_event_start, on_picture_save, on_movie_end and on_event_end are
+ *   sent to HouseMotion.
+ *
+ * - A DVR client: it polls the HouseMotion status and downloads every
+ *   recording as soon as it is reported stable.
+ *
+ * The benchmark reports the latency from a file being closed by the
+ * writer to its download being complete, and the download throughput.
+ * Without hooks, HouseMotion relies on its 60 seconds heuristic.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "housemotion_testhttp.h"
+
+static const char *PipelineRoot = 0;
+static const char *PipelineHost = "localhost";
+static const char *PipelinePort = "8099";
+static int         PipelineCameras = 1;
+static int         PipelineDuration = 30;
+static int         PipelineInterval = 10;
+static int         PipelinePictures = 3;
+static int         PipelineMovie = 512;
+static int         PipelineHooks = 1;
+static int         PipelinePoll = 1000;
+static int         PipelineDrain = 90;
+
+static char PipelineHostName[256];
+
+typedef struct {
+    char      path[640]; // Relative to the root.
+    double    closed;
+    double    downloaded;
+    long long size;
+} PipelineFile;
+
+static PipelineFile   *PipelineFiles = 0;
+static int             PipelineFilesCount = 0;
+static int             PipelineFilesSize = 0;
+static int             PipelineWriting = 0;
+static pthread_mutex_t PipelineLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pipeline_option (const char *name, const char *arg,
+                            const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, "--", 2)) return 0;
+    if (strncmp (arg+2, name, length)) return 0;
+    *value = arg + 2 + length;
+    return 1;
+}
+
+static void pipeline_encode (char *buffer, int size, const char *value) {
+    int cursor = 0;
+    for (; *value && (cursor < size - 4); ++value) {
+        unsigned char c = (unsigned char)(*value);
+        if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+            ((c >= '0') && (c <= '9')) || strchr ("/:._-", c)) {
+            buffer[cursor++] = c;
+        } else {
+            cursor += snprintf (buffer+cursor, size-cursor, "%%%02X", c);
+        }
+    }
+    buffer[cursor] = 0;
+}
+
+static void pipeline_hook (const char *format, const char *value,
+                           const char *camera) {
+    if (!PipelineHooks) return;
+
+    char encoded[1024];
+    char uri[2048];
+    pipeline_encode (encoded, sizeof(encoded), value);
+    snprintf (uri, sizeof(uri), format, encoded, camera);
+    housemotion_testhttp (PipelineHost, PipelinePort, "GET", uri, 0, 0, 0);
+}
+
+static void pipeline_closed (const char *relative, long long size) {
+
+    pthread_mutex_lock (&PipelineLock);
+    if (PipelineFilesCount >= PipelineFilesSize) {
+        PipelineFilesSize += 256;
+        PipelineFiles = realloc (PipelineFiles,
+                                 PipelineFilesSize * sizeof(PipelineFile));
+    }
+    PipelineFile *file = PipelineFiles + (PipelineFilesCount++);
+    snprintf (file->path, sizeof(file->path), "%s", relative);
+    file->closed = housemotion_testhttp_now ();
+    file->downloaded = 0;
+    file->size = size;
+    pthread_mutex_unlock (&PipelineLock);
+}
+
+static void pipeline_write (int fd, int size) {
+    static char data[4096];
+    while (size > 0) {
+        int n = (size > sizeof(data)) ? sizeof(data) : size;
+        if (write (fd, data, n) != n) return;
+        size -= n;
+    }
+}
+
+// Simulate one Motion event: a movie is appended to during the event,
+// with pictures written in between.
+//
+static void pipeline_event (const char *camera, int sequence) {
+
+    char event[512];
+    char path[1024];
+    char relative[640];
+    char fullpath[1024];
+    time_t now = time(0);
+    struct tm local = *localtime (&now);
+
+    snprintf (path, sizeof(path), "%s/%04d/%02d/%02d", PipelineRoot,
+              local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    char *sep;
+    for (sep = strchr (path + strlen(PipelineRoot) + 1, '/'); sep;
+         sep = strchr (sep + 1, '/')) {
+        *sep = 0;
+        mkdir (path, 0755);
+        *sep = '/';
+    }
+    mkdir (path, 0755);
+
+    snprintf (event, sizeof(event), "%04d/%02d/%02d/%02d:%02d:%02d-%s:%s:%d",
+              local.tm_year + 1900, local.tm_mon + 1, local.tm_mday,
+              local.tm_hour, local.tm_min, local.tm_sec,
+              PipelineHostName, camera, sequence);
+    pipeline_hook ("/cctv/motion/event/start?event=%s&camera=%s", event, camera);
+
+    snprintf (relative, sizeof(relative), "%s.mkv", event);
+    snprintf (fullpath, sizeof(fullpath), "%s/%s", PipelineRoot, relative);
+    int movie = open (fullpath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (movie < 0) return;
+
+    int chunks = PipelinePictures + 1;
+    int i;
+    for (i = 0; i < chunks; ++i) {
+        pipeline_write (movie, (PipelineMovie * 1024) / chunks);
+        usleep (200000);
+        if (i >= PipelinePictures) break;
+
+        char picture[640];
+        char picturepath[1024];
+        snprintf (picture, sizeof(picture), "%s-%02d.jpg", event, i);
+        snprintf (picturepath, sizeof(picturepath), "%s/%s", PipelineRoot, picture);
+        int fd = open (picturepath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) continue;
+        pipeline_write (fd, 2048);
+        pipeline_write (fd, 30 * 1024);
+        close (fd);
+        pipeline_closed (picture, 32 * 1024);
+        pipeline_hook ("/cctv/motion/event?file=%s&camera=%s", picturepath, camera);
+    }
+    close (movie);
+    pipeline_closed (relative, ((PipelineMovie * 1024) / chunks) * chunks);
+    pipeline_hook ("/cctv/motion/event?file=%s&camera=%s", fullpath, camera);
+    pipeline_hook ("/cctv/motion/event/end?event=%s&camera=%s", event, camera);
+}
+
+static void *pipeline_camera (void *context) {
+
+    long id = (long)context;
+    char camera[16];
+    snprintf (camera, sizeof(camera), "%ld", id);
+
+    double end = housemotion_testhttp_now () + PipelineDuration;
+    int sequence = 1;
+
+    // Spread the events of the different cameras over time.
+    usleep ((useconds_t)((id * PipelineInterval * 1000000LL) / PipelineCameras));
+
+    while (housemotion_testhttp_now () < end) {
+        double start = housemotion_testhttp_now ();
+        pipeline_event (camera, sequence++);
+        double delay = start + PipelineInterval - housemotion_testhttp_now ();
+        if (delay > 0) usleep ((useconds_t)(delay * 1000000));
+    }
+    pthread_mutex_lock (&PipelineLock);
+    PipelineWriting -= 1;
+    pthread_mutex_unlock (&PipelineLock);
+    return 0;
+}
+
+static PipelineFile *pipeline_search (const char *relative) {
+    int i;
+    for (i = 0; i < PipelineFilesCount; ++i) {
+        if (!strcmp (PipelineFiles[i].path, relative)) return PipelineFiles + i;
+    }
+    return 0;
+}
+
+// Download every file listed as stable and not yet downloaded.
+// Return the number of files still waiting to be downloaded.
+//
+static int pipeline_poll (char *status, int size) {
+
+    if (housemotion_testhttp (PipelineHost, PipelinePort, "GET",
+                              "/cctv/status", status, size, 0) != 200)
+        return -1;
+
+    char *cursor = strstr (status, "\"recordings\":[");
+    if (!cursor) return -1;
+    cursor += 14;
+
+    while (*cursor == '[') {
+        long long mtime, size;
+        char path[512];
+        char stable[8];
+        if (sscanf (cursor, "[%lld,\"%511[^\"]\",%lld,%7[a-z]",
+                    &mtime, path, &size, stable) == 4) {
+            if (!strcmp (stable, "true")) {
+                pthread_mutex_lock (&PipelineLock);
+                PipelineFile *file = pipeline_search (path);
+                int needed = file && (file->downloaded == 0);
+                pthread_mutex_unlock (&PipelineLock);
+
+                if (needed) {
+                    char uri[1024];
+                    long long length;
+                    snprintf (uri, sizeof(uri), "/cctv/recording/%s", path);
+                    int code = housemotion_testhttp (PipelineHost, PipelinePort,
+                                                     "GET", uri, 0, 0, &length);
+                    if (code == 200) {
+                        // The table may have been moved in the meantime.
+                        pthread_mutex_lock (&PipelineLock);
+                        file = pipeline_search (path);
+                        file->downloaded = housemotion_testhttp_now ();
+                        file->size = length;
+                        pthread_mutex_unlock (&PipelineLock);
+                    }
+                }
+            }
+        }
+        cursor = strchr (cursor, ']');
+        if (!cursor) break;
+        cursor += 1;
+        if (*cursor == ',') cursor += 1;
+    }
+
+    int i, waiting = 0;
+    pthread_mutex_lock (&PipelineLock);
+    for (i = 0; i < PipelineFilesCount; ++i) {
+        if (PipelineFiles[i].downloaded == 0) waiting += 1;
+    }
+    pthread_mutex_unlock (&PipelineLock);
+    return waiting;
+}
+
+static int pipeline_compare (const void *a, const void *b) {
+    double delta = *((const double *)a) - *((const double *)b);
+    if (delta < 0) return -1;
+    return delta > 0;
+}
+
+static void pipeline_report (void) {
+
+    int i;
+    int count = 0;
+    long long bytes = 0;
+    double first = 0, last = 0;
+    double *latencies = calloc (PipelineFilesCount + 1, sizeof(double));
+
+    for (i = 0; i < PipelineFilesCount; ++i) {
+        PipelineFile *file = PipelineFiles + i;
+        if ((first == 0) || (file->closed < first)) first = file->closed;
+        if (file->downloaded == 0) continue;
+        if (file->downloaded > last) last = file->downloaded;
+        latencies[count++] = file->downloaded - file->closed;
+        bytes += file->size;
+    }
+    qsort (latencies, count, sizeof(double), pipeline_compare);
+
+    double elapsed = (last > first) ? (last - first) : 1;
+    printf ("cameras=%d hooks=%s written=%d downloaded=%d"
+                " p50=%.3f p90=%.3f max=%.3f files/s=%.1f MB/s=%.2f\n",
+            PipelineCameras, PipelineHooks?"yes":"no",
+            PipelineFilesCount, count,
+            count ? latencies[count / 2] : 0,
+            count ? latencies[(count * 9) / 10] : 0,
+            count ? latencies[count - 1] : 0,
+            count / elapsed, (bytes / elapsed) / (1024 * 1024));
+    free (latencies);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (pipeline_option ("root=", argv[i], &PipelineRoot)) continue;
+        if (pipeline_option ("host=", argv[i], &PipelineHost)) continue;
+        if (pipeline_option ("port=", argv[i], &PipelinePort)) continue;
+        if (pipeline_option ("cameras=", argv[i], &value)) {
+            PipelineCameras = atoi (value);
+        } else if (pipeline_option ("duration=", argv[i], &value)) {
+            PipelineDuration = atoi (value);
+        } else if (pipeline_option ("interval=", argv[i], &value)) {
+            PipelineInterval = atoi (value);
+        } else if (pipeline_option ("pictures=", argv[i], &value)) {
+            PipelinePictures = atoi (value);
+        } else if (pipeline_option ("movie=", argv[i], &value)) {
+            PipelineMovie = atoi (value);
+        } else if (pipeline_option ("hooks=", argv[i], &value)) {
+            PipelineHooks = !strcmp (value, "yes");
+        } else if (pipeline_option ("poll=", argv[i], &value)) {
+            PipelinePoll = atoi (value);
+        } else if (pipeline_option ("drain=", argv[i], &value)) {
+            PipelineDrain = atoi (value);
+        }
+    }
+    if (!PipelineRoot) {
+        fprintf (stderr, "missing --root option\n");
+        return 2;
+    }
+    if (PipelineCameras < 1) PipelineCameras = 1;
+    if (PipelineInterval < 1) PipelineInterval = 1;
+    gethostname (PipelineHostName, sizeof(PipelineHostName));
+
+    PipelineWriting = PipelineCameras;
+    for (i = 0; i < PipelineCameras; ++i) {
+        pthread_t thread;
+        pthread_create (&thread, 0, pipeline_camera, (void *)(long)(i+1));
+        pthread_detach (thread);
+    }
+
+    // Act as the DVR client until everything was downloaded, or else
+    // the drain period expired after the writers stopped.
+    //
+    static char status[4*1024*1024];
+    double deadline = 0;
+    for (;;) {
+        usleep (PipelinePoll * 1000);
+        int waiting = pipeline_poll (status, sizeof(status));
+
+        pthread_mutex_lock (&PipelineLock);
+        int writing = PipelineWriting;
+        pthread_mutex_unlock (&PipelineLock);
+        if (writing > 0) continue;
+
+        if (waiting == 0) break;
+        if (deadline == 0)
+            deadline = housemotion_testhttp_now () + PipelineDrain;
+        else if (housemotion_testhttp_now () > deadline)
+            break;
+    }
+    pipeline_report ();
+    return 0;
+}
@@ -0,0 +1,271 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_replay.c - Replay a traffic captured by HouseMotion.
+ *
+ * SYNOPSYS:
+ *
+ * housemotion_replay [--host=NAME] [--port=INTEGER] [--speed=REAL]
+ *                    [--map=OLD=NEW] [--pid=INTEGER]
+ *                    [--baseline=FILE] [--save=FILE] [--tolerance=INTEGER]
+ *                    CAPTURE
+ *
+ * This program reads a capture file produced by HouseMotion (see the
+ * --motion-capture option) and sends the same requests, with the same
+ * timing, to a test instance of HouseMotion. The timing is accelerated
+ * by the --speed factor (0 means as fast as possible).
+ *
+ * The --map option replaces the production storage root with the test
+ * storage root in the requests (e.g. the Motion file notifications).
+ *
+ * The latency of each request is measured, and the CPU time used by the
+ * test instance is measured if its process ID is provided. The results
+ * can be saved as a baseline, or compared with a previously saved one:
+ * the program exits with status 1 if any result is worse than the
+ * baseline by more than the tolerance (a percentage, default 20).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "housemotion_testhttp.h"
+
+static const char *ReplayHost = "localhost";
+static const char *ReplayPort = "8099";
+static double      ReplaySpeed = 1.0;
+static const char *ReplayMapOld = 0;
+static const char *ReplayMapNew = 0;
+static int         ReplayPid = 0;
+static const char *ReplayBaseline = 0;
+static const char *ReplaySave = 0;
+static int         ReplayTolerance = 20;
+
+static double *Latencies = 0;
+static int     LatenciesCount = 0;
+static int     LatenciesSize = 0;
+static int     ReplayErrors = 0;
+
+#define REPLAY_METRICS 5
+static const char *ReplayMetricNames[REPLAY_METRICS] = {
+    "p50", "p90", "p99", "max", "cpu"
+};
+
+static int replay_option (const char *name, const char *arg,
+                          const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, "--", 2)) return 0;
+    if (strncmp (arg+2, name, length)) return 0;
+    *value = arg + 2 + length;
+    return 1;
+}
+
+// Return the CPU time (user + system) used so far by the test instance.
+//
+static double replay_cpu (void) {
+
+    if (!ReplayPid) return 0;
+
+    char path[64];
+    char buffer[1024];
+    snprintf (path, sizeof(path), "/proc/%d/stat", ReplayPid);
+    FILE *fd = fopen (path, "r");
+    if (!fd) return 0;
+    if (!fgets (buffer, sizeof(buffer), fd)) buffer[0] = 0;
+    fclose (fd);
+
+    // The process name may contain spaces: skip it.
+    char *p = strrchr (buffer, ')');
+    if (!p) return 0;
+    unsigned long long utime, stime;
+    if (sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                &utime, &stime) != 2) return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void replay_map (char *uri, int size) {
+
+    if (!ReplayMapOld) return;
+
+    char *match = strstr (uri, ReplayMapOld);
+    if (!match) return;
+
+    char tail[2048];
+    snprintf (tail, sizeof(tail), "%s", match + strlen(ReplayMapOld));
+    snprintf (match, size - (match - uri), "%s%s", ReplayMapNew, tail);
+}
+
+static void replay_record (double latency) {
+
+    if (LatenciesCount >= LatenciesSize) {
+        LatenciesSize += 1024;
+        Latencies = realloc (Latencies, LatenciesSize * sizeof(double));
+    }
+    Latencies[LatenciesCount++] = latency;
+}
+
+static int replay_compare (const void *a, const void *b) {
+    double delta = *((const double *)a) - *((const double *)b);
+    if (delta < 0) return -1;
+    return delta > 0;
+}
+
+static double replay_percentile (int percent) {
+    if (!LatenciesCount) return 0;
+    int i = (LatenciesCount * percent) / 100;
+    if (i >= LatenciesCount) i = LatenciesCount - 1;
+    return Latencies[i];
+}
+
+static int replay_load_baseline (const char *name, double *metrics) {
+
+    FILE *fd = fopen (name, "r");
+    if (!fd) return 0;
+
+    int i;
+    char key[16];
+    double value;
+    while (fscanf (fd, " %15[a-z0-9]=%lf", key, &value) == 2) {
+        for (i = 0; i < REPLAY_METRICS; ++i) {
+            if (!strcmp (key, ReplayMetricNames[i])) metrics[i] = value;
+        }
+    }
+    fclose (fd);
+    return 1;
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *capture = 0;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (replay_option ("host=", argv[i], &ReplayHost)) continue;
+        if (replay_option ("port=", argv[i], &ReplayPort)) continue;
+        if (replay_option ("speed=", argv[i], &value)) {
+            ReplaySpeed = atof (value);
+            continue;
+        }
+        if (replay_option ("map=", argv[i], &value)) {
+            const char *sep = strchr (value, '=');
+            if (sep) {
+                ReplayMapOld = strndup (value, sep - value);
+                ReplayMapNew = sep + 1;
+            }
+            continue;
+        }
+        if (replay_option ("pid=", argv[i], &value)) {
+            ReplayPid = atoi (value);
+            continue;
+        }
+        if (replay_option ("baseline=", argv[i], &ReplayBaseline)) continue;
+        if (replay_option ("save=", argv[i], &ReplaySave)) continue;
+        if (replay_option ("tolerance=", argv[i], &value)) {
+            ReplayTolerance = atoi (value);
+            continue;
+        }
+        capture = argv[i];
+    }
+    if (!capture) {
+        fprintf (stderr, "missing capture file\n");
+        return 2;
+    }
+    FILE *fd = fopen (capture, "r");
+    if (!fd) {
+        fprintf (stderr, "cannot open %s\n", capture);
+        return 2;
+    }
+
+    double cpu = replay_cpu ();
+    double start = housemotion_testhttp_now ();
+    double origin = 0;
+    char line[4096];
+
+    while (fgets (line, sizeof(line), fd)) {
+        double timestamp;
+        char method[16];
+        char uri[2048];
+        if (sscanf (line, "%lf %15s %2047s", &timestamp, method, uri) != 3)
+            continue;
+        if (origin == 0) origin = timestamp;
+
+        if (ReplaySpeed > 0) {
+            double delay = start + ((timestamp - origin) / ReplaySpeed)
+                                 - housemotion_testhttp_now ();
+            if (delay > 0) usleep ((useconds_t)(delay * 1000000));
+        }
+        replay_map (uri, sizeof(uri));
+
+        double sent = housemotion_testhttp_now ();
+        int status = housemotion_testhttp (ReplayHost, ReplayPort,
+                                           method, uri, 0, 0, 0);
+        replay_record (housemotion_testhttp_now () - sent);
+        if ((status < 200) || (status >= 500)) ReplayErrors += 1;
+    }
+    fclose (fd);
+
+    double metrics[REPLAY_METRICS];
+    qsort (Latencies, LatenciesCount, sizeof(double), replay_compare);
+    metrics[0] = replay_percentile (50) * 1000;
+    metrics[1] = replay_percentile (90) * 1000;
+    metrics[2] = replay_percentile (99) * 1000;
+    metrics[3] = LatenciesCount ? Latencies[LatenciesCount-1] * 1000 : 0;
+    metrics[4] = replay_cpu () - cpu;
+
+    printf ("requests=%d errors=%d duration=%.3f",
+            LatenciesCount, ReplayErrors, housemotion_testhttp_now () - start);
+    for (i = 0; i < REPLAY_METRICS; ++i) {
+        printf (" %s=%.3f", ReplayMetricNames[i], metrics[i]);
+    }
+    printf ("\n");
+
+    if (ReplaySave) {
+        FILE *out = fopen (ReplaySave, "w");
+        if (out) {
+            for (i = 0; i < REPLAY_METRICS; ++i) {
+                fprintf (out, "%s=%.3f\n", ReplayMetricNames[i], metrics[i]);
+            }
+            fclose (out);
+        }
+    }
+
+    int regression = 0;
+    if (ReplayBaseline) {
+        double baseline[REPLAY_METRICS];
+        for (i = 0; i < REPLAY_METRICS; ++i) baseline[i] = 0;
+        if (!replay_load_baseline (ReplayBaseline, baseline)) {
+            fprintf (stderr, "cannot open %s\n", ReplayBaseline);
+            return 2;
+        }
+        for (i = 0; i < REPLAY_METRICS; ++i) {
+            if (baseline[i] <= 0) continue;
+            double limit = baseline[i] * (100 + ReplayTolerance) / 100;
+            if (metrics[i] > limit) {
+                printf ("REGRESSION %s: %.3f (baseline %.3f)\n",
+                        ReplayMetricNames[i], metrics[i], baseline[i]);
+                regression = 1;
+            }
+        }
+    }
+    return regression;
+}
@@ -0,0 +1,428 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ *
+ * housemotion_stress.c - A stress test of the storage cleanup.
+ *
+ * SYNOPSYS:
+ *
+ * housemotion_stress --root=DIRECTORY [--host=NAME] [--port=INTEGER]
+ *                    [--cameras=INTEGER] [--downloaders=INTEGER]
+ *                    [--duration=SECONDS] [--movie=KB] [--pictures=INTEGER]
+ *                    [--day=SECONDS] [--poll=MS] [--pause=MS]
+ *
+ * This program writes recordings continuously to a small volume that is
+ * kept near its cleanup threshold, while other threads download these
+ * recordings, so that the HouseMotion cleanup runs concurrently with
+ * both. The simulated date advances by one day every --day seconds, so
+ * that new day directories are created while the cleanup removes the
+ * old ones.
+ *
+ * Each camera writes one event (a movie and --pictures pictures) in about
+ * half a second, then pauses for --pause milliseconds. The defaults (two
+ * cameras, 1 MB movies, no pause) write about 4 events, 20 files and
+ * 4.5 MB per second, more than the normal HouseMotion cleanup removes
+ * (one event per second): the storage then reaches the critical level,
+ * and the emergency mode must prevent the volume from becoming full. A
+ * --pause of 1000 with one camera (about 0.7 event per second) stays
+ * within the normal cleanup rate.
+ *
+ * A camera that fails to write because the volume is full waits 100
+ * milliseconds before its next event, as Motion would not record faster.
+ *
+ * The test reports the cleanup throughput, the peak disk usage and the
+ * HTTP latency, and fails if a race is detected:
+ *
+ * - a file was deleted while it was still being written,
+ * - a download returned less data than the listed size,
+ * - a day directory was removed between its creation and the creation
+ *   of the first file in it,
+ * - the volume became full (Motion would have lost a recording).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "housemotion_testhttp.h"
+
+static const char *StressRoot = 0;
+static const char *StressHost = "localhost";
+static const char *StressPort = "8099";
+static int         StressCameras = 2;
+static int         StressDownloaders = 2;
+static int         StressDuration = 120;
+static int         StressMovie = 1024;
+static int         StressPictures = 4;
+static int         StressDay = 30;
+static int         StressPoll = 500;
+static int         StressPause = 0;
+
+static double StressStart = 0;
+static time_t StressEpoch = 0;
+static double StressEnd = 0;
+
+static pthread_mutex_t StressLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long StressFilesWritten = 0;
+static long long StressBytesWritten = 0;
+static long long StressDownloads = 0;
+static long long StressBytesDownloaded = 0;
+static long long StressVanished = 0;   // Listed, then cleaned up: expected.
+static long long StressRejected = 0;   // 503 from the admission control.
+static long long StressDeletedWhileWritten = 0;
+static long long StressTruncated = 0;
+static long long StressDirectoryRaces = 0;
+static long long StressFull = 0;
+static int       StressPeakUsage = 0;
+
+#define STRESS_LATENCY_MAX 100000
+static double *StressLatencies = 0;
+static int     StressLatencyCount = 0;
+
+static int stress_option (const char *name, const char *arg,
+                          const char **value) {
+    int length = strlen(name);
+    if (strncmp (arg, "--", 2)) return 0;
+    if (strncmp (arg+2, name, length)) return 0;
+    *value = arg + 2 + length;
+    return 1;
+}
+
+static void stress_count (long long *counter, long long value) {
+    pthread_mutex_lock (&StressLock);
+    *counter += value;
+    pthread_mutex_unlock (&StressLock);
+}
+
+static int stress_request (const char *uri, char *buffer, int size,
+                           long long *length) {
+    double start = housemotion_testhttp_now ();
+    int code = housemotion_testhttp (StressHost, StressPort,
+                                     "GET", uri, buffer, size, length);
+    double latency = housemotion_testhttp_now () - start;
+    pthread_mutex_lock (&StressLock);
+    if (StressLatencyCount < STRESS_LATENCY_MAX)
+        StressLatencies[StressLatencyCount++] = latency;
+    pthread_mutex_unlock (&StressLock);
+    if (code == 503) stress_count (&StressRejected, 1);
+    return code;
+}
+
+// Write a whole file, and verify that it was not deleted before it was
+// closed. Return 0 on success.
+//
+static int stress_write (int fd, int size) {
+    static char data[8192];
+    while (size > 0) {
+        int n = (size > sizeof(data)) ? sizeof(data) : size;
+        if (write (fd, data, n) != n) {
+            if (errno == ENOSPC) stress_count (&StressFull, 1);
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+static void stress_close (int fd, long long size) {
+    struct stat filestat;
+    if ((!fstat (fd, &filestat)) && (filestat.st_nlink == 0))
+        stress_count (&StressDeletedWhileWritten, 1);
+    close (fd);
+    pthread_mutex_lock (&StressLock);
+    StressFilesWritten += 1;
+    StressBytesWritten += size;
+    pthread_mutex_unlock (&StressLock);
+}
+
+// The simulated date advances one day every StressDay seconds.
+//
+static void stress_day (char *buffer, int size) {
+    time_t now = time(0);
+    time_t simulated = now + ((now - StressEpoch) / StressDay) * 86400;
+    struct tm local = *localtime (&simulated);
+    snprintf (buffer, size, "%04d/%02d/%02d",
+              local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+}
+
+static int stress_create (const char *day, const char *name) {
+
+    char path[1024];
+    snprintf (path, sizeof(path), "%s/%s", StressRoot, day);
+    char *sep;
+    for (sep = strchr (path + strlen(StressRoot) + 1, '/'); sep;
+         sep = strchr (sep + 1, '/')) {
+        *sep = 0;
+        mkdir (path, 0755);
+        *sep = '/';
+    }
+    if (mkdir (path, 0755) && (errno == ENOSPC)) {
+        // The directory could not be created: this is not a race.
+        stress_count (&StressFull, 1);
+        return -1;
+    }
+
+    snprintf (path, sizeof(path), "%s/%s/%s", StressRoot, day, name);
+    int fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            // The directory was removed right after being created.
+            stress_count (&StressDirectoryRaces, 1);
+        } else if (errno == ENOSPC) {
+            stress_count (&StressFull, 1);
+        }
+    }
+    return fd;
+}
+
+static void *stress_camera (void *context) {
+
+    long id = (long)context;
+    int sequence = 1;
+    char day[64];
+    char name[256];
+
+    while (housemotion_testhttp_now () < StressEnd) {
+
+        stress_day (day, sizeof(day));
+        time_t now = time(0);
+        struct tm local = *localtime (&now);
+        char event[128];
+        snprintf (event, sizeof(event), "%02d:%02d:%02d-stress:%ld:%d",
+                  local.tm_hour, local.tm_min, local.tm_sec, id, sequence++);
+
+        snprintf (name, sizeof(name), "%s.mkv", event);
+        int movie = stress_create (day, name);
+        if (movie < 0) {
+            usleep (100000);
+            continue;
+        }
+        int chunk = (StressMovie * 1024) / (StressPictures + 1);
+        long long written = 0;
+        int failed = 0;
+        int i;
+        for (i = 0; i <= StressPictures; ++i) {
+            if (stress_write (movie, chunk)) {
+                failed = 1;
+                break;
+            }
+            written += chunk;
+            usleep (100000);
+            if (i >= StressPictures) break;
+
+            snprintf (name, sizeof(name), "%s-%02d.jpg", event, i);
+            int fd = stress_create (day, name);
+            if (fd < 0) continue;
+            if (!stress_write (fd, 32 * 1024)) stress_close (fd, 32 * 1024);
+            else close (fd);
+        }
+        // Only the data actually written is accounted for: a full volume
+        // is reported separately. Like Motion, do not retry at once on a
+        // full volume.
+        stress_close (movie, written);
+        usleep ((failed ? 100 : StressPause) * 1000);
+    }
+    return 0;
+}
+
+static void *stress_downloader (void *context) {
+
+    char buffer[256*1024];
+
+    while (housemotion_testhttp_now () < StressEnd) {
+        usleep (StressPoll * 1000);
+
+        if (stress_request ("/cctv/recordings?order=asc&count=200",
+                            buffer, sizeof(buffer), 0) != 200)
+            continue;
+
+        char *cursor = strstr (buffer, "\"recordings\":[");
+        if (!cursor) continue;
+        cursor += 14;
+
+        // Download the oldest stable files: these are the ones most at
+        // risk of being deleted by the cleanup.
+        while (*cursor == '[') {
+            long long mtime, size;
+            char path[512];
+            char stable[8];
+            if ((sscanf (cursor, "[%lld,\"%511[^\"]\",%lld,%7[a-z]",
+                         &mtime, path, &size, stable) == 4) &&
+                (!strcmp (stable, "true"))) {
+                char uri[1024];
+                long long length;
+                snprintf (uri, sizeof(uri), "/cctv/recording/%s", path);
+                int code = stress_request (uri, 0, 0, &length);
+                if (code == 200) {
+                    stress_count (&StressDownloads, 1);
+                    stress_count (&StressBytesDownloaded, length);
+                    if (length < size) stress_count (&StressTruncated, 1);
+                } else if (code == 404) {
+                    stress_count (&StressVanished, 1);
+                }
+            }
+            cursor = strchr (cursor, ']');
+            if (!cursor) break;
+            cursor += 1;
+            if (*cursor == ',') cursor += 1;
+            if (housemotion_testhttp_now () >= StressEnd) break;
+        }
+    }
+    return 0;
+}
+
+static long long stress_used (void) {
+    struct statvfs fs;
+    if (statvfs (StressRoot, &fs)) return 0;
+    long long total = (long long)(fs.f_blocks) * fs.f_frsize;
+    long long available = (long long)(fs.f_bavail) * fs.f_bsize;
+    int usage = total ? (int)(((total - available) * 100) / total) : 0;
+    if (usage > StressPeakUsage) StressPeakUsage = usage;
+    return total - available;
+}
+
+static long long stress_files (const char *path) {
+    long long count = 0;
+    DIR *handle = opendir (path);
+    if (!handle) return 0;
+    struct dirent *p;
+    while ((p = readdir (handle)) != 0) {
+        if (p->d_name[0] == '.') continue;
+        if (p->d_type == DT_DIR) {
+            char sub[1024];
+            snprintf (sub, sizeof(sub), "%s/%s", path, p->d_name);
+            count += stress_files (sub);
+        } else if (p->d_type == DT_REG) {
+            count += 1;
+        }
+    }
+    closedir (handle);
+    return count;
+}
+
+static int stress_compare (const void *a, const void *b) {
+    double delta = *((const double *)a) - *((const double *)b);
+    if (delta < 0) return -1;
+    return delta > 0;
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (stress_option ("root=", argv[i], &StressRoot)) continue;
+        if (stress_option ("host=", argv[i], &StressHost)) continue;
+        if (stress_option ("port=", argv[i], &StressPort)) continue;
+        if (stress_option ("cameras=", argv[i], &value)) {
+            StressCameras = atoi (value);
+        } else if (stress_option ("downloaders=", argv[i], &value)) {
+            StressDownloaders = atoi (value);
+        } else if (stress_option ("duration=", argv[i], &value)) {
+            StressDuration = atoi (value);
+        } else if (stress_option ("movie=", argv[i], &value)) {
+            StressMovie = atoi (value);
+        } else if (stress_option ("pictures=", argv[i], &value)) {
+            StressPictures = atoi (value);
+        } else if (stress_option ("day=", argv[i], &value)) {
+            StressDay = atoi (value);
+        } else if (stress_option ("poll=", argv[i], &value)) {
+            StressPoll = atoi (value);
+        } else if (stress_option ("pause=", argv[i], &value)) {
+            StressPause = atoi (value);
+        }
+    }
+    if (!StressRoot) {
+        fprintf (stderr, "missing --root option\n");
+        return 2;
+    }
+    if (StressCameras < 1) StressCameras = 1;
+    if (StressDay < 1) StressDay = 1;
+    if (StressPause < 0) StressPause = 0;
+    StressLatencies = calloc (STRESS_LATENCY_MAX, sizeof(double));
+
+    long long initial = stress_used ();
+    StressStart = housemotion_testhttp_now ();
+    StressEpoch = time(0);
+    StressEnd = StressStart + StressDuration;
+
+    for (i = 0; i < StressCameras; ++i) {
+        pthread_t thread;
+        pthread_create (&thread, 0, stress_camera, (void *)(long)(i+1));
+        pthread_detach (thread);
+    }
+    for (i = 0; i < StressDownloaders; ++i) {
+        pthread_t thread;
+        pthread_create (&thread, 0, stress_downloader, 0);
+        pthread_detach (thread);
+    }
+
+    // Monitor the disk usage while the test is running.
+    while (housemotion_testhttp_now () < StressEnd) {
+        usleep (200000);
+        stress_used ();
+    }
+    sleep (2); // Let the threads finish their current file.
+
+    pthread_mutex_lock (&StressLock);
+    double elapsed = housemotion_testhttp_now () - StressStart;
+    long long present = stress_files (StressRoot);
+    long long used = stress_used () - initial;
+    long long deletedfiles = StressFilesWritten - present;
+    long long deletedbytes = StressBytesWritten - used;
+    if (deletedbytes < 0) deletedbytes = 0;
+
+    qsort (StressLatencies, StressLatencyCount, sizeof(double), stress_compare);
+    int n = StressLatencyCount;
+
+    printf ("written=%lld files (%.1f MB) cleaned=%lld files (%.2f MB/s)"
+                " peak=%d%%\n",
+            StressFilesWritten, StressBytesWritten / (1024.0 * 1024),
+            deletedfiles, (deletedbytes / elapsed) / (1024 * 1024),
+            StressPeakUsage);
+    printf ("downloads=%lld (%.1f MB) vanished=%lld rejected=%lld"
+                " http p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+            StressDownloads, StressBytesDownloaded / (1024.0 * 1024),
+            StressVanished, StressRejected,
+            n ? StressLatencies[n / 2] : 0,
+            n ? StressLatencies[(n * 9) / 10] : 0,
+            n ? StressLatencies[(n * 99) / 100] : 0,
+            n ? StressLatencies[n - 1] : 0);
+    printf ("races: deleted-while-written=%lld truncated=%lld"
+                " directory=%lld full=%lld\n",
+            StressDeletedWhileWritten, StressTruncated,
+            StressDirectoryRaces, StressFull);
+    int failed = StressDeletedWhileWritten || StressTruncated ||
+                 StressDirectoryRaces || StressFull;
+    pthread_mutex_unlock (&StressLock);
+
+    printf ("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+/* HouseMotion - a web server to handle videos files from Motion.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housemotion_testhttp.c - A minimal HTTP client for the test tools.
+ *
+ * SYNOPSYS:
+ *
+ * int housemotion_testhttp (const char *host, const char *port,
+ *                           const char *method, const char *uri,
+ *                           char *buffer, int size, long long *length);
+ *
+ *    Send one request (one connection per request) and wait for the
+ *    complete response. The response content is copied to the buffer
+ *    (if any), up to its size, and null terminated. The length of the
+ *    whole content is returned in length (if not null). Return the HTTP
+ *    status code, or -1 if the request failed.
+ *
+ * double housemotion_testhttp_now (void);
+ *
+ *    Return a monotonic time in seconds, used for latency measurements.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "housemotion_testhttp.h"
+
+double housemotion_testhttp_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+int housemotion_testhttp (const char *host, const char *port,
+                          const char *method, const char *uri,
+                          char *buffer, int size, long long *length) {
+
+    struct addrinfo hints;
+    struct addrinfo *server;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (host, port, &hints, &server)) return -1;
+
+    int s = socket (server->ai_family, server->ai_socktype, 0);
+    if (s < 0) {
+        freeaddrinfo (server);
+        return -1;
+    }
+    if (connect (s, server->ai_addr, server->ai_addrlen)) {
+        freeaddrinfo (server);
+        close (s);
+        return -1;
+    }
+    freeaddrinfo (server);
+
+    char request[4096];
+    int requestlength = snprintf (request, sizeof(request),
+                                  "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                                      "Connection: close\r\n\r\n",
+                                  method, uri, host);
+    if (write (s, request, requestlength) != requestlength) {
+        close (s);
+        return -1;
+    }
+
+    // Read the whole response. Only the start of the response (status
+    // line and HTTP header) is kept aside, to find the content.
+    //
+    char header[8192];
+    int headerlength = 0;
+    char *content = 0;
+    long long total = 0;
+    int copied = 0;
+    int status = -1;
+    char chunk[65536];
+    int received;
+
+    while ((received = read (s, chunk, sizeof(chunk))) > 0) {
+        char *data = chunk;
+        if (!content) {
+            int room = sizeof(header) - 1 - headerlength;
+            int n = (received < room) ? received : room;
+            memcpy (header + headerlength, chunk, n);
+            headerlength += n;
+            header[headerlength] = 0;
+            content = strstr (header, "\r\n\r\n");
+            if (!content) continue;
+            content += 4;
+            if (!strncmp (header, "HTTP/", 5)) {
+                char *code = strchr (header, ' ');
+                if (code) status = atoi (code+1);
+            }
+            // Skip the HTTP header in the data just received.
+            int skip = (content - header) - (headerlength - n);
+            data = chunk + skip;
+            received -= skip;
+        }
+        if (buffer && (copied < size - 1)) {
+            int n = size - 1 - copied;
+            if (n > received) n = received;
+            memcpy (buffer + copied, data, n);
+            copied += n;
+        }
+        total += received;
+    }
+    close (s);
+    if (buffer && (size > 0)) buffer[copied] = 0;
+    if (length) *length = total;
+    return status;
+}
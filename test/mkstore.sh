@@ -0,0 +1,30 @@
+#!/bin/bash
+# Create a synthetic Motion storage, for testing and benchmarking.
+#
+# Usage: mkstore.sh DIRECTORY [DAYS [FILES [CAMERAS]]]
+#
+# This creates DAYS days of recordings (year/month/day directories), with
+# FILES small picture files per day, spread over CAMERAS cameras. The file
+# names follow the format recommended in the README file, and the files
+# modification times match their names.
+#
+root=$1
+days=${2:-7}
+files=${3:-500}
+cameras=${4:-4}
+if [ "x$root" = "x" ] ; then echo "Usage: $0 DIRECTORY [DAYS [FILES [CAMERAS]]]" ; exit 1 ; fi
+
+host=`hostname`
+now=`date +%s`
+for day in `seq $days -1 1` ; do
+   base=$((now - (day * 86400)))
+   dir=$root/`date -d @$base +%Y/%m/%d`
+   mkdir -p $dir
+   for i in `seq 1 $files` ; do
+      stamp=$((base + (i * 86400 / files)))
+      camera=$(( (i % cameras) + 1 ))
+      name=$dir/`date -d @$stamp +%H:%M:%S`-$host:$camera:$i.jpg
+      head -c $((1024 + (i % 16) * 1024)) /dev/zero > $name
+      touch -d @$stamp $name
+   done
+done
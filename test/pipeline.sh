@@ -0,0 +1,29 @@
+#!/bin/bash
+# Run the end-to-end pipeline benchmark against a test instance.
+#
+# Usage: pipeline.sh [housemotion_pipeline options]
+#
+# The benchmark is run with 1, 8 and 32 simulated cameras, first with
+# the Motion hooks (event end and file notifications) and then without,
+# where HouseMotion relies on its 60 seconds heuristic. Each run uses
+# a new empty storage.
+#
+cd `dirname $0`
+if [ ! -x ./housemotion_pipeline ] ; then make -C .. tools || exit 1 ; fi
+
+port=${PORT:-8099}
+root=${ROOT:-/tmp/housemotion-pipeline}
+
+for hooks in yes no ; do
+   for cameras in 1 8 32 ; do
+      rm -rf $root
+      mkdir -p $root/store
+      echo "target_dir $root/store" > $root/motion.conf
+      ../housemotion --http-service=$port --motion-conf=$root/motion.conf &
+      pid=$!
+      sleep 2
+      ./housemotion_pipeline --port=$port --root=$root/store --cameras=$cameras --hooks=$hooks "$@"
+      kill $pid
+      wait $pid 2> /dev/null
+   done
+done
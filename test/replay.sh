@@ -0,0 +1,47 @@
+#!/bin/bash
+# Replay a traffic capture against a test instance of HouseMotion.
+#
+# Usage: replay.sh CAPTURE [housemotion_replay options]
+#
+# The test instance uses a synthetic storage (see mkstore.sh). The size
+# of this storage can be adjusted using the DAYS, FILES and CAMERAS
+# environment variables. The storage root used in production (default:
+# /videos) is mapped to the synthetic storage.
+#
+capture=$1
+shift
+if [ "x$capture" = "x" ] ; then echo "Usage: $0 CAPTURE [options]" ; exit 1 ; fi
+
+# The file names are relative to the caller's directory, not to test/.
+absolute () {
+   case "$1" in
+      /*) echo "$1" ;;
+      *) echo "$PWD/$1" ;;
+   esac
+}
+capture=`absolute $capture`
+options=()
+for option in "$@" ; do
+   case "$option" in
+      --save=*) options+=("--save=`absolute ${option#--save=}`") ;;
+      --baseline=*) options+=("--baseline=`absolute ${option#--baseline=}`") ;;
+      *) options+=("$option") ;;
+   esac
+done
+cd `dirname $0`
+
+port=${PORT:-8099}
+root=${ROOT:-/tmp/housemotion-replay}
+if [ ! -x ./housemotion_replay ] ; then make -C .. tools || exit 1 ; fi
+if [ ! -d $root/store ] ; then
+   ./mkstore.sh $root/store ${DAYS:-7} ${FILES:-500} ${CAMERAS:-4}
+fi
+echo "target_dir $root/store" > $root/motion.conf
+
+../housemotion --http-service=$port --motion-conf=$root/motion.conf &
+pid=$!
+sleep 2
+./housemotion_replay --port=$port --pid=$pid --map=${STORE:-/videos}=$root/store "${options[@]}" $capture
+status=$?
+kill $pid
+exit $status
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Stress the storage cleanup with concurrent writes and downloads.
+#
+# Usage: stress.sh [housemotion_stress options]
+#
+# The test runs on a small tmpfs volume (SIZE, default 256m), so that the
+# cleanup threshold (CLEAN, default 70%) is reached quickly. Mounting the
+# volume requires root access: as an alternative, an existing small
+# volume can be provided using the STORE environment variable.
+#
+# With the default options, the writers exceed the rate that the normal
+# cleanup sustains, which exercises the emergency mode. A much smaller
+# volume fills up between two checks of the storage space. The options
+# --cameras=1 --pause=1000 stay within the normal cleanup rate.
+#
+cd `dirname $0`
+if [ ! -x ./housemotion_stress ] ; then make -C .. tools || exit 1 ; fi
+
+port=${PORT:-8099}
+root=${ROOT:-/tmp/housemotion-stress}
+store=${STORE:-$root/store}
+
+mkdir -p $root $store
+mounted=no
+if [ "x$STORE" = "x" ] ; then
+   if [ `id -u` != 0 ] ; then echo "Mounting a tmpfs requires root, or set STORE" ; exit 1 ; fi
+   mount -t tmpfs -o size=${SIZE:-256m} housemotion-stress $store || exit 1
+   mounted=yes
+fi
+echo "target_dir $store" > $root/motion.conf
+
+../housemotion --http-service=$port --motion-conf=$root/motion.conf --motion-clean=${CLEAN:-70} &
+pid=$!
+sleep 2
+./housemotion_stress --port=$port --root=$store "$@"
+status=$?
+kill $pid
+wait $pid 2> /dev/null
+
+if [ $mounted = yes ] ; then umount $store ; fi
+exit $status